@@ -0,0 +1,163 @@
+#include <util.h>
+#include <hittable.h>
+#include <hittable-list.h>
+#include <sphere.h>
+#include <material.h>
+#include <bvh.h>
+#include <sphere-set.h>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+ * Compares closest-hit throughput of the flat hittable_list, the bvh over sphere objects, and the structure-of-arrays
+ * sphere_set (with both its scalar and SIMD leaf kernels).
+ *
+ * Scenes are the sphere field from main.cxx viewed from its camera position, and randomly placed spheres at a few
+ * sizes with the sphere density kept constant, so that only the object count changes between runs. Every structure
+ * is fed the same rays, and the number of hits and sum of hit distances are checked to agree.
+ */
+
+struct bench_result {
+    double seconds;
+    long long hits;
+    double t_sum;
+};
+
+static bench_result trace_all(const hittable& world, const std::vector<ray>& rays) {
+    bench_result result{0, 0, 0};
+    hit_record rec;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto& r : rays) {
+        if (world.hit(r, interval(0.001, infinity), rec)) {
+            result.hits++;
+            result.t_sum += rec.t;
+        }
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    result.seconds = std::chrono::duration<double>(stop - start).count();
+    return result;
+}
+
+static bool agrees(const bench_result& a, const bench_result& b) {
+    return a.hits == b.hits && std::fabs(a.t_sum - b.t_sum) <= 1e-6 * std::fabs(a.t_sum);
+}
+
+struct bench_scene {
+    std::string name;
+    std::vector<point3> centers;
+    std::vector<double> radii;
+    std::vector<ray> rays;
+};
+
+// The sphere field from main.cxx, with rays leaving the camera position towards the field
+static bench_scene sphere_field(std::mt19937& rng, int ray_count) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    bench_scene scene{"main.cxx field", {}, {}, {}};
+
+    scene.centers.push_back(point3(0, -1000, 0));
+    scene.radii.push_back(1000);
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            point3 center(a + 0.9 * uniform(rng), 0.2, b + 0.9 * uniform(rng));
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                scene.centers.push_back(center);
+                scene.radii.push_back(0.2);
+            }
+        }
+    }
+    for (auto center : { point3(0, 1, 0), point3(-4, 1, 0), point3(4, 1, 0) }) {
+        scene.centers.push_back(center);
+        scene.radii.push_back(1.0);
+    }
+
+    point3 lookfrom(13, 2, 3);
+    for (int i = 0; i < ray_count; i++) {
+        point3 target(22 * uniform(rng) - 11, 3 * uniform(rng) - 0.5, 22 * uniform(rng) - 11);
+        scene.rays.push_back(ray(lookfrom, target - lookfrom));
+    }
+    return scene;
+}
+
+static bench_scene random_spheres(std::mt19937& rng, int n, int ray_count) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    bench_scene scene{std::to_string(n) + " random", {}, {}, {}};
+    double side = 2.0 * std::cbrt(double(n));
+
+    for (int i = 0; i < n; i++) {
+        scene.centers.push_back(point3(side * uniform(rng), side * uniform(rng), side * uniform(rng)));
+        scene.radii.push_back(0.2 + 0.3 * uniform(rng));
+    }
+
+    for (int i = 0; i < ray_count; i++) {
+        point3 origin(side * uniform(rng), side * uniform(rng), side * uniform(rng));
+        vec3 direction(uniform(rng) - 0.5, uniform(rng) - 0.5, uniform(rng) - 0.5);
+        scene.rays.push_back(ray(origin, direction));
+    }
+    return scene;
+}
+
+int main() {
+    const int ray_count = 200000;
+
+    // The flat list is too slow to trace every ray at large sizes, so it gets a budget of sphere tests instead
+    const long long list_test_budget = 400000000;
+
+    std::mt19937 rng(1234);
+    auto mat = make_shared<material>(lambertian(color(0.5, 0.5, 0.5)));
+
+    std::vector<bench_scene> scenes;
+    scenes.push_back(sphere_field(rng, ray_count));
+    for (int n : { 500, 10000, 100000 }) scenes.push_back(random_spheres(rng, n, ray_count));
+
+    std::printf("%-16s %10s %14s %14s %14s %14s %12s\n",
+        "scene", "spheres", "list rays/s", "bvh rays/s", "soa rays/s", "simd rays/s", "build (ms)");
+
+    for (const auto& scene : scenes) {
+        int n = int(scene.centers.size());
+
+        hittable_list list;
+        sphere_set set;
+        for (int i = 0; i < n; i++) {
+            list.add(make_shared<sphere>(scene.centers[i], scene.radii[i], mat));
+            set.add(scene.centers[i], scene.radii[i], mat);
+        }
+
+        auto build_start = std::chrono::high_resolution_clock::now();
+        bvh tree(list);
+        auto build_stop = std::chrono::high_resolution_clock::now();
+        double build_ms = std::chrono::duration<double, std::milli>(build_stop - build_start).count();
+
+        set.build();
+
+        size_t list_rays = std::min<size_t>(scene.rays.size(), size_t(list_test_budget / n));
+        std::vector<ray> list_subset(scene.rays.begin(), scene.rays.begin() + list_rays);
+
+        auto list_result = trace_all(list, list_subset);
+        auto bvh_subset = trace_all(tree, list_subset);
+        auto bvh_result = trace_all(tree, scene.rays);
+
+        set.use_simd = false;
+        auto soa_result = trace_all(set, scene.rays);
+        set.use_simd = sphere_set::simd_supported();
+        auto simd_result = trace_all(set, scene.rays);
+
+        if (!agrees(list_result, bvh_subset) || !agrees(bvh_result, soa_result) || !agrees(bvh_result, simd_result)) {
+            std::fprintf(stderr, "Mismatch on %s: bvh found %lld hits, soa %lld, simd %lld\n",
+                scene.name.c_str(), bvh_result.hits, soa_result.hits, simd_result.hits);
+            return 1;
+        }
+
+        double rays = double(scene.rays.size());
+        std::printf("%-16s %10d %14.0f %14.0f %14.0f %14.0f %12.2f\n", scene.name.c_str(), n,
+            list_rays / list_result.seconds, rays / bvh_result.seconds,
+            rays / soa_result.seconds, rays / simd_result.seconds, build_ms);
+    }
+
+    if (!sphere_set::simd_supported()) std::printf("\nAVX2 is not supported on this CPU, simd column uses the scalar kernel\n");
+}
@@ -0,0 +1,446 @@
+#include <util.h>
+#include <camera.h>
+#include <scene.h>
+#include <sphere-set.h>
+#include <triangle-mesh.h>
+#include <instance.h>
+#include <image-writer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <thread>
+#include <vector>
+
+/*
+ * End-to-end render benchmark.
+ *
+ * Renders a fixed set of canonical scenes at fixed seeds, with the single threaded renderer, and with the thread pool
+ * at increasing thread counts both tile by tile and with the wavefront integrator (which is expected to be the slower
+ * of the two, see camera::wavefront_render). It reports for each run:
+ *
+ *  - the time of each phase: building the scene's acceleration structures, rendering, and encoding the image as PNG
+ *  - camera samples per second, and rays per second (every bounce of every path, and every shadow ray, counts as one ray)
+ *  - the speedup and parallel efficiency over the single threaded render, giving the thread scaling curve
+ *
+ * Results are printed as a table, or as JSON with --json so that runs of different versions can be compared by a
+ * script. The same seed always gives the same image, so differing sample or ray counts between versions mean the
+ * renderer's output changed, not just its speed.
+ *
+ * The benchmark is built twice, as bench with double precision geometry and as bench_float with single precision
+ * (see real in util.h). --save-images writes every scene's image to a directory as PFM, and --reference compares the
+ * images against those saved by another build: running bench --save-images and then bench_float --reference on the
+ * same directory gives the image difference that goes with the float build's speedup.
+ *
+ * Usage: bench [--json] [--quick] [--threads 1,2,4,...] [--scene name] [--save-images dir] [--reference dir]
+ */
+
+struct bench_options {
+    bool json = false;
+    bool quick = false;
+    std::vector<int> threads;
+    std::string scene_filter;
+    std::string save_images;
+    std::string reference;
+};
+
+struct bench_scene {
+    std::string name;
+    long long primitives = 0;
+    double build_ms = 0;
+    camera cam;
+    hittable_list world;
+    std::unique_ptr<scene> owner;                   // Owns the materials of scenes built from a scene_description
+    std::vector<shared_ptr<material>> materials;    // Otherwise, materials referenced by raw pointer
+};
+
+struct bench_run {
+    std::string backend;
+    int threads;
+    double render_s;
+    double encode_ms;
+    long long samples;
+    long long rays;
+    image output;
+};
+
+// How far an image is from a reference: root mean square difference and mean difference (bias) of the linear
+// values clamped to [0, 1], and the peak signal to noise ratio of the 8-bit display values
+struct image_difference {
+    double rmse = 0;
+    double bias = 0;
+    double psnr_db = 0;
+};
+
+static const char* precision_name() {
+    return sizeof(real) == sizeof(float) ? "float" : "double";
+}
+
+// File name for a scene's image, e.g. "field-11-double.pfm"
+static std::string image_file(const std::string& dir, const std::string& scene_name, const char* precision) {
+    std::string name = scene_name;
+    for (char& c : name) if (c == ' ') c = '-';
+    return dir + "/" + name + "-" + precision + ".pfm";
+}
+
+// Reads a PFM written by encode_pfm. Throws std::runtime_error if it is missing or not in that form
+static image read_pfm(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int width = 0, height = 0;
+    double scale = 0;
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0 || scale >= 0)
+        throw std::runtime_error("'" + path + "' is not a little endian colour PFM");
+    in.get();
+
+    image result(width, height);
+    std::vector<float> row((size_t)width * 3);
+    for (int j = height - 1; j >= 0; j--) {
+        if (!in.read(reinterpret_cast<char*>(row.data()), std::streamsize(row.size() * sizeof(float))))
+            throw std::runtime_error("'" + path + "' is truncated");
+        for (int i = 0; i < width; i++) result.at(i, j) = color(row[3 * i], row[3 * i + 1], row[3 * i + 2]);
+    }
+    return result;
+}
+
+static image_difference compare(const image& a, const image& reference) {
+    if (a.width != reference.width || a.height != reference.height)
+        throw std::runtime_error("Reference image has a different size");
+
+    double squared = 0, sum = 0, byte_squared = 0;
+    for (size_t k = 0; k < a.pixels.size(); k++) {
+        for (int c = 0; c < 3; c++) {
+            double x = std::clamp(double(a.pixels[k][c]), 0.0, 1.0);
+            double y = std::clamp(double(reference.pixels[k][c]), 0.0, 1.0);
+            squared += (x - y) * (x - y);
+            sum += x - y;
+            double byte_diff = double(to_byte(x)) - double(to_byte(y));
+            byte_squared += byte_diff * byte_diff;
+        }
+    }
+
+    double n = 3.0 * a.pixels.size();
+    image_difference result;
+    result.rmse = std::sqrt(squared / n);
+    result.bias = sum / n;
+    result.psnr_db = byte_squared > 0 ? 10 * std::log10(255.0 * 255.0 / (byte_squared / n)) : infinity;
+    return result;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The camera of the main.cxx scene, at benchmark resolution
+static void bench_camera(camera& cam, const bench_options& options) {
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = options.quick ? 160 : 320;
+    cam.samples_per_pixel = options.quick ? 8 : 16;
+    cam.max_recurse_depth = 16;
+    cam.rr_min_depth = 4;
+    cam.sampler = sampler_type::sobol;
+    cam.seed = 1;
+
+    cam.vfov = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+}
+
+/*
+ * The sphere field of main.cxx, extending extent spheres in each direction from the centre (main.cxx uses 11). With
+ * all_glass, every small sphere is a dielectric, which makes paths long and branchy. With moving, the diffuse spheres
+ * bounce upwards while the shutter is open, so their motion blur can be timed against the still field.
+ */
+static bench_scene sphere_field(const std::string& name, int extent, bool all_glass, bool moving, const bench_options& options) {
+    random_generator().seed(1234);
+    scene_description desc;
+
+    desc.add_sphere(point3(0, -1000, 0), 1000, desc.add_lambertian(color(0.5, 0.5, 0.5)));
+    for (int a = -extent; a < extent; a++) {
+        for (int b = -extent; b < extent; b++) {
+            auto choose_mat = all_glass ? 1.0 : random_double();
+            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+            if ((center - point3(4, 0.2, 0)).length() <= 0.9) continue;
+
+            uint32_t mat;
+            point3 center2 = center;
+            if (choose_mat < 0.4) {
+                mat = desc.add_lambertian(color::random() * color::random());
+                if (moving) center2 = center + vec3(0, random_double(0, 0.5), 0);
+            }
+            else if (choose_mat < 0.8) mat = desc.add_metal(color::random(0.5, 1), random_double(0, 0.5));
+            else mat = desc.add_dielectric(1.5);
+            desc.add_sphere(center, center2, 0.2, mat);
+        }
+    }
+    desc.add_sphere(point3(0, 1, 0), 1.0, desc.add_dielectric(1.5));
+    desc.add_sphere(point3(-4, 1, 0), 1.0, desc.add_lambertian(color(0.4, 0.2, 0.1)));
+    desc.add_sphere(point3(4, 1, 0), 1.0, desc.add_metal(color(0.7, 0.6, 0.5), 0.0));
+    bench_camera(desc.cam, options);
+    if (moving) desc.cam.shutter_close = 1;
+
+    bench_scene result;
+    result.name = name;
+    result.primitives = (long long)desc.spheres.size();
+
+    auto start = std::chrono::steady_clock::now();
+    result.owner = std::make_unique<scene>(desc);
+    result.build_ms = elapsed_ms(start);
+
+    result.cam = result.owner->cam;
+    result.world = result.owner->world;
+    return result;
+}
+
+/*
+ * The room of scenes/sphere-room.txt: walls made of large spheres, lit only by one small sphere light, so every path
+ * samples the light and traces shadow rays.
+ */
+static bench_scene sphere_room(const bench_options& options) {
+    scene_description desc;
+    auto white = desc.add_lambertian(color(0.75, 0.75, 0.75));
+    desc.add_sphere(point3(0, -1000, 0), 1000, white);
+    desc.add_sphere(point3(0, 1008, 0), 1000, white);
+    desc.add_sphere(point3(-1006, 4, 0), 1000, desc.add_lambertian(color(0.75, 0.25, 0.25)));
+    desc.add_sphere(point3(1006, 4, 0), 1000, desc.add_lambertian(color(0.25, 0.25, 0.75)));
+    desc.add_sphere(point3(0, 4, -1006), 1000, white);
+    desc.add_sphere(point3(0, 4, 1014), 1000, white);
+
+    desc.add_sphere(point3(-2.5, 1.5, -2), 1.5, desc.add_metal(color(0.9, 0.9, 0.9), 0.05));
+    desc.add_sphere(point3(2.5, 1.5, 0.5), 1.5, desc.add_dielectric(1.5));
+    desc.add_sphere(point3(0, 0.8, -4), 0.8, white);
+    desc.add_sphere(point3(0, 7, -1), 0.4, desc.add_diffuse_light(color(50, 46, 40)));
+
+    bench_camera(desc.cam, options);
+    desc.cam.aspect_ratio = 4.0 / 3.0;
+    desc.cam.vfov = 50;
+    desc.cam.lookfrom = point3(0, 4, 12.5);
+    desc.cam.lookat = point3(0, 3, 0);
+    desc.cam.defocus_angle = 0;
+    desc.cam.sky = false;
+
+    bench_scene result;
+    result.name = "sphere room";
+    result.primitives = (long long)desc.spheres.size();
+
+    auto start = std::chrono::steady_clock::now();
+    result.owner = std::make_unique<scene>(desc);
+    result.build_ms = elapsed_ms(start);
+
+    result.cam = result.owner->cam;
+    result.world = result.owner->world;
+    return result;
+}
+
+// A torus with the given number of segments around each of its two circles
+static shared_ptr<triangle_mesh> torus_mesh(int major_segments, int minor_segments, const material* mat) {
+    auto mesh = make_shared<triangle_mesh>(mat);
+    const double major_radius = 1.0, minor_radius = 0.35;
+
+    for (int i = 0; i < major_segments; i++) {
+        double u = 2 * pi * i / major_segments;
+        for (int j = 0; j < minor_segments; j++) {
+            double v = 2 * pi * j / minor_segments;
+            vec3 ring(std::cos(u), 0, std::sin(u));
+            vec3 normal = std::cos(v) * ring + vec3(0, std::sin(v), 0);
+            mesh->vertices.push_back(point3(0, 0, 0) + major_radius * ring + minor_radius * normal);
+            mesh->normals.push_back(normal);
+        }
+    }
+
+    auto index = [&](int i, int j) { return uint32_t((i % major_segments) * minor_segments + j % minor_segments); };
+    for (int i = 0; i < major_segments; i++) {
+        for (int j = 0; j < minor_segments; j++) {
+            uint32_t a = index(i, j), b = index(i + 1, j), c = index(i + 1, j + 1), d = index(i, j + 1);
+            mesh->add_triangle(a, d, c);
+            mesh->add_triangle(a, c, b);
+        }
+    }
+    mesh->normal_indices = mesh->indices;
+    return mesh;
+}
+
+// Instances of one finely tessellated torus spread over the ground, exercising the mesh BVH and the top level
+static bench_scene mesh_field(const bench_options& options) {
+    bench_scene result;
+    result.name = "mesh field";
+    bench_camera(result.cam, options);
+
+    auto ground = make_shared<material>(lambertian(color(0.5, 0.5, 0.5)));
+    auto gold = make_shared<material>(metal(color(0.8, 0.6, 0.2), 0.1));
+    auto spheres = make_shared<sphere_set>();
+    spheres->add(point3(0, -1000, 0), 1000, ground);
+
+    auto start = std::chrono::steady_clock::now();
+    auto torus = torus_mesh(options.quick ? 256 : 512, options.quick ? 64 : 128, gold.get());
+    torus->build();
+    spheres->build();
+
+    auto instances = make_shared<instance_bvh>();
+    random_generator().seed(1234);
+    for (int a = -6; a < 6; a++) {
+        for (int b = -6; b < 6; b++) {
+            auto t = transform::translate(vec3(1.6 * a + 0.8, 0.4, 1.6 * b + 0.8))
+                   * transform::rotate(vec3(random_double(-1, 1), 1, random_double(-1, 1)), random_double(0, 360))
+                   * transform::scale(0.5);
+            instances->add(torus, t);
+        }
+    }
+    instances->build();
+    result.build_ms = elapsed_ms(start);
+
+    result.primitives = (long long)(torus->triangle_count() * instances->size()) + 1;
+    result.world.add(spheres);
+    result.world.add(instances);
+    result.materials.push_back(gold);
+    return result;
+}
+
+static bench_run run(bench_scene& s, const std::string& backend, int threads) {
+    camera cam = s.cam;
+    cam.multithread_mode = backend != "single";
+    cam.wavefront_mode = backend == "wavefront";
+    cam.thread_count = threads;
+    cam.progress = make_shared<silent_progress_reporter>();
+
+    auto start = std::chrono::steady_clock::now();
+    image output = cam.render(s.world);
+    double render_s = elapsed_ms(start) / 1000;
+
+    start = std::chrono::steady_clock::now();
+    auto encoded = encode_png(output);
+    double encode_ms = elapsed_ms(start);
+
+    return bench_run{ backend, threads, render_s, encode_ms, cam.last_samples_traced(), cam.last_rays_traced(), std::move(output) };
+}
+
+static bool parse_options(int argc, char* argv[], bench_options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--quick") {
+            options.quick = true;
+        } else if (arg == "--scene" && i + 1 < argc) {
+            options.scene_filter = argv[++i];
+        } else if (arg == "--save-images" && i + 1 < argc) {
+            options.save_images = argv[++i];
+        } else if (arg == "--reference" && i + 1 < argc) {
+            options.reference = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            std::stringstream list(argv[++i]);
+            std::string item;
+            while (std::getline(list, item, ',')) {
+                int n = std::atoi(item.c_str());
+                if (n < 1) return false;
+                options.threads.push_back(n);
+            }
+        } else {
+            return false;
+        }
+    }
+
+    // Default to powers of two up to the hardware thread count, and the count itself
+    if (options.threads.empty()) {
+        int hardware = std::max(1, int(std::thread::hardware_concurrency()));
+        for (int n = 1; n < hardware; n *= 2) options.threads.push_back(n);
+        options.threads.push_back(hardware);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bench_options options;
+    if (!parse_options(argc, argv, options)) {
+        std::fprintf(stderr, "Usage: %s [--json] [--quick] [--threads 1,2,4,...] [--scene name] [--save-images dir] [--reference dir]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::pair<std::string, std::function<bench_scene()>>> scenes = {
+        { "field 11", [&] { return sphere_field("field 11", 11, false, false, options); } },
+        { "field 33", [&] { return sphere_field("field 33", 33, false, false, options); } },
+        { "field 100", [&] { return sphere_field("field 100", 100, false, false, options); } },
+        { "glass field", [&] { return sphere_field("glass field", 11, true, false, options); } },
+        { "moving field", [&] { return sphere_field("moving field", 11, false, true, options); } },
+        { "mesh field", [&] { return mesh_field(options); } },
+        { "sphere room", [&] { return sphere_room(options); } },
+    };
+
+    if (options.json) {
+        std::printf("{\n  \"hardware_threads\": %u,\n  \"quick\": %s,\n  \"precision\": \"%s\",\n  \"results\": [",
+            std::thread::hardware_concurrency(), options.quick ? "true" : "false", precision_name());
+    } else {
+        std::printf("%s precision geometry\n", precision_name());
+        std::printf("%-12s %10s %9s %8s %10s %10s %12s %12s %8s %6s %10s\n", "scene", "prims", "backend", "threads",
+            "build ms", "render s", "samples/s", "rays/s", "speedup", "eff", "encode ms");
+    }
+
+    bool first_result = true;
+    for (const auto& [name, make_scene] : scenes) {
+        if (!options.scene_filter.empty() && name.find(options.scene_filter) == std::string::npos) continue;
+        bench_scene s = make_scene();
+
+        std::vector<bench_run> runs;
+        runs.push_back(run(s, "single", 1));
+        for (int n : options.threads) runs.push_back(run(s, "pool", n));
+        for (int n : options.threads) runs.push_back(run(s, "wavefront", n));
+
+        // Every run renders the same image, so the single threaded one stands for all of them
+        std::optional<image_difference> difference;
+        try {
+            if (!options.save_images.empty()) write_image(runs[0].output, image_file(options.save_images, s.name, precision_name()));
+            if (!options.reference.empty()) difference = compare(runs[0].output, read_pfm(image_file(options.reference, s.name, "double")));
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+
+        double baseline = runs[0].render_s;
+        for (const auto& r : runs) {
+            double speedup = baseline / r.render_s;
+            double efficiency = speedup / r.threads;
+            double samples_per_s = r.samples / r.render_s;
+            double rays_per_s = r.rays / r.render_s;
+
+            if (options.json) {
+                std::printf("%s\n    {\"scene\": \"%s\", \"primitives\": %lld, \"backend\": \"%s\", \"threads\": %d, "
+                    "\"build_ms\": %.3f, \"render_s\": %.4f, \"encode_ms\": %.3f, \"samples\": %lld, \"rays\": %lld, "
+                    "\"samples_per_s\": %.0f, \"rays_per_s\": %.0f, \"speedup\": %.3f, \"efficiency\": %.3f",
+                    first_result ? "" : ",", s.name.c_str(), s.primitives, r.backend.c_str(), r.threads, s.build_ms,
+                    r.render_s, r.encode_ms, r.samples, r.rays, samples_per_s, rays_per_s, speedup, efficiency);
+                if (difference) {
+                    std::printf(", \"rmse\": %.6f, \"bias\": %.6f", difference->rmse, difference->bias);
+
+                    // Identical images have an infinite PSNR, which JSON cannot represent
+                    if (std::isfinite(difference->psnr_db)) std::printf(", \"psnr_db\": %.2f", difference->psnr_db);
+                    else std::printf(", \"psnr_db\": null");
+                }
+                std::printf("}");
+                first_result = false;
+            } else {
+                std::printf("%-12s %10lld %9s %8d %10.2f %10.3f %12.0f %12.0f %8.2f %6.2f %10.2f\n", s.name.c_str(),
+                    s.primitives, r.backend.c_str(), r.threads, s.build_ms, r.render_s, samples_per_s, rays_per_s,
+                    speedup, efficiency, r.encode_ms);
+            }
+        }
+        if (difference && !options.json) {
+            std::printf("%-12s against the double image: rmse %.6f, bias %+.6f, psnr %.2f dB\n", s.name.c_str(),
+                difference->rmse, difference->bias, difference->psnr_db);
+        }
+        std::fflush(stdout);
+    }
+
+    if (options.json) std::printf("\n  ]\n}\n");
+}
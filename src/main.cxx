@@ -1,16 +1,35 @@
 #include <memory.h>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <util.h>
-#include <hittable.h>
-#include <hittable-list.h>
-#include <sphere.h>
 #include <camera.h>
+#include <scene.h>
+#include <image-writer.h>
+#include <animation.h>
+#include <interactive.h>
+#include <distributed.h>
 
-int main() {
-    hittable_list world;
+// The built-in scene: a field of small random spheres around three large ones, laid out by the given seed
+static scene_description default_scene(uint64_t seed) {
+    random_generator().seed(seed);
 
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
+    scene_description desc;
+
+    auto ground_material = desc.add_lambertian(color(0.5, 0.5, 0.5));
+    desc.add_sphere(point3(0,-1000,0), 1000, ground_material);
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -18,43 +37,46 @@ int main() {
             point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
 
             if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
+                uint32_t sphere_material;
 
                 if (choose_mat < 0.4) {
                     // diffuse
                     auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = desc.add_lambertian(albedo);
+                    desc.add_sphere(center, 0.2, sphere_material);
                 } else if (choose_mat < 0.8) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = desc.add_metal(albedo, fuzz);
+                    desc.add_sphere(center, 0.2, sphere_material);
                 } else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = desc.add_dielectric(1.5);
+                    desc.add_sphere(center, 0.2, sphere_material);
                 }
             }
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    auto material1 = desc.add_dielectric(1.5);
+    desc.add_sphere(point3(0, 1, 0), 1.0, material1);
 
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    auto material2 = desc.add_lambertian(color(0.4, 0.2, 0.1));
+    desc.add_sphere(point3(-4, 1, 0), 1.0, material2);
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    auto material3 = desc.add_metal(color(0.7, 0.6, 0.5), 0.0);
+    desc.add_sphere(point3(4, 1, 0), 1.0, material3);
 
-    camera cam;
+    camera& cam = desc.cam;
 
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 1920;
     cam.samples_per_pixel = 500;
     cam.max_recurse_depth = 40;
+    cam.rr_min_depth = 4;
+    cam.sampler = sampler_type::sobol;
+    cam.seed = seed;
 
     cam.vfov = 20;
     cam.lookfrom = point3(13,2,3);
@@ -65,6 +87,391 @@ int main() {
     cam.focus_dist    = 10.0;
 
     cam.multithread_mode = true;
+    cam.thread_count = 0;   // Use every hardware thread
+
+    return desc;
+}
+
+// The path of one AOV: path with "-" and the AOV's name inserted before the extension
+static std::string aov_file_path(const std::string& path, const std::string& name) {
+    auto dot = path.find_last_of('.');
+    auto slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+    return path.substr(0, dot) + "-" + name + path.substr(dot);
+}
+
+// Reads all of text as a number, returning false if it is not one or is out of range for T
+template <typename T>
+static bool parse_number(const char* text, T& value) {
+    const char* end = text + std::strlen(text);
+    auto [last, error] = std::from_chars(text, end, value);
+    return error == std::errc() && last == end;
+}
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+/*
+ * Interactive preview (see interactive.h). The camera statements in settings_path are applied over the scene's
+ * camera, and the file is watched: whenever its contents change, the render starts again with the new settings. Every
+ * frame replaces the output, by writing a temporary file next to it and renaming that over it, so that a viewer
+ * polling the output never reads half a frame. Runs until interrupted, then sums up the latency of the changes.
+ */
+static int run_interactive(const hittable& world, const camera& base, const std::string& settings_path,
+                           const std::string& output_path, image_format format, bool report) {
+    auto read_settings = [&](std::string& text) {
+        std::ifstream file(settings_path);
+        if (!file) return false;
+        std::ostringstream contents;
+        contents << file.rdbuf();
+        text = contents.str();
+        return true;
+    };
+    auto apply_settings = [&](const std::string& text) {
+        camera cam = base;
+        std::istringstream in(text);
+        apply_camera_settings(in, settings_path, cam);
+        return cam;
+    };
+
+    std::string text;
+    camera first;
+    try {
+        if (!read_settings(text)) throw std::runtime_error("Unable to open camera settings '" + settings_path + "'");
+        first = apply_settings(text);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    std::mutex report_lock;
+    std::vector<double> latencies;
+    std::string temporary = output_path + ".tmp";
+
+    auto write_frame = [&](const preview_frame& frame) {
+        try {
+            write_image(frame.pixels, temporary, format);
+            if (std::rename(temporary.c_str(), output_path.c_str()) != 0) {
+                throw std::runtime_error("Unable to replace '" + output_path + "'");
+            }
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> guard(report_lock);
+            std::cerr << e.what() << '\n';
+            return;
+        }
+
+        // The frame is only visible once the rename has replaced the output, so that is where the latency ends
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame.changed_at).count();
+
+        std::lock_guard<std::mutex> guard(report_lock);
+        if (frame.first) latencies.push_back(seconds);
+        if (report) {
+            std::fprintf(stderr, "change %llu: %s %d px wide, %d spp, shown %.3f s after the change (rendered after %.3f s)\n",
+                frame.change, frame.first ? "first frame" : "refined to", frame.render_width, frame.samples_per_pixel,
+                seconds, frame.seconds);
+        }
+    };
+
+    std::signal(SIGINT, [](int) { interrupted = 1; });
+    std::signal(SIGTERM, [](int) { interrupted = 1; });
+    {
+        interactive_preview preview(world, first, write_frame);
+        while (!interrupted) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+            std::string changed;
+            if (!read_settings(changed) || changed == text) continue;
+            text = changed;
+            try {
+                preview.set_camera(apply_settings(text));
+            } catch (const std::exception& e) {
+                // Likely caught part way through being saved. The next save restarts the preview
+                std::lock_guard<std::mutex> guard(report_lock);
+                std::cerr << e.what() << '\n';
+            }
+        }
+    }
+
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        std::fprintf(stderr, "%zu camera settings shown, first frame after %.3f s median, %.3f s worst\n", latencies.size(),
+            latencies[latencies.size() / 2], latencies.back());
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    shared_ptr<progress_reporter> progress = make_progress_reporter("tty");
+    std::string output_path = "-";
+    std::string format_name;
+    std::optional<uint64_t> seed;
+    double adaptive_threshold = 0;
+    int samples_per_pixel = 0;
+    std::string scene_path;
+    std::string save_scene_path;
+    std::string checkpoint_path;
+    std::string resume_path;
+    std::string preview_path;
+    double checkpoint_interval = 60;
+    std::string heatmap_path;
+    bool wavefront = false;
+    int worker_count = 0;
+    bool worker = false;
+    std::string animation_path;
+    int frame_count = 0;
+    bool denoise = false;
+    std::string aov_path;
+    std::string interactive_path;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool valid = true;
+        if (arg == "--progress" && i + 1 < argc) {
+            progress = make_progress_reporter(argv[++i]);
+            if (!progress) {
+                std::cerr << "Unknown progress reporter '" << argv[i] << "', expected tty, json or none\n";
+                return 1;
+            }
+        } else if ((arg == "-o" || arg == "--output") && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (arg == "--adaptive" && i + 1 < argc) {
+            valid = parse_number(argv[++i], adaptive_threshold) && adaptive_threshold > 0;
+        } else if (arg == "--seed" && i + 1 < argc) {
+            uint64_t value;
+            valid = parse_number(argv[++i], value);
+            seed = value;
+        } else if (arg == "--scene" && i + 1 < argc) {
+            scene_path = argv[++i];
+        } else if (arg == "--save-scene" && i + 1 < argc) {
+            save_scene_path = argv[++i];
+        } else if (arg == "--spp" && i + 1 < argc) {
+            valid = parse_number(argv[++i], samples_per_pixel) && samples_per_pixel > 0;
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpoint_path = argv[++i];
+        } else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            valid = parse_number(argv[++i], checkpoint_interval) && checkpoint_interval >= 0;
+        } else if (arg == "--resume" && i + 1 < argc) {
+            resume_path = argv[++i];
+        } else if (arg == "--preview" && i + 1 < argc) {
+            preview_path = argv[++i];
+        } else if (arg == "--wavefront") {
+            wavefront = true;
+        } else if (arg == "--workers" && i + 1 < argc) {
+            valid = parse_number(argv[++i], worker_count) && worker_count > 0;
+        } else if (arg == "--worker") {
+            worker = true;
+        } else if (arg == "--animate" && i + 1 < argc) {
+            animation_path = argv[++i];
+        } else if (arg == "--frames" && i + 1 < argc) {
+            valid = parse_number(argv[++i], frame_count) && frame_count > 0;
+        } else if (arg == "--interactive" && i + 1 < argc) {
+            interactive_path = argv[++i];
+        } else if (arg == "--denoise") {
+            denoise = true;
+        } else if (arg == "--aovs" && i + 1 < argc) {
+            aov_path = argv[++i];
+        } else if (arg == "--format" && i + 1 < argc) {
+            format_name = argv[++i];
+            if (format_name != "ppm" && format_name != "pfm" && format_name != "png") {
+                std::cerr << "Unknown image format '" << format_name << "', expected ppm, pfm or png\n";
+                return 1;
+            }
+        } else if (arg == "--heatmap" && i + 1 < argc) {
+            heatmap_path = argv[++i];
+#ifndef RAYTRACER_STATS
+            std::cerr << "--heatmap needs a build with statistics (cmake -DRAYTRACER_STATS=ON)\n";
+            return 1;
+#endif
+        } else {
+            valid = false;
+        }
+
+        // Numbers must be given in full, and counts and thresholds must be positive
+        if (!valid) {
+            std::cerr << "Usage: " << argv[0] << " [--scene file] [--save-scene file] [-o output.ppm|.pfm|.png] [--format ppm|pfm|png] [--progress tty|json|none] [--seed N] [--adaptive threshold]"
+                      << " [--spp N] [--checkpoint file] [--checkpoint-interval seconds] [--resume file] [--preview image] [--heatmap image] [--wavefront]"
+                      << " [--workers N] [--animate camera-path --frames N] [--denoise] [--aovs image]"
+                      << " [--interactive camera-file]\n";
+            return 1;
+        }
+    }
+
+    // A checkpoint carries the seed and sampler it was started with, which resuming has to keep using
+    accumulation_buffer accumulated;
+    if (!resume_path.empty()) {
+        try {
+            accumulated = accumulation_buffer::load(resume_path);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+        seed = accumulated.seed;
+    }
 
-    cam.render(world);
+    /*
+     * Scene files carry their own camera settings, which the command line overrides. The built-in scene is laid out by
+     * the seed, so the same seed reproduces both the scene and the render.
+     */
+    std::unique_ptr<scene> loaded;
+    try {
+        if (scene_path.empty()) {
+            auto desc = default_scene(seed.value_or(0));
+            if (!save_scene_path.empty() && !worker) write_scene_binary(desc, save_scene_path);
+            loaded = std::make_unique<scene>(desc);
+        } else {
+            if (!save_scene_path.empty() && !worker) write_scene_binary(read_scene_description(scene_path), save_scene_path);
+            loaded = std::make_unique<scene>(scene_path);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    const hittable& world = loaded->world;
+    camera& cam = loaded->cam;
+
+    if (seed) cam.seed = *seed;
+    if (!accumulated.empty()) cam.sampler = accumulated.sampler;
+    if (samples_per_pixel > 0) cam.samples_per_pixel = samples_per_pixel;
+
+    // With adaptive sampling, samples_per_pixel becomes the average budget rather than a fixed count
+    if (adaptive_threshold > 0) {
+        cam.adaptive_sampling = true;
+        cam.adaptive_threshold = adaptive_threshold;
+    }
+
+    cam.progress = progress;
+    cam.wavefront_mode = wavefront;
+
+    // A worker renders whatever its coordinator sends it over standard input and output, with the same scene and settings
+    if (worker) return render_worker(cam, world) ? 0 : 1;
+
+    /*
+     * Checkpointing, resuming and previews render progressively: a few samples are added to every pixel per pass, and
+     * the running sums can be written out between passes.
+     *
+     * With --workers, this process coordinates that many copies of itself, started with the same arguments plus
+     * --worker, which trace the samples between them. Unless progress is being saved, each tile is then one task.
+     */
+    bool progressive = !checkpoint_path.empty() || !resume_path.empty() || !preview_path.empty();
+
+    // The format is taken from the output file extension unless given explicitly
+    image_format format = format_from_path(output_path);
+    if (format_name == "pfm") format = image_format::pfm;
+    else if (format_name == "png") format = image_format::png;
+    else if (format_name == "ppm") format = image_format::ppm;
+
+    // Checkpoints, previews, workers and the interactive preview all add passes of a fixed number of samples per pixel,
+    // tile by tile
+    if ((adaptive_threshold > 0 || wavefront) && (progressive || worker_count > 0 || !interactive_path.empty())) {
+        std::cerr << "--adaptive and --wavefront cannot be combined with checkpoints, previews, workers or --interactive\n";
+        return 1;
+    }
+
+    if (!interactive_path.empty()) {
+        if (progressive || worker_count > 0 || !animation_path.empty() || output_path == "-") {
+            std::cerr << "--interactive needs an output file name, and cannot be combined with checkpoints, previews, workers or --animate\n";
+            return 1;
+        }
+        return run_interactive(world, cam, interactive_path, output_path, format, progress && progress->enabled());
+    }
+
+    /*
+     * An animation renders frames along a camera path into numbered files (see frame_path), building the scene once
+     * and writing each frame while the next renders.
+     */
+    if (!animation_path.empty()) {
+        if (progressive || worker_count > 0 || frame_count < 1 || output_path == "-" || !aov_path.empty()) {
+            std::cerr << "--animate needs --frames N and an output file name, and cannot be combined with checkpoints, previews, workers or --aovs\n";
+            return 1;
+        }
+
+        cam.denoise = denoise;
+        try {
+            camera_path path = camera_path::load(animation_path);
+            render_animation(cam, world, path, frame_count, [&](int index, const image& frame) {
+                write_image(frame, frame_path(output_path, index), format);
+            });
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+
+#ifdef RAYTRACER_STATS
+        render_stats_report(stderr);
+#endif
+        return 0;
+    }
+
+    image output;
+    try {
+        auto last_save = std::chrono::steady_clock::now();
+        auto after_pass = [&](const accumulation_buffer& acc) {
+            auto now = std::chrono::steady_clock::now();
+            if (std::chrono::duration<double>(now - last_save).count() < checkpoint_interval) return;
+            last_save = now;
+            if (!checkpoint_path.empty()) acc.save(checkpoint_path);
+            if (!preview_path.empty()) write_image(acc.resolve(), preview_path);
+        };
+
+        if (worker_count > 0) {
+            std::vector<std::string> arguments = { argv[0] };
+            for (int i = 1; i < argc; i++) {
+                if (std::string(argv[i]) == "--workers") i++;
+                else arguments.push_back(argv[i]);
+            }
+            arguments.push_back("--worker");
+
+            if (!progressive) cam.pass_samples = cam.samples_per_pixel;
+            worker_processes workers("/proc/self/exe", arguments, worker_count);
+
+            output = render_distributed(cam, workers, accumulated, after_pass);
+            if (!checkpoint_path.empty()) accumulated.save(checkpoint_path);
+        } else if (progressive) {
+            output = cam.render_progressive(world, accumulated, after_pass);
+            if (!checkpoint_path.empty()) accumulated.save(checkpoint_path);
+        } else {
+            output = cam.render(world);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+#ifdef RAYTRACER_STATS
+    render_stats_report(stderr);
+    if (!heatmap_path.empty()) {
+        try {
+            write_image(render_stats_heatmap(output.width, output.height), heatmap_path);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+    }
+#endif
+
+    /*
+     * The denoiser and --aovs take a pass of camera rays of their own, after the render and whichever way it was done.
+     * The AOVs are written next to each other as "-albedo", "-normal" and "-depth" files, best as PFM to keep their range.
+     */
+    if (denoise || !aov_path.empty()) {
+        try {
+            aov_buffers aovs = cam.render_aovs(world);
+            if (denoise) output = cam.denoised(output, aovs);
+            if (!aov_path.empty()) {
+                write_image(aovs.albedo, aov_file_path(aov_path, "albedo"));
+                write_image(aovs.normal, aov_file_path(aov_path, "normal"));
+                write_image(aovs.depth, aov_file_path(aov_path, "depth"));
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+    }
+
+    try {
+        write_image(output, output_path, format);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
 }
@@ -0,0 +1,131 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "interval.h"
+#include "vec3.h"
+#include "ray.h"
+
+// Axis-aligned bounding box, stored as one interval per axis.
+//
+// Used by the acceleration structures to cheaply reject rays before running the (comparatively expensive)
+// intersection tests of the objects contained within the box.
+
+class aabb {
+	public:
+		interval x, y, z;
+
+		// The default box is empty, since intervals are empty by default
+		aabb() {}
+
+		aabb(const interval& x, const interval& y, const interval& z) : x(x), y(y), z(z) {
+			pad_to_minimums();
+		}
+
+		// Treats the two points a and b as extrema of the bounding box, in any order
+		aabb(const point3& a, const point3& b) {
+			x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
+			y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
+			z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+
+			pad_to_minimums();
+		}
+
+		// Creates the tightest box enclosing both input boxes
+		aabb(const aabb& box0, const aabb& box1) {
+			x = interval(box0.x, box1.x);
+			y = interval(box0.y, box1.y);
+			z = interval(box0.z, box1.z);
+		}
+
+		// The box interpolated linearly from a at t = 0 to b at t = 1, for bounding moving objects (see
+		// hittable::moving)
+		static aabb lerp(const aabb& a, const aabb& b, real t) {
+			aabb result;
+			result.x = interval(a.x.min + t * (b.x.min - a.x.min), a.x.max + t * (b.x.max - a.x.max));
+			result.y = interval(a.y.min + t * (b.y.min - a.y.min), a.y.max + t * (b.y.max - a.y.max));
+			result.z = interval(a.z.min + t * (b.z.min - a.z.min), a.z.max + t * (b.z.max - a.z.max));
+			return result;
+		}
+
+		const interval& axis_interval(int n) const {
+			if (n == 1) return y;
+			if (n == 2) return z;
+			return x;
+		}
+
+		bool is_empty() const {
+			return x.min > x.max || y.min > y.max || z.min > z.max;
+		}
+
+		point3 centroid() const {
+			return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+		}
+
+		// Returns the index of the longest axis of the bounding box
+		int longest_axis() const {
+			if (x.size() > y.size())
+				return x.size() > z.size() ? 0 : 2;
+			else
+				return y.size() > z.size() ? 1 : 2;
+		}
+
+		/*
+			Surface area of the box. This is the quantity minimised by the surface area heuristic, as the
+			probability of a random ray hitting a convex volume is proportional to its surface area.
+		*/
+		double surface_area() const {
+			if (is_empty()) return 0;
+
+			auto dx = x.size();
+			auto dy = y.size();
+			auto dz = z.size();
+			return 2 * (dx * dy + dy * dz + dz * dx);
+		}
+
+		/*
+			Slab test. Returns true if the ray passes through the box anywhere within ray_t.
+
+			Takes the reciprocal of the ray direction rather than the ray itself, as the BVH traversal tests the same
+			ray against many boxes and would otherwise recompute the three divisions for every one of them.
+		*/
+		bool hit(const point3& origin, const vec3& inv_dir, interval ray_t) const {
+			for (int axis = 0; axis < 3; axis++) {
+				const interval& ax = axis_interval(axis);
+				auto t0 = (ax.min - origin[axis]) * inv_dir[axis];
+				auto t1 = (ax.max - origin[axis]) * inv_dir[axis];
+
+				if (t0 > t1) std::swap(t0, t1);
+
+				// Widen the far distance by the worst case rounding error of computing it (Ize, "Robust BVH Ray
+				// Traversal", 2013), so rays grazing a box edge are never culled. Watertight triangle meshes rely on it
+				t1 *= 1 + 2 * gamma_bound(3);
+
+				if (t0 > ray_t.min) ray_t.min = t0;
+				if (t1 < ray_t.max) ray_t.max = t1;
+
+				if (ray_t.max < ray_t.min) return false;
+			}
+			return true;
+		}
+
+		bool hit(const ray& r, interval ray_t) const {
+			const vec3& d = r.direction();
+			return hit(r.origin(), vec3(1/d.x(), 1/d.y(), 1/d.z()), ray_t);
+		}
+
+		static const aabb empty, universe;
+
+	private:
+		// Avoids degenerate boxes (e.g. for an axis-aligned quad), which the slab test would otherwise miss
+		void pad_to_minimums() {
+			real delta = 0.0001;
+			if (x.size() < delta) x = x.expand(delta);
+			if (y.size() < delta) y = y.expand(delta);
+			if (z.size() < delta) z = z.expand(delta);
+		}
+};
+
+const inline aabb aabb::empty = aabb(interval::empty, interval::empty, interval::empty);
+const inline aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
+
+#endif
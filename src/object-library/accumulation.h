@@ -0,0 +1,158 @@
+#ifndef ACCUMULATION_H
+#define ACCUMULATION_H
+
+#include "image.h"
+#include "sampler.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Running per-pixel sums of the samples taken so far, used by progressive rendering.
+ *
+ * Together with the seed and sampler type, the per-pixel sample counts are the complete random number state of a
+ * render: each sample's random sequence is derived from (seed, pixel, sample index), so continuing from sample
+ * counts[k] of pixel k picks up exactly where the previous run left off. That makes the buffer a self-contained
+ * checkpoint, which can be saved to disk and later resumed, or extended with more samples. (The stratified and
+ * blue noise point sets depend on samples_per_pixel, so renders meant to be extended later should use the sobol or
+ * independent samplers.)
+ *
+ * Checkpoint layout (little endian):
+ *     "RTCK", u32 version, u32 width, u32 height, u64 seed, u32 sampler,
+ *     then per pixel: f64 sum_r, f64 sum_g, f64 sum_b, u32 count
+ */
+class accumulation_buffer {
+    public:
+        int width = 0;
+        int height = 0;
+        uint64_t seed = 0;
+        sampler_type sampler = sampler_type::independent;
+        std::vector<color_sum> sums;
+        std::vector<uint32_t> counts;
+
+        accumulation_buffer() {}
+
+        accumulation_buffer(int width, int height, uint64_t seed, sampler_type sampler) :
+            width(width), height(height), seed(seed), sampler(sampler),
+            sums((size_t)width * height), counts((size_t)width * height, 0) {}
+
+        bool empty() const { return sums.empty(); }
+
+        // Fewest samples taken by any pixel
+        uint32_t min_count() const {
+            uint32_t result = UINT32_MAX;
+            for (auto c : counts) result = c < result ? c : result;
+            return counts.empty() ? 0 : result;
+        }
+
+        // Averages the samples taken so far into an image. Pixels without samples are black
+        image resolve() const {
+            image output(width, height);
+            for (size_t k = 0; k < sums.size(); k++) {
+                output.pixels[k] = counts[k] > 0 ? sums[k].scaled(1.0 / counts[k]) : color(0, 0, 0);
+            }
+            return output;
+        }
+
+        /*
+         * Writes a checkpoint. The data goes to a temporary file which then replaces the target, so an interrupted
+         * write never destroys the previous checkpoint. Throws std::runtime_error on failure.
+         */
+        void save(const std::string& path) const {
+            std::vector<unsigned char> bytes;
+            bytes.reserve(32 + sums.size() * (3 * sizeof(double) + sizeof(uint32_t)));
+
+            append(bytes, magic, 4);
+            append_value(bytes, version);
+            append_value(bytes, uint32_t(width));
+            append_value(bytes, uint32_t(height));
+            append_value(bytes, seed);
+            append_value(bytes, uint32_t(sampler));
+            for (size_t k = 0; k < sums.size(); k++) {
+                append_value(bytes, sums[k].x());
+                append_value(bytes, sums[k].y());
+                append_value(bytes, sums[k].z());
+                append_value(bytes, counts[k]);
+            }
+
+            std::string temp_path = path + ".tmp";
+            std::FILE* file = std::fopen(temp_path.c_str(), "wb");
+            if (!file) throw std::runtime_error("Unable to open '" + temp_path + "' for writing");
+
+            bool failed = std::fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size();
+            failed |= std::fclose(file) != 0;
+            if (failed || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+                std::remove(temp_path.c_str());
+                throw std::runtime_error("Unable to write checkpoint '" + path + "'");
+            }
+        }
+
+        // Reads a checkpoint written by save(). Throws std::runtime_error if it is missing or malformed
+        static accumulation_buffer load(const std::string& path) {
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if (!file) throw std::runtime_error("Unable to open checkpoint '" + path + "'");
+
+            std::vector<unsigned char> bytes;
+            unsigned char chunk[65536];
+            size_t read;
+            while ((read = std::fread(chunk, 1, sizeof(chunk), file)) > 0) bytes.insert(bytes.end(), chunk, chunk + read);
+            std::fclose(file);
+
+            size_t pos = 0;
+            auto take = [&](void* dst, size_t size) {
+                if (pos + size > bytes.size()) throw std::runtime_error("Checkpoint '" + path + "' is truncated");
+                std::memcpy(dst, bytes.data() + pos, size);
+                pos += size;
+            };
+
+            char file_magic[4];
+            uint32_t file_version, w, h, sampler_value;
+            uint64_t file_seed;
+            take(file_magic, 4);
+            take(&file_version, sizeof(file_version));
+            if (std::memcmp(file_magic, magic, 4) != 0 || file_version != version)
+                throw std::runtime_error("'" + path + "' is not a checkpoint of this version");
+
+            take(&w, sizeof(w));
+            take(&h, sizeof(h));
+            take(&file_seed, sizeof(file_seed));
+            take(&sampler_value, sizeof(sampler_value));
+
+            // Checked before anything is allocated, so a corrupt header cannot ask for more memory than the file holds
+            const size_t pixel_bytes = 3 * sizeof(double) + sizeof(uint32_t);
+            if (w == 0 || h == 0 || w > uint32_t(INT32_MAX) || h > uint32_t(INT32_MAX)
+                || (bytes.size() - pos) / pixel_bytes / w < h)
+                throw std::runtime_error("Checkpoint '" + path + "' is truncated or has an invalid resolution");
+            if (sampler_value > uint32_t(sampler_type::blue_noise))
+                throw std::runtime_error("Checkpoint '" + path + "' has an unknown sampler");
+
+            accumulation_buffer buffer(int(w), int(h), file_seed, sampler_type(sampler_value));
+            for (size_t k = 0; k < buffer.sums.size(); k++) {
+                double rgb[3];
+                take(rgb, sizeof(rgb));
+                take(&buffer.counts[k], sizeof(uint32_t));
+                buffer.sums[k] = color_sum(rgb[0], rgb[1], rgb[2]);
+            }
+            return buffer;
+        }
+
+    private:
+        static constexpr char magic[4] = { 'R', 'T', 'C', 'K' };
+        static constexpr uint32_t version = 1;
+
+        static void append(std::vector<unsigned char>& bytes, const void* data, size_t size) {
+            auto p = static_cast<const unsigned char*>(data);
+            bytes.insert(bytes.end(), p, p + size);
+        }
+
+        template <typename T>
+        static void append_value(std::vector<unsigned char>& bytes, const T& value) {
+            append(bytes, &value, sizeof(T));
+        }
+};
+
+#endif
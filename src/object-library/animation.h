@@ -0,0 +1,202 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "camera.h"
+#include "image.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Camera animation: rendering many frames of one scene as the camera moves along a keyframed path.
+ *
+ * A camera path file holds one key per line, with '#' starting a comment:
+ *
+ *     key <time> lookfrom <x> <y> <z>
+ *     key <time> lookat <x> <y> <z>
+ *     key <time> vfov <degrees>
+ *     key <time> focus_dist <distance>
+ *
+ * Each field is animated on its own, so it needs keys only where it changes, and fields without keys keep the
+ * camera's own setting. Between keys a field follows a smooth curve through them (a cubic Hermite spline with
+ * Catmull-Rom tangents), and before the first and after the last it stays at that key's value. Times are in any unit;
+ * the frames of an animation are spread evenly from the earliest key to the latest.
+ */
+
+// The keys of one animated field, in order of time
+template <typename T>
+class keyframe_track {
+    public:
+        bool empty() const { return keys.empty(); }
+        double start() const { return keys.front().first; }
+        double end() const { return keys.back().first; }
+
+        // Keys must be added in order of strictly increasing time. Returns false otherwise
+        bool add(double time, const T& value) {
+            if (!keys.empty() && time <= keys.back().first) return false;
+            keys.emplace_back(time, value);
+            return true;
+        }
+
+        T at(double time) const {
+            if (time <= keys.front().first) return keys.front().second;
+            if (time >= keys.back().first) return keys.back().second;
+
+            size_t k = size_t(std::upper_bound(keys.begin(), keys.end(), time,
+                [](double t, const std::pair<double, T>& key) { return t < key.first; }) - keys.begin()) - 1;
+
+            double h = keys[k + 1].first - keys[k].first;
+            double s = (time - keys[k].first) / h;
+            double s2 = s * s, s3 = s2 * s;
+
+            // Hermite basis, with the tangents scaled from per unit time to per segment
+            return (2 * s3 - 3 * s2 + 1) * keys[k].second + (s3 - 2 * s2 + s) * h * tangent(k)
+                 + (-2 * s3 + 3 * s2) * keys[k + 1].second + (s3 - s2) * h * tangent(k + 1);
+        }
+
+    private:
+        std::vector<std::pair<double, T>> keys;
+
+        // Rate of change at key k: the slope between its neighbours, or to its one neighbour at either end
+        T tangent(size_t k) const {
+            size_t before = k > 0 ? k - 1 : k;
+            size_t after = k + 1 < keys.size() ? k + 1 : k;
+            return (1 / (keys[after].first - keys[before].first)) * (keys[after].second - keys[before].second);
+        }
+};
+
+class camera_path {
+    public:
+        keyframe_track<vec3> lookfrom;
+        keyframe_track<vec3> lookat;
+        keyframe_track<double> vfov;
+        keyframe_track<double> focus_dist;
+
+        bool empty() const { return lookfrom.empty() && lookat.empty() && vfov.empty() && focus_dist.empty(); }
+
+        // Earliest key of any field, or 0 if there are none
+        double start() const {
+            double result = infinity;
+            if (!lookfrom.empty()) result = std::min(result, lookfrom.start());
+            if (!lookat.empty()) result = std::min(result, lookat.start());
+            if (!vfov.empty()) result = std::min(result, vfov.start());
+            if (!focus_dist.empty()) result = std::min(result, focus_dist.start());
+            return empty() ? 0 : result;
+        }
+
+        // Latest key of any field, or 0 if there are none
+        double end() const {
+            double result = -infinity;
+            if (!lookfrom.empty()) result = std::max(result, lookfrom.end());
+            if (!lookat.empty()) result = std::max(result, lookat.end());
+            if (!vfov.empty()) result = std::max(result, vfov.end());
+            if (!focus_dist.empty()) result = std::max(result, focus_dist.end());
+            return empty() ? 0 : result;
+        }
+
+        // Time of frame index of frame_count, spread evenly from start() to end()
+        double frame_time(int index, int frame_count) const {
+            if (frame_count <= 1) return start();
+            return start() + (end() - start()) * index / (frame_count - 1);
+        }
+
+        // Sets the camera's animated fields to their values at the given time
+        void apply(camera& cam, double time) const {
+            if (!lookfrom.empty()) cam.lookfrom = lookfrom.at(time);
+            if (!lookat.empty()) cam.lookat = lookat.at(time);
+            if (!vfov.empty()) cam.vfov = vfov.at(time);
+            if (!focus_dist.empty()) cam.focus_dist = focus_dist.at(time);
+        }
+
+        // Reads a camera path file. Throws std::runtime_error if it is missing or malformed, or has no keys
+        static camera_path load(const std::string& path) {
+            std::ifstream file(path);
+            if (!file) throw std::runtime_error("Unable to open camera path '" + path + "'");
+
+            camera_path result;
+            std::string line;
+            for (int line_number = 1; std::getline(file, line); line_number++) {
+                auto comment = line.find('#');
+                if (comment != std::string::npos) line.erase(comment);
+
+                std::istringstream in(line);
+                std::string keyword;
+                if (!(in >> keyword)) continue;
+                std::string where = path + ":" + std::to_string(line_number);
+                if (keyword != "key") throw std::runtime_error(where + ": unknown statement '" + keyword + "'");
+
+                double time, v[3];
+                std::string field;
+                if (!(in >> time >> field)) throw std::runtime_error(where + ": expected a time and a field");
+
+                bool vector_field = field == "lookfrom" || field == "lookat";
+                int count = vector_field ? 3 : 1;
+                for (int k = 0; k < count; k++) {
+                    if (!(in >> v[k])) throw std::runtime_error(where + ": expected " + std::to_string(count) + " numbers");
+                }
+
+                bool added;
+                if (field == "lookfrom") added = result.lookfrom.add(time, vec3(v[0], v[1], v[2]));
+                else if (field == "lookat") added = result.lookat.add(time, vec3(v[0], v[1], v[2]));
+                else if (field == "vfov") added = result.vfov.add(time, v[0]);
+                else if (field == "focus_dist") added = result.focus_dist.add(time, v[0]);
+                else throw std::runtime_error(where + ": unknown or unanimated camera field '" + field + "'");
+
+                if (!added) throw std::runtime_error(where + ": keys of a field must be in order of increasing time");
+            }
+
+            if (result.empty()) throw std::runtime_error("Camera path '" + path + "' has no keys");
+            return result;
+        }
+};
+
+/*
+ * The path of frame index, made by replacing the last run of '#' in pattern with the frame number, zero padded to the
+ * length of the run. Without a '#', the number is inserted before the extension as "-0000".
+ */
+inline std::string frame_path(const std::string& pattern, int index) {
+    auto last = pattern.find_last_of('#');
+    if (last == std::string::npos) {
+        auto dot = pattern.find_last_of('.');
+        auto slash = pattern.find_last_of('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = pattern.size();
+        return frame_path(pattern.substr(0, dot) + "-####" + pattern.substr(dot), index);
+    }
+
+    auto first = pattern.find_last_not_of('#', last);
+    first = first == std::string::npos ? 0 : first + 1;
+
+    std::string number = std::to_string(index);
+    if (number.size() < last + 1 - first) number.insert(0, last + 1 - first - number.size(), '0');
+    return pattern.substr(0, first) + number + pattern.substr(last + 1);
+}
+
+/*
+ * Renders frame_count frames along the camera path, handing each to write_frame(index, image) as it is done.
+ *
+ * The scene, its acceleration structures and the camera's thread pool are all reused from frame to frame, and
+ * write_frame runs on a thread of its own, so encoding and writing one frame overlaps with rendering the next. Only
+ * one frame is written at a time: rendering a frame finishes by waiting for the previous one to be written. An
+ * exception thrown by write_frame is rethrown here.
+ */
+inline void render_animation(camera& cam, const hittable& world, const camera_path& path, int frame_count,
+                             const std::function<void(int, const image&)>& write_frame) {
+    std::future<void> writing;
+    for (int index = 0; index < frame_count; index++) {
+        path.apply(cam, path.frame_time(index, frame_count));
+        image frame = cam.render(world);
+
+        if (writing.valid()) writing.get();
+        writing = std::async(std::launch::async, [&write_frame, index, frame = std::move(frame)] { write_frame(index, frame); });
+    }
+    if (writing.valid()) writing.get();
+}
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable-list.h"
+
+#include <algorithm>
+#include <vector>
+
+/*
+	Bounding volume hierarchy.
+
+	The tree is built top-down with the surface area heuristic (SAH): primitives are binned along each axis by
+	centroid, and the partition with the lowest expected intersection cost is chosen. A node is only split when doing
+	so is expected to be cheaper than testing all of its primitives directly.
+
+	Nodes are stored flattened in depth-first order, so the left child of a node always directly follows it and only
+	the index of the right child needs storing. Leaves reference a contiguous range of prim_indices, which lets the
+	owning hittable reorder its primitives to match and keep each leaf's data together in memory.
+
+	bvh_tree only deals with boxes, so it can be shared by anything which needs an acceleration structure over a set of
+	primitives. The bvh class below wraps it into a hittable for arbitrary objects.
+
+	For moving primitives (see hittable::moving), every node has a box at either end of the motion, and traversal
+	interpolates them to the time of the ray. Each box tested is then about as tight as the primitives are at that
+	moment, where boxes around the whole of their motion would overlap heavily and be entered by many more rays.
+*/
+
+struct bvh_node {
+	aabb bbox;
+	int offset;	// Interior nodes: index of the right child. Leaves: index of the first primitive
+	int count;	// Number of primitives in a leaf, 0 for interior nodes
+	int axis;	// Axis interior nodes were split along, used to visit children front to back
+};
+
+class bvh_tree {
+	public:
+		std::vector<bvh_node> nodes;
+		std::vector<int> prim_indices;
+
+		// Upper bound on tree depth, and so on the size of the traversal stack
+		static constexpr int max_depth = 96;
+
+		/*
+			Builds the tree over the given primitive boxes. prim_indices[i] is the index (into prim_bounds) of the
+			primitive that should be stored at position i after the build.
+
+			intersect_cost is the cost of testing one primitive relative to a box test, which weighs how eagerly nodes
+			are split. Leaves never hold more than max_leaf_size primitives unless their centroids all coincide.
+		*/
+		void build(const std::vector<aabb>& prim_bounds, int max_leaf_size = 4, double intersect_cost = 1.0) {
+			nodes.clear();
+			end_boxes.clear();
+			prim_indices.clear();
+			if (prim_bounds.empty()) return;
+
+			std::vector<build_prim> prims(prim_bounds.size());
+			for (size_t i = 0; i < prims.size(); i++) {
+				prims[i].bbox = prim_bounds[i];
+				prims[i].centroid = prim_bounds[i].centroid();
+				prims[i].index = int(i);
+			}
+
+			nodes.reserve(2 * prims.size());
+			build_recursive(prims, 0, int(prims.size()), 0, std::max(1, max_leaf_size), intersect_cost);
+
+			prim_indices.reserve(prims.size());
+			for (const auto& prim : prims) prim_indices.push_back(prim.index);
+		}
+
+		/*
+			Builds the tree over moving primitives, given their boxes at times 0 and 1. The tree is shaped by the boxes
+			halfway through the motion, and then each node is given boxes enclosing its primitives at either end.
+		*/
+		void build(const std::vector<aabb>& start_bounds, const std::vector<aabb>& end_bounds, int max_leaf_size = 4, double intersect_cost = 1.0) {
+			std::vector<aabb> middle(start_bounds.size());
+			for (size_t i = 0; i < middle.size(); i++) middle[i] = aabb::lerp(start_bounds[i], end_bounds[i], 0.5);
+			build(middle, max_leaf_size, intersect_cost);
+
+			// Children always come after their parent, so a backwards sweep sees them first
+			end_boxes.resize(nodes.size());
+			for (int k = int(nodes.size()) - 1; k >= 0; k--) {
+				bvh_node& node = nodes[k];
+				aabb start, end;
+				if (node.count > 0) {
+					for (int i = node.offset; i < node.offset + node.count; i++) {
+						start = aabb(start, start_bounds[prim_indices[i]]);
+						end = aabb(end, end_bounds[prim_indices[i]]);
+					}
+				} else {
+					start = aabb(nodes[k + 1].bbox, nodes[node.offset].bbox);
+					end = aabb(end_boxes[k + 1], end_boxes[node.offset]);
+				}
+				node.bbox = start;
+				end_boxes[k] = end;
+			}
+		}
+
+		bool moving() const { return !end_boxes.empty(); }
+
+		aabb bounding_box() const {
+			if (nodes.empty()) return aabb::empty;
+			return moving() ? aabb(nodes[0].bbox, end_boxes[0]) : nodes[0].bbox;
+		}
+
+		aabb start_bounding_box() const { return nodes.empty() ? aabb::empty : nodes[0].bbox; }
+		aabb end_bounding_box() const { return moving() ? end_boxes[0] : start_bounding_box(); }
+
+		/*
+			Walks the tree along the ray, calling intersect_leaf(first, count, ray_t) for every leaf the ray reaches.
+
+			intersect_leaf should return true if it found a hit, and shrink ray_t.max to the distance of that hit so
+			that nodes further away than the closest hit so far are culled. Children are visited nearest first
+			(judged by the sign of the ray direction along the split axis) to make that culling effective.
+		*/
+		template <typename F>
+		bool traverse(const ray& r, interval ray_t, F&& intersect_leaf) const {
+			return moving() ? walk<false, true>(r, ray_t, intersect_leaf) : walk<false, false>(r, ray_t, intersect_leaf);
+		}
+
+		// As traverse(), but returns as soon as any leaf reports a hit, for occlusion queries
+		template <typename F>
+		bool traverse_any(const ray& r, interval ray_t, F&& intersect_leaf) const {
+			return moving() ? walk<true, true>(r, ray_t, intersect_leaf) : walk<true, false>(r, ray_t, intersect_leaf);
+		}
+
+	private:
+		struct build_prim {
+			aabb bbox;
+			point3 centroid;
+			int index;
+		};
+
+		struct bin {
+			aabb bbox;
+			int count = 0;
+		};
+
+		// Boxes of the nodes at time 1 for a moving tree, whose nodes' own boxes are then those at time 0. Otherwise empty
+		std::vector<aabb> end_boxes;
+
+		static constexpr int bin_count = 16;
+		static constexpr double traversal_cost = 1.0;
+
+		// Past this depth nodes are split at the median, which bounds the total depth of the tree
+		static constexpr int sah_depth_limit = 64;
+
+		template <bool any_hit, bool motion, typename F>
+		bool walk(const ray& r, interval ray_t, F& intersect_leaf) const {
+			if (nodes.empty()) return false;
+
+			const point3& origin = r.origin();
+			const vec3& dir = r.direction();
+			vec3 inv_dir(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+			bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+			int stack[max_depth];
+			int stack_size = 0;
+			int current = 0;
+			bool hit_anything = false;
+
+			while (true) {
+				const bvh_node& node = nodes[current];
+				STATS_COUNT(bvh_nodes);
+
+				bool entered;
+				if constexpr (motion) entered = aabb::lerp(node.bbox, end_boxes[current], r.time()).hit(origin, inv_dir, ray_t);
+				else entered = node.bbox.hit(origin, inv_dir, ray_t);
+
+				if (entered) {
+					if (node.count > 0) {
+						if (intersect_leaf(node.offset, node.count, ray_t)) {
+							if constexpr (any_hit) return true;
+							hit_anything = true;
+						}
+						if (stack_size == 0) break;
+						current = stack[--stack_size];
+					} else if (dir_is_neg[node.axis]) {
+						stack[stack_size++] = current + 1;
+						current = node.offset;
+					} else {
+						stack[stack_size++] = node.offset;
+						current = current + 1;
+					}
+				} else {
+					if (stack_size == 0) break;
+					current = stack[--stack_size];
+				}
+			}
+
+			return hit_anything;
+		}
+
+		void make_leaf(int node_index, const aabb& bounds, int begin, int end) {
+			nodes[node_index] = bvh_node{ bounds, begin, end - begin, 0 };
+		}
+
+		int build_recursive(std::vector<build_prim>& prims, int begin, int end, int depth, int max_leaf_size, double intersect_cost) {
+			int node_index = int(nodes.size());
+			nodes.emplace_back();
+
+			aabb bounds;
+			point3 cmin(infinity, infinity, infinity);
+			point3 cmax(-infinity, -infinity, -infinity);
+			for (int i = begin; i < end; i++) {
+				bounds = aabb(bounds, prims[i].bbox);
+				for (int a = 0; a < 3; a++) {
+					cmin[a] = std::fmin(cmin[a], prims[i].centroid[a]);
+					cmax[a] = std::fmax(cmax[a], prims[i].centroid[a]);
+				}
+			}
+
+			int count = end - begin;
+			if (count == 1) {
+				make_leaf(node_index, bounds, begin, end);
+				return node_index;
+			}
+
+			// Evaluate the SAH cost of splitting between every pair of adjacent bins, on all three axes
+			int best_axis = -1;
+			int best_split = 0;
+			double best_cost = infinity;
+
+			if (depth < sah_depth_limit) {
+				for (int axis = 0; axis < 3; axis++) {
+					double extent = cmax[axis] - cmin[axis];
+					if (extent <= 0) continue;
+
+					bin bins[bin_count];
+					double scale = bin_count / extent;
+					for (int i = begin; i < end; i++) {
+						int b = std::min(bin_count - 1, int((prims[i].centroid[axis] - cmin[axis]) * scale));
+						bins[b].count++;
+						bins[b].bbox = aabb(bins[b].bbox, prims[i].bbox);
+					}
+
+					// Sweep from the right to accumulate the cost of everything right of each split plane
+					double right_cost[bin_count];
+					aabb right_box;
+					int right_count = 0;
+					for (int b = bin_count - 1; b > 0; b--) {
+						right_box = aabb(right_box, bins[b].bbox);
+						right_count += bins[b].count;
+						right_cost[b] = right_count * right_box.surface_area();
+					}
+
+					aabb left_box;
+					int left_count = 0;
+					for (int b = 0; b < bin_count - 1; b++) {
+						left_box = aabb(left_box, bins[b].bbox);
+						left_count += bins[b].count;
+						if (left_count == 0 || left_count == count) continue;
+
+						double cost = left_count * left_box.surface_area() + right_cost[b + 1];
+						if (cost < best_cost) {
+							best_cost = cost;
+							best_axis = axis;
+							best_split = b;
+						}
+					}
+				}
+			}
+
+			double leaf_cost = count * intersect_cost;
+			double area = bounds.surface_area();
+			if (best_axis >= 0 && area > 0)
+				best_cost = traversal_cost + intersect_cost * best_cost / area;
+
+			if (count <= max_leaf_size && (best_axis < 0 || best_cost >= leaf_cost)) {
+				make_leaf(node_index, bounds, begin, end);
+				return node_index;
+			}
+
+			int mid;
+			int axis;
+			if (best_axis >= 0) {
+				axis = best_axis;
+				double scale = bin_count / (cmax[axis] - cmin[axis]);
+				auto it = std::partition(prims.begin() + begin, prims.begin() + end, [&](const build_prim& p) {
+					int b = std::min(bin_count - 1, int((p.centroid[axis] - cmin[axis]) * scale));
+					return b <= best_split;
+				});
+				mid = int(it - prims.begin());
+			} else {
+				// No useful SAH split (coincident centroids, or too deep), so split at the median instead
+				axis = bounds.longest_axis();
+				mid = begin + count / 2;
+				std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+					[axis](const build_prim& a, const build_prim& b) { return a.centroid[axis] < b.centroid[axis]; });
+			}
+
+			build_recursive(prims, begin, mid, depth + 1, max_leaf_size, intersect_cost);
+			int right = build_recursive(prims, mid, end, depth + 1, max_leaf_size, intersect_cost);
+
+			nodes[node_index] = bvh_node{ bounds, right, 0, axis };
+			return node_index;
+		}
+};
+
+/*
+	Hittable wrapping a bvh_tree over arbitrary hittable objects. Intersection cost grows logarithmically with the
+	number of objects, rather than linearly as with hittable_list.
+
+	Any hittable_list can be converted into one, e.g.
+
+		world = hittable_list(make_shared<bvh>(world));
+*/
+class bvh : public hittable {
+	public:
+		bvh(const hittable_list& list) : bvh(list.objects) {}
+
+		bvh(const std::vector<shared_ptr<hittable>>& src_objects) {
+			bool any_moving = false;
+			for (const auto& object : src_objects) any_moving |= object->moving();
+
+			if (any_moving) {
+				std::vector<aabb> start, end;
+				start.reserve(src_objects.size());
+				end.reserve(src_objects.size());
+				for (const auto& object : src_objects) {
+					start.push_back(object->start_bounding_box());
+					end.push_back(object->end_bounding_box());
+				}
+				tree.build(start, end);
+			} else {
+				std::vector<aabb> bounds;
+				bounds.reserve(src_objects.size());
+				for (const auto& object : src_objects) bounds.push_back(object->bounding_box());
+				tree.build(bounds);
+			}
+
+			// Store objects in leaf order, so each leaf's objects are adjacent
+			objects.reserve(src_objects.size());
+			prims.reserve(src_objects.size());
+			for (int index : tree.prim_indices) {
+				objects.push_back(src_objects[index]);
+				prims.push_back(src_objects[index].get());
+			}
+		}
+
+		bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+			return tree.traverse(r, ray_t, [&](int first, int count, interval& t) {
+				hit_record temp_rec;
+				bool hit_anything = false;
+
+				for (int i = first; i < first + count; i++) {
+					if (prims[i]->hit(r, t, temp_rec)) {
+						hit_anything = true;
+						t.max = temp_rec.t;
+						rec = temp_rec;
+					}
+				}
+
+				return hit_anything;
+			});
+		}
+
+		bool occluded(const ray& r, interval ray_t) const override {
+			return tree.traverse_any(r, ray_t, [&](int first, int count, interval& t) {
+				for (int i = first; i < first + count; i++) {
+					if (prims[i]->occluded(r, t)) return true;
+				}
+				return false;
+			});
+		}
+
+		aabb bounding_box() const override { return tree.bounding_box(); }
+		bool moving() const override { return tree.moving(); }
+		aabb start_bounding_box() const override { return tree.start_bounding_box(); }
+		aabb end_bounding_box() const override { return tree.end_bounding_box(); }
+
+	private:
+		bvh_tree tree;
+		std::vector<shared_ptr<hittable>> objects;	// Keeps the objects alive
+		std::vector<const hittable*> prims;		// Same objects, used for traversal
+};
+
+#endif
@@ -3,14 +3,30 @@
 
 #include "hittable.h"
 #include "color.h"
+#include "image.h"
+#include "framebuffer.h"
 #include "util.h"
 #include "material.h"
+#include "thread-pool.h"
+#include "progress.h"
+#include "sampler.h"
+#include "accumulation.h"
+#include "wavefront.h"
+#include "lights.h"
+#include "denoiser.h"
 
+#include <atomic>
 #include <chrono>
 #include <thread>
-#include <atomic>
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
+class worker_processes;
+
 class camera {
     public:
         double aspect_ratio = 1.0;
@@ -19,6 +35,8 @@ class camera {
         double sample_radius = 0.5;
         double diffusion_colour_amount = 0.5;
         int max_recurse_depth = 10;
+        int rr_min_depth = 3;           // Bounces before Russian roulette may end a path. >= max_recurse_depth disables it
+        double min_throughput = 1e-4;   // Paths whose throughput falls below this end immediately
 
         double vfov = 90;
         point3 lookfrom = point3(0, 0, 0);
@@ -28,110 +46,450 @@ class camera {
         double defocus_angle = 0;
         double focus_dist = 10;
 
+        // Motion blur: every ray is cast at a moment picked evenly from [shutter_open, shutter_close] (see ray::time),
+        // and sees moving objects where they are at that moment. With the two equal the scene is seen at one instant
+        double shutter_open = 0;
+        double shutter_close = 0;
+
+        // What rays which escape the scene see: the sky gradient, or if sky is off a constant background_color
+        bool sky = true;
+        color background_color = color(0, 0, 0);
+
+        // Lights sampled directly at every diffuse bounce, with shadow rays (see direct_light). Lights which are not in
+        // the list, and all of them if light_sampling is off, are only found when paths happen to hit them
+        shared_ptr<const light_list> lights;
+        bool light_sampling = true;
+
+        // How pixel and lens positions are sampled, and the seed all of a render's random numbers derive from
+        sampler_type sampler = sampler_type::independent;
+        uint64_t seed = 0;
+
         bool multithread_mode = false;
+        int thread_count = 0;   // Threads used by multi_thread_render, 0 uses every hardware thread
+        int tile_size = 32;     // Side length in pixels of the square tiles handed out to threads
 
-        void render(const hittable& world) {
-            if (multithread_mode) multi_thread_render(world);
-            else single_thread_render(world);
+        /*
+         * Adaptive sampling. Rather than taking samples_per_pixel samples everywhere, each pixel stops once the
+         * estimated error of its mean drops below adaptive_threshold (in gamma corrected luminance, where 1 is full
+         * white), after at least adaptive_min_samples. The samples this saves within a tile are then spent on its
+         * noisiest pixels, up to adaptive_max_samples each (0 means 4 * samples_per_pixel).
+         */
+        bool adaptive_sampling = false;
+        double adaptive_threshold = 0.01;
+        int adaptive_min_samples = 16;
+        int adaptive_max_samples = 0;
+
+        int pass_samples = 8;   // Samples per pixel added by each pass of render_progressive, or task of render_distributed
+
+        // Once set, from any thread, render_progressive stops as soon as it can: tiles not yet started are skipped,
+        // and it returns when those in flight are done, with the buffer short of samples. For interactive previews
+        shared_ptr<const std::atomic<bool>> cancel;
+
+        // Render breadth first with wavefront_render rather than one path at a time, with at most this many paths in
+        // flight. Ignored with adaptive sampling and by render_progressive
+        bool wavefront_mode = false;
+        int wavefront_batch_size = 1 << 16;
+
+        // Worker threads for multi_thread_render. Created on first use, and may be shared between cameras
+        shared_ptr<thread_pool> pool;
+
+        // Where render progress is reported to. A silent_progress_reporter (or nullptr) disables it altogether
+        shared_ptr<progress_reporter> progress = make_shared<tty_progress_reporter>();
+
+        // Denoise what render() returns (see denoiser.h), guided by AOVs from aov_samples camera rays per pixel. Other
+        // renders can be denoised with denoised()
+        bool denoise = false;
+        denoise_settings denoiser;
+        int aov_samples = 4;
+
+        // Renders the world, returning the averaged linear colour of each pixel
+        image render(const hittable& world) {
+            image output;
+            if (wavefront_mode && !adaptive_sampling) output = wavefront_render(world);
+            else if (multithread_mode) output = multi_thread_render(world);
+            else output = single_thread_render(world);
+
+            if (denoise) output = denoised(output, render_aovs(world));
+            return output;
+        }
+
+        /*
+         * Finds what the camera rays of each pixel first hit, for the denoiser: their albedo, normal and depth (see
+         * aov_buffers), averaged over aov_samples rays. These are the camera rays of the pixel's first samples, so
+         * they match the image exactly, down to depth of field and motion blur, and cost only a camera ray each.
+         */
+        aov_buffers render_aovs(const hittable& world) {
+            initialize();
+            if (multithread_mode) ensure_pool();
+
+            aov_buffers aovs{ image(image_width, image_height), image(image_width, image_height), image(image_width, image_height) };
+            int count = std::max(1, aov_samples);
+            real scale = real(1) / count;
+
+            for_each_chunk((size_t)image_width * image_height, [&](size_t begin, size_t end, int, size_t) {
+                pixel_sampler samples(sampler, samples_per_pixel, seed);
+                for (size_t p = begin; p < end; p++) {
+                    int i = int(p % image_width), j = int(p / image_width);
+                    color albedo(0, 0, 0);
+                    vec3 normal(0, 0, 0);
+                    real depth = 0;
+                    int hits = 0;
+
+                    for (int s = 0; s < count; s++) {
+                        samples.start_sample(i, j, s);
+                        ray r = get_ray(i, j, samples);
+                        hit_record rec;
+                        if (world.hit(r, interval(0, infinity), rec)) {
+                            albedo += rec.mat->albedo();
+                            normal += rec.normal;
+                            depth += rec.t * r.direction().length();
+                            hits++;
+                        } else {
+                            albedo += background(r);
+                        }
+                    }
+
+                    aovs.albedo.pixels[p] = scale * albedo;
+                    aovs.normal.pixels[p] = scale * normal;
+                    aovs.depth.pixels[p] = color(1, 1, 1) * (hits > 0 ? depth / hits : 0);
+                }
+            });
+            return aovs;
+        }
+
+        // Filters a render of this camera with its denoiser settings, guided by aovs from render_aovs()
+        image denoised(const image& noisy, const aov_buffers& aovs) {
+            if (multithread_mode) ensure_pool();
+            return denoise_image(noisy, aovs, denoiser, multithread_mode ? pool.get() : nullptr);
         }
 
         /*
          *
-         * CPU Single threaded render function. Sequentially calculates the colour value for each pixel one by one
+         * CPU Single threaded render function. Sequentially calculates the colour value for each pixel, one tile at a time
          *
          */
-        void single_thread_render(const hittable& world) {
+        image single_thread_render(const hittable& world) {
             auto start = std::chrono::high_resolution_clock::now();
             initialize();
 
-            int total = image_height * image_width;
-            int cur = 0;
+            long long total = (long long)image_height * image_width;
+            bool report = progress && progress->enabled();
+            if (report) progress->begin(total);
 
-            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            framebuffer output(image_width, image_height, make_tiles());
+            progress_counters completed(1);
+            render_stats stats(1);
 
-            for (int j = 0; j < image_height; j++) {
-                for (int i = 0; i < image_width; i++) {
-                    color pixel_color(0,0,0);
+            for (int index = 0; index < output.tile_count(); index++) {
+                render_tile(world, output.tile_pixels(index), &completed, stats, 0, output.tile_at(index));
+                if (report) progress->update(completed.total(), total, elapsed_seconds(start));
+            }
 
-                    // Averages the colour around the pixel to avoid 'jagged' edges
-                    for (int sample = 0; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(i, j);
-                        pixel_color += ray_color(r, max_recurse_depth, world);
-                    }
+            samples_traced = stats.samples.total();
+            rays_traced = stats.rays.total();
+            if (report) progress->finish(total, elapsed_seconds(start));
+            return output.resolve();
+        }
 
-                    write_color(std::cout, pixel_samples_scale * pixel_color);
-                    ++cur;
-                    generate_loading_bar(cur, total, start);
+        /*
+         * Multi-threaded render. The image is split into square tiles of tile_size pixels, which are handed to a
+         * persistent work-stealing thread pool. Cheap tiles (e.g. open sky) finish early, and the threads which drew
+         * them then steal tiles from the others, so all threads stay busy until the image is done. Each tile is
+         * rendered into its own block of a framebuffer, so threads never write to the same cache line.
+         */
+
+        image multi_thread_render(const hittable& world) {
+            auto start = std::chrono::high_resolution_clock::now();
+            initialize();
+
+            long long total = (long long)image_height * image_width;
+            framebuffer output(image_width, image_height, make_tiles());
+
+            ensure_pool();
+
+            // Progress is only counted when someone is going to look at it
+            bool report = progress && progress->enabled();
+            progress_counters completed(pool->size());
+            progress_counters* counters = report ? &completed : nullptr;
+            if (report) progress->begin(total);
+
+            render_stats stats(pool->size());
+
+            pool->start(output.tile_count(), [&](int task, int worker) {
+                render_tile(world, output.tile_pixels(task), counters, stats, worker, output.tile_at(task));
+            });
+
+            if (report) {
+                // Periodically report progress while the pool works
+                while (!pool->wait_for(std::chrono::milliseconds(100))) {
+                    progress->update(completed.total(), total, elapsed_seconds(start));
                 }
+            } else {
+                pool->wait();
             }
 
-            // Calculate total time taken
-            auto stop = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::seconds>(stop - start).count();
-            long long minutes = duration / 60;
-            long long seconds = duration % 60;
-            std::clog << "\rTotal time taken: " << minutes << "m " << seconds << "s                                                                                                                                                \n";
+            samples_traced = stats.samples.total();
+            rays_traced = stats.rays.total();
+            if (report) progress->finish(total, elapsed_seconds(start));
+            return output.resolve();
         }
 
         /*
-         * Simple Multi-Threaded implmenetation. Divides work to be done across several different threads
+         * Progressive render. Samples are added to the accumulation buffer in passes of pass_samples per pixel, until
+         * every pixel has samples_per_pixel samples, and after_pass (if given) is called between passes, e.g. to write
+         * a preview image and checkpoint. pass_samples is read again for every pass, so after_pass may change it.
+         *
+         * The buffer may already hold samples, from a checkpoint or an earlier call: only the samples each pixel is
+         * missing are traced, so raising samples_per_pixel refines an existing render without redoing any of it. An
+         * empty buffer is set up for this camera. Throws std::runtime_error if the buffer belongs to a render with a
+         * different resolution, seed or sampler. Adaptive sampling does not apply to progressive renders.
          */
+        image render_progressive(const hittable& world, accumulation_buffer& accumulated,
+                                 const std::function<void(const accumulation_buffer&)>& after_pass = {}) {
+            auto start = std::chrono::high_resolution_clock::now();
+            initialize();
+            prepare_accumulation(accumulated);
+
+            long long total = 0;
+            for (auto count : accumulated.counts) total += std::max(0, samples_per_pixel - int(count));
+
+            bool report = progress && progress->enabled();
+            if (report) progress->begin(total);
+
+            if (multithread_mode) ensure_pool();
+            render_stats stats(multithread_mode ? pool->size() : 1);
+            std::vector<tile> tiles = make_tiles();
+            auto cancelled = [this] { return cancel && cancel->load(std::memory_order_relaxed); };
+
+            while (int(accumulated.min_count()) < samples_per_pixel && !cancelled()) {
+                int pass_size = std::max(1, pass_samples);
+                auto render_pass = [&](int task, int worker) {
+                    if (cancelled()) return;
+                    accumulate_tile(world, accumulated, stats, worker, tiles[task], pass_size);
+                };
+
+                if (multithread_mode) {
+                    pool->start(int(tiles.size()), render_pass);
+                    while (!pool->wait_for(std::chrono::milliseconds(100))) {
+                        if (report) progress->update(stats.samples.total(), total, elapsed_seconds(start));
+                    }
+                } else {
+                    for (int task = 0; task < int(tiles.size()); task++) {
+                        render_pass(task, 0);
+                        if (report) progress->update(stats.samples.total(), total, elapsed_seconds(start));
+                    }
+                }
 
-        void multi_thread_render(const hittable& world) {
+                if (after_pass && !cancelled()) after_pass(accumulated);
+            }
+
+            samples_traced = stats.samples.total();
+            rays_traced = stats.rays.total();
+            if (report) progress->finish(total, elapsed_seconds(start));
+            return accumulated.resolve();
+        }
+
+        /*
+         * Wavefront render. Rather than following each path to its end before starting the next, a batch of paths
+         * (every sample of a run of pixels, up to wavefront_batch_size paths) advances one bounce at a time, in
+         * stages which each run over the whole batch:
+         *
+         *  1. generate: a camera ray for every sample of the batch
+         *  2. intersect: the closest hit of every live path
+         *  3. sort: the paths are grouped by the kind of material they hit, with the misses in a group of their own
+         *  4. shade: misses take the colour of the sky, and hits add the light they emit or receive directly from the
+         *     lights (tracing shadow rays), then scatter, one kind of material after another
+         *  5. compact: paths still alive are packed together for the next bounce
+         *
+         * So each stage runs one piece of code over many paths, instead of every path running through all of them,
+         * which keeps that code and its data in cache. Stages are split into chunks across the thread pool in
+         * multithreaded mode, and run on the calling thread otherwise.
+         *
+         * Every path keeps its own random number state and the samples of a pixel are summed in order, so the image is
+         * identical to the one the depth-first renderers produce.
+         *
+         * Intersection is still one world.hit() per ray, so there is no batched traversal for the stages to pay for, and
+         * this is slower than the tiled renderer on the CPU. Its stages are what a batched intersector would slot into.
+         */
+        image wavefront_render(const hittable& world) {
             auto start = std::chrono::high_resolution_clock::now();
             initialize();
 
-            int total  = image_height * image_width;
-            std::vector<color> colors(total);
-            std::atomic<int> completed = 0;
+            long long total = (long long)image_height * image_width;
+            image output(image_width, image_height);
+
+            bool report = progress && progress->enabled();
+            if (report) progress->begin(total);
+
+            if (multithread_mode) ensure_pool();
+            int workers = multithread_mode ? pool->size() : 1;
+            render_stats stats(workers);
+
+            int spp = std::max(1, samples_per_pixel);
+            long long pixels_per_batch = std::max(1, wavefront_batch_size / spp);
+            size_t capacity = size_t(std::min(pixels_per_batch, total)) * spp;
+
+            path_batch paths, survivors;
+            paths.resize(capacity);
+            survivors.resize(capacity);
+            hit_batch hits;
+            hits.resize(capacity);
+            std::vector<path_random> random(capacity); // By slot, so compaction leaves them in place
+            std::vector<uint8_t> bucket(capacity);     // 0 for paths which missed, otherwise 1 + the type of material hit
+            std::vector<uint8_t> alive(capacity);
+            std::vector<uint32_t> order(capacity);
+            std::vector<color> radiance(capacity);
+
+            // Per chunk counts for the counting sort and the compaction
+            constexpr int buckets = 1 + material::type_count;  // Misses, then one per type of material
+            std::vector<std::array<size_t, buckets>> bucket_counts;
+            std::vector<size_t> survivor_counts;
+
+            for (long long first_pixel = 0; first_pixel < total; first_pixel += pixels_per_batch) {
+                long long pixel_count = std::min(pixels_per_batch, total - first_pixel);
+                size_t live = size_t(pixel_count) * spp;
+                paths.resize(live);
+
+                // Generate
+                for_each_chunk(live, [&](size_t begin, size_t end, int, size_t) {
+                    pixel_sampler samples(sampler, samples_per_pixel, seed);
+                    for (size_t k = begin; k < end; k++) {
+                        long long pixel = first_pixel + (long long)(k / spp);
+                        int i = int(pixel % image_width);
+                        int j = int(pixel / image_width);
+
+                        samples.start_sample(i, j, int(k % spp));
+                        paths.set_ray(k, get_ray(i, j, samples));
+                        paths.set_throughput(k, color(1, 1, 1));
+                        paths.scatter_pdf[k] = 0;
+                        paths.slot[k] = uint32_t(k);
+                        random[k] = { random_generator(), thread_sample_stream() };
+                        radiance[k] = color(0, 0, 0);
+                    }
+                });
+
+                for (int bounce = 0; bounce < max_recurse_depth && live > 0; bounce++) {
+                    size_t chunks = chunk_count(live);
+
+                    // Intersect, counting the paths of each chunk which go in each bucket for the sort
+                    bucket_counts.assign(chunks, {});
+                    for_each_chunk(live, [&](size_t begin, size_t end, int worker, size_t chunk) {
+                        for (size_t k = begin; k < end; k++) {
+                            if (bounce == 0) STATS_COUNT(primary_rays);
+                            else STATS_COUNT(secondary_rays);
+
+                            int b = 0;
+                            hit_record rec;
+                            if (world.hit(paths.get_ray(k), interval(0, infinity), rec)) {
+                                hits.set(k, rec);
+                                b = 1 + int(rec.mat->type());
+                            }
+                            bucket[k] = uint8_t(b);
+                            bucket_counts[chunk][b]++;
+                        }
+                        stats.rays.add(worker, (long long)(end - begin));
+                    });
+
+                    // Sort, a counting sort which gives every chunk its own range of each bucket
+                    size_t offset = 0;
+                    for (int b = 0; b < buckets; b++) {
+                        for (auto& counts : bucket_counts) offset += std::exchange(counts[b], offset);
+                    }
 
-            // Obtain available threads on machine
-            int thread_count = std::thread::hardware_concurrency();
-            if (thread_count == 0) {
-                std::clog << "Unable to determine thread count, defaulting to 2\n";
-                thread_count = 2;
-            }
+                    for_each_chunk(live, [&](size_t begin, size_t end, int, size_t chunk) {
+                        auto& next = bucket_counts[chunk];
+                        for (size_t k = begin; k < end; k++) order[next[bucket[k]]++] = uint32_t(k);
+                    });
+
+                    // Shade
+                    for_each_chunk(live, [&](size_t begin, size_t end, int worker, size_t) {
+                        long long shadow_rays = 0;
+                        for (size_t n = begin; n < end; n++) {
+                            size_t k = order[n];
+                            ray current = paths.get_ray(k);
+                            color throughput = paths.throughput(k);
+                            alive[k] = 0;
+
+                            if (bucket[k] == 0) {
+                                STATS_COUNT(misses);
+                                STATS_PATH_LENGTH(bounce + 1);
+                                radiance[paths.slot[k]] += throughput * background(current);
+                                continue;
+                            }
+                            STATS_COUNT(hits);
+
+                            uint32_t slot = paths.slot[k];
+                            hit_record rec = hits.get(k);
+                            random[slot].resume();
+                            radiance[slot] += throughput * direct_light(world, current, rec, paths.scatter_pdf[k], shadow_rays);
+
+                            ray scattered;
+                            double scatter_pdf;
+                            if (continue_path(current, rec, bounce, throughput, scatter_pdf, scattered)) {
+                                random[slot].suspend();
+                                paths.set_ray(k, scattered);
+                                paths.set_throughput(k, throughput);
+                                paths.scatter_pdf[k] = scatter_pdf;
+                                alive[k] = 1;
+                            }
+                        }
+                        stats.rays.add(worker, shadow_rays);
+                    });
+
+                    // Compact
+                    survivor_counts.assign(chunks, 0);
+                    for_each_chunk(live, [&](size_t begin, size_t end, int, size_t chunk) {
+                        for (size_t k = begin; k < end; k++) survivor_counts[chunk] += alive[k];
+                    });
+
+                    size_t survivor_total = 0;
+                    for (auto& count : survivor_counts) survivor_total += std::exchange(count, survivor_total);
+                    survivors.resize(survivor_total);
+
+                    for_each_chunk(live, [&](size_t begin, size_t end, int, size_t chunk) {
+                        size_t next = survivor_counts[chunk];
+                        for (size_t k = begin; k < end; k++) {
+                            if (alive[k]) paths.copy_path(survivors, next++, k);
+                        }
+                    });
+
+                    std::swap(paths, survivors);
+                    live = survivor_total;
+                }
 
-            // Initialize all threads
-            std::vector<std::thread> threads;
-            int rows_per_thread = image_height / thread_count;
-            for (int i{}; i < thread_count; ++i) {
-                int offset = i;
-                int chunk_size = thread_count;
-
-                threads.emplace_back(
-                    &camera::render_batch,
-                    this,
-                    std::cref(world),
-                    std::ref(colors),
-                    std::ref(completed),
-                    offset,
-                    thread_count
-                );
-            }
+                // Paths still going at the maximum depth never reach the sky, and keep only the light they have found so far
+                for (size_t k = 0; k < live; k++) STATS_PATH_LENGTH(max_recurse_depth);
 
-            // Periodically generate the loading bar. This thread is
-            while (completed < total) {
-                generate_loading_bar(completed, total, start);
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            }
+                // Sum each pixel's samples in order, as the depth-first renderers do
+                for_each_chunk(size_t(pixel_count), [&](size_t begin, size_t end, int worker, size_t) {
+                    for (size_t p = begin; p < end; p++) {
+                        color_sum pixel_color;
+                        for (int sample = 0; sample < spp; sample++) pixel_color += radiance[p * spp + sample];
 
-            for (auto& t : threads) {
-                t.join();
-            }
+                        long long pixel = first_pixel + (long long)p;
+                        output.at(int(pixel % image_width), int(pixel / image_width)) = pixel_color.scaled(pixel_samples_scale);
+                    }
+                    stats.samples.add(worker, (long long)(end - begin) * samples_per_pixel);
+                });
 
-            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-            for (int i{}; i < total; ++i) {
-                write_color(std::cout, pixel_samples_scale * colors[i]);
+                if (report) progress->update(first_pixel + pixel_count, total, elapsed_seconds(start));
             }
 
-            auto stop = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::seconds>(stop - start).count();
-            long long minutes = duration / 60;
-            long long seconds = duration % 60;
-            std::clog << "\rTotal time taken: " << minutes << "m " << seconds << "s                                                                                                                               \n";
+            samples_traced = stats.samples.total();
+            rays_traced = stats.rays.total();
+            if (report) progress->finish(total, elapsed_seconds(start));
+            return output;
         }
 
+        // Height of the images this camera renders, which follows from image_width and aspect_ratio
+        int output_height() const { return std::max(1, int(image_width / aspect_ratio)); }
+
+        // Number of camera samples traced by the last render, which adaptive sampling reduces
+        long long last_samples_traced() const { return samples_traced; }
+
+        // Number of rays intersected with the world by the last render, counting every bounce of every path
+        long long last_rays_traced() const { return rays_traced; }
+
     private:
 
         int image_height;
@@ -143,42 +501,235 @@ class camera {
         vec3 u, v, w;
         vec3 defocus_disk_u;
         vec3 defocus_disk_v;
+        long long samples_traced = 0;
+        long long rays_traced = 0;
+
+        // The coordinator and worker loops of distributed renders (see distributed.h), kept out of this header so that
+        // the camera does not depend on sockets and processes
+        friend image render_distributed(camera& cam, worker_processes& workers, accumulation_buffer& accumulated,
+                                        const std::function<void(const accumulation_buffer&)>& after_pass);
+        friend bool render_worker(camera& cam, const hittable& world, int input, int output);
+
+        // Work done by each worker during a render
+        struct render_stats {
+            progress_counters samples;
+            progress_counters rays;
+
+            explicit render_stats(int workers) : samples(workers), rays(workers) {}
+        };
+
+        // Sets up an empty buffer for this camera, or checks that a partly filled one is from a render like this one
+        void prepare_accumulation(accumulation_buffer& accumulated) const {
+            if (accumulated.empty()) {
+                accumulated = accumulation_buffer(image_width, image_height, seed, sampler);
+            } else if (accumulated.width != image_width || accumulated.height != image_height
+                       || accumulated.seed != seed || accumulated.sampler != sampler) {
+                throw std::runtime_error("Accumulation buffer does not match the camera's resolution, seed or sampler");
+            }
+        }
 
-        void generate_loading_bar(const int cur, int total, const std::chrono::time_point<std::chrono::high_resolution_clock>& start) {
-            int percent_complete = static_cast<int>((double(cur)/total) * 100.0);
+        // Reuses the pool from previous renders where possible, so threads are only created once
+        void ensure_pool() {
+            if (!pool || (thread_count > 0 && pool->size() != thread_count)) {
+                pool = make_shared<thread_pool>(thread_count);
+            }
+        }
+
+        static double elapsed_seconds(const std::chrono::time_point<std::chrono::high_resolution_clock>& start) {
             auto now = std::chrono::high_resolution_clock::now();
-            auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now-start).count();
-            long long minutes = elapsed / 60;
-            long long seconds = elapsed % 60;
-
-            std::clog << "[";
-            for (int i = 0; i < 100; i++) {
-                if (i < percent_complete) std::clog << "=";
-                else if (i == percent_complete) std::clog << ">";
-                else std::clog << " ";
+            return std::chrono::duration<double>(now - start).count();
+        }
+
+        // Paths per chunk of a wavefront stage: enough to make handing out a chunk cheap in comparison
+        static constexpr size_t wavefront_chunk = 1024;
+
+        static size_t chunk_count(size_t count) { return (count + wavefront_chunk - 1) / wavefront_chunk; }
+
+        // Calls body(begin, end, worker, chunk) for consecutive chunks of [0, count), on the pool in multithreaded mode
+        template <typename F>
+        void for_each_chunk(size_t count, F&& body) {
+            size_t chunks = chunk_count(count);
+            auto run = [&](int chunk, int worker) {
+                size_t begin = size_t(chunk) * wavefront_chunk;
+                body(begin, std::min(count, begin + wavefront_chunk), worker, size_t(chunk));
+            };
+
+            if (multithread_mode && chunks > 1) {
+                pool->start(int(chunks), run);
+                pool->wait();
+            } else {
+                for (size_t chunk = 0; chunk < chunks; chunk++) run(int(chunk), 0);
+            }
+        }
+
+        std::vector<tile> make_tiles() const {
+            int size = tile_size > 0 ? tile_size : 32;
+            std::vector<tile> tiles;
+            for (int y = 0; y < image_height; y += size) {
+                for (int x = 0; x < image_width; x += size) {
+                    tiles.push_back({x, y, std::min(x + size, image_width), std::min(y + size, image_height)});
+                }
             }
-            std::clog << "] " << percent_complete << "%, Elapsed Time: " << minutes << "m " << seconds << "s \r";
+            return tiles;
         }
 
-        void render_batch(const hittable& world, std::vector<color>& colors, std::atomic<int>& completed, int offset, int chunk_size) {
+        // Renders the tile's pixels into output, row by row
+        void render_tile(const hittable& world, color* output, progress_counters* completed, render_stats& stats, int worker, const tile& t) {
+            STATS_TILE_TIMER(t.x0, t.y0, t.x1, t.y1);
+            if (adaptive_sampling) {
+                render_tile_adaptive(world, output, completed, stats, worker, t);
+                return;
+            }
+
+            pixel_sampler samples(sampler, samples_per_pixel, seed);
+            long long rays = 0;
 
-            for  (int j = offset; j < image_height; j += chunk_size) {
-                for (int i{}; i < image_width; ++i) {
-                    color pixel_color(0, 0, 0);
+            for (int j = t.y0; j < t.y1; ++j) {
+                for (int i = t.x0; i < t.x1; ++i) {
+                    color_sum pixel_color;
                     for (int sample{}; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(i, j);
-                        pixel_color += ray_color(r, max_recurse_depth, world);
+                        samples.start_sample(i, j, sample);
+                        ray r = get_ray(i, j, samples);
+                        pixel_color += ray_color(r, max_recurse_depth, world, rays);
                     }
 
-                    colors[j * image_width + i] = pixel_color;
-                    ++completed;
+                    *output++ = pixel_color.scaled(pixel_samples_scale);
+                }
+
+                if (completed) completed->add(worker, t.x1 - t.x0);
+                stats.samples.add(worker, (long long)(t.x1 - t.x0) * samples_per_pixel);
+            }
+
+            stats.rays.add(worker, rays);
+        }
+
+        // Sum of samples [first, last) of pixel (i, j)
+        color_sum sample_sum(const hittable& world, pixel_sampler& samples, int i, int j, int first, int last, long long& rays) {
+            color_sum sum;
+            for (int sample = first; sample < last; sample++) {
+                samples.start_sample(i, j, sample);
+                ray r = get_ray(i, j, samples);
+                sum += ray_color(r, max_recurse_depth, world, rays);
+            }
+            return sum;
+        }
+
+        // Adds up to pass_size samples to every pixel of the tile, continuing each pixel's sample sequence
+        void accumulate_tile(const hittable& world, accumulation_buffer& accumulated, render_stats& stats, int worker, const tile& t, int pass_size) {
+            STATS_TILE_TIMER(t.x0, t.y0, t.x1, t.y1);
+            pixel_sampler samples(sampler, samples_per_pixel, seed);
+            long long rays = 0;
+
+            for (int j = t.y0; j < t.y1; ++j) {
+                for (int i = t.x0; i < t.x1; ++i) {
+                    size_t k = (size_t)j * image_width + i;
+                    int first = int(accumulated.counts[k]);
+                    int last = std::min(samples_per_pixel, first + pass_size);
+
+                    color_sum pixel_color = sample_sum(world, samples, i, j, first, last, rays);
+                    if (last > first) {
+                        accumulated.sums[k] += pixel_color;
+                        accumulated.counts[k] = uint32_t(last);
+                        stats.samples.add(worker, last - first);
+                    }
                 }
             }
+
+            stats.rays.add(worker, rays);
+        }
+
+        /*
+            Running estimate of one pixel. Alongside the colour sum, it tracks the mean and variance of the samples'
+            gamma corrected luminance (with Welford's method), from which the standard error of the mean follows.
+        */
+        struct pixel_estimate {
+            color_sum sum;
+            double mean = 0;
+            double m2 = 0;
+            int count = 0;
+
+            void add(const color& c) {
+                sum += c;
+                count++;
+
+                auto luminance = 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+                auto x = linear_to_gamma(std::fmin(luminance, 1.0));
+                auto delta = x - mean;
+                mean += delta / count;
+                m2 += delta * (x - mean);
+            }
+
+            double error() const {
+                if (count < 2) return infinity;
+                return std::sqrt(m2 / (double(count - 1) * count));
+            }
+        };
+
+        void render_tile_adaptive(const hittable& world, color* output, progress_counters* completed, render_stats& stats, int worker, const tile& t) {
+            const int batch = 8;
+            int min_samples = std::clamp(adaptive_min_samples, 2, std::max(2, samples_per_pixel));
+            int max_samples = adaptive_max_samples > 0 ? adaptive_max_samples : 4 * samples_per_pixel;
+
+            int width = t.x1 - t.x0;
+            int pixel_count = width * (t.y1 - t.y0);
+            std::vector<pixel_estimate> pixels(pixel_count);
+            pixel_sampler samples(sampler, samples_per_pixel, seed);
+            long long rays = 0;
+
+            auto take_samples = [&](int k, int n) {
+                int i = t.x0 + k % width;
+                int j = t.y0 + k / width;
+                auto& estimate = pixels[k];
+                for (int s = 0; s < n; s++) {
+                    samples.start_sample(i, j, estimate.count);
+                    ray r = get_ray(i, j, samples);
+                    estimate.add(ray_color(r, max_recurse_depth, world, rays));
+                }
+            };
+
+            auto converged = [&](int k) { return pixels[k].error() <= adaptive_threshold; };
+
+            // First pass: each pixel samples until it converges or reaches its share of the budget
+            long long budget = (long long)pixel_count * samples_per_pixel;
+            for (int k = 0; k < pixel_count; k++) {
+                take_samples(k, min_samples);
+                while (pixels[k].count < samples_per_pixel && !converged(k)) {
+                    take_samples(k, std::min(batch, samples_per_pixel - pixels[k].count));
+                }
+                budget -= pixels[k].count;
+            }
+
+            // Second pass: spend what the converged pixels saved on the noisiest remaining ones, a batch at a time
+            std::vector<int> noisy;
+            while (budget > 0) {
+                noisy.clear();
+                for (int k = 0; k < pixel_count; k++) {
+                    if (pixels[k].count < max_samples && !converged(k)) noisy.push_back(k);
+                }
+                if (noisy.empty()) break;
+
+                std::sort(noisy.begin(), noisy.end(), [&](int a, int b) { return pixels[a].error() > pixels[b].error(); });
+                for (int k : noisy) {
+                    if (budget <= 0) break;
+                    int n = int(std::min<long long>({ (long long)batch, (long long)(max_samples - pixels[k].count), budget }));
+                    take_samples(k, n);
+                    budget -= n;
+                }
+            }
+
+            long long taken = 0;
+            for (int k = 0; k < pixel_count; k++) {
+                output[k] = pixels[k].sum.scaled(1.0 / pixels[k].count);
+                taken += pixels[k].count;
+            }
+
+            if (completed) completed->add(worker, pixel_count);
+            stats.samples.add(worker, taken);
+            stats.rays.add(worker, rays);
         }
 
         void initialize() {
-            image_height = int(image_width / aspect_ratio);
-            image_height = (image_height < 1) ? 1 : image_height;
+            image_height = output_height();
 
             pixel_samples_scale = 1.0 / samples_per_pixel;
 
@@ -213,56 +764,185 @@ class camera {
             as for a simple anti-aliasing implementation.
 
             User can set the samples_per_pixel attribute in their camera object in order to set the number of samples for
-            anti-aliasing.
+            anti-aliasing. The sample positions come from the given sampler, which must have been started on this
+            pixel sample.
 
         */
-        ray get_ray(int i, int j) {
-            auto offset = sample_square();
+        ray get_ray(int i, int j, pixel_sampler& samples) const {
+            auto offset = sample_square(samples.pixel_2d());
             auto pixel_sample = pixel00_loc + ((i + offset.x()) * pixel_delta_u) + ((j + offset.y()) * pixel_delta_v);
 
-            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(samples.lens_2d());
             auto ray_direction = pixel_sample - ray_origin;
+            auto ray_time = shutter_close > shutter_open ? shutter_open + (shutter_close - shutter_open) * samples.time_1d() : shutter_open;
 
-            return ray(ray_origin, ray_direction);
+            return ray(ray_origin, ray_direction, real(ray_time));
         }
 
         /*
-            Returns a vector to a random point in the a square with side length 2 * sample-radius
+            Returns a vector to a point in the a square with side length 2 * sample-radius, given a point of the unit
+            square
 
             Used as a helper function to get_ray()
         */
-        vec3 sample_square() const {
-            auto px = random_double() - 0.5;
-            auto py = random_double() - 0.5;
+        vec3 sample_square(const sample_2d& s) const {
+            auto px = s.u - 0.5;
+            auto py = s.v - 0.5;
 
             return vec3(px * sample_radius * 2, py * sample_radius * 2, 0);
         }
 
-        point3 defocus_disk_sample() const {
-            auto p = random_in_unit_disk();
+        point3 defocus_disk_sample(const sample_2d& s) const {
+            auto p = sample_unit_disk(s.u, s.v);
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
 
         /*
-            Set to calculate colours based on direction of normals currently
+            Traces a path through the world, starting with ray r, for at most depth bounces.
+
+            Rather than recursing once per bounce, the loop carries the product of the attenuations seen so far
+            (the path throughput), which scales whatever light the path finally reaches. A path whose throughput has
+            fallen to (nearly) zero can no longer contribute, so it stops there instead of bouncing on to max depth.
+
+            After rr_min_depth bounces, paths are also terminated by Russian roulette: each continues with probability
+            equal to its brightest throughput channel, and survivors are scaled up to compensate, which keeps the
+            image unbiased while cutting most of the long, dim paths that glass-heavy scenes produce.
+
+            Light from emitters is gathered at every surface along the way (see direct_light), weighted by the
+            throughput up to there.
+
+            The number of rays traced along the path, shadow rays included, is added to rays.
         */
-        color ray_color(const ray& r, int depth, const hittable& world) {
-            if (depth <= 0) return color(0, 0, 0);
+        color ray_color(const ray& r, int depth, const hittable& world, long long& rays) {
+            color radiance(0, 0, 0);
+            color throughput(1, 1, 1);
+            double scatter_pdf = 0;
+            ray current = r;
+
+            for (int bounce = 0; bounce < depth; bounce++) {
+                hit_record rec;
+                rays++;
+                if (bounce == 0) STATS_COUNT(primary_rays);
+                else STATS_COUNT(secondary_rays);
+
+                // Scattered rays start just off the surface they leave (see hit_record::spawn_origin), so need no minimum distance
+                if (!world.hit(current, interval(0, infinity), rec)) {
+                    STATS_COUNT(misses);
+                    STATS_PATH_LENGTH(bounce + 1);
+                    return radiance + throughput * background(current);
+                }
+
+                STATS_COUNT(hits);
+                radiance += throughput * direct_light(world, current, rec, scatter_pdf, rays);
 
-            hit_record rec;
-            if (world.hit(r, interval(0.001, infinity), rec)) {
                 ray scattered;
-                color attenuation;
-                if (rec.mat->scatter(r, rec, attenuation, scattered))
-                    return attenuation * ray_color(scattered, depth-1, world);
-                return color(0, 0, 0);
+                if (!continue_path(current, rec, bounce, throughput, scatter_pdf, scattered)) return radiance;
+                current = scattered;
             }
 
+            STATS_PATH_LENGTH(depth);
+            return radiance;
+        }
+
+        // Colour seen along a ray which hits nothing
+        color background(const ray& r) const {
+            if (!sky) return background_color;
             vec3 unit_direction = unit_vector(r.direction());
             auto a = 0.5*(unit_direction.y() + 1);
             return (1.0-a)*color(1.0,1.0,1.0) + a*color(0.5,0.7,1.0);
         }
+
+        bool sampling_lights() const { return light_sampling && lights && !lights->empty(); }
+
+        /*
+            Light reaching the start of ray current straight from the hit rec: what the surface emits, plus at diffuse
+            surfaces a sample of the light arriving there directly from a light (next-event estimation), which costs
+            a shadow ray.
+
+            Both that sample and a later bounce which happens to hit a light can find the same light, so each is
+            weighted by multiple importance sampling (Veach's power heuristic): a light counts in proportion to how
+            likely the strategy which found it was to find it, compared to the other. scatter_pdf is the density with
+            which the last bounce picked current's direction, 0 for camera rays and mirror-like bounces, which light
+            sampling could never have produced, so what they hit counts in full.
+        */
+        color direct_light(const hittable& world, const ray& current, const hit_record& rec, double scatter_pdf, long long& rays) const {
+            color result(0, 0, 0);
+            if (rec.mat->emits()) {
+                result = rec.mat->emitted(rec);
+                int light = rec.mat->light_index();
+                if (scatter_pdf > 0 && light >= 0 && sampling_lights()) {
+                    result *= power_heuristic(scatter_pdf, lights->pdf(current.origin(), light));
+                }
+            }
+
+            if (!sampling_lights() || !rec.mat->diffuse()) return result;
+
+            light_sample sample;
+            if (!lights->sample(rec.p, sample)) return result;
+
+            color reflected = rec.mat->eval(rec, sample.direction);
+            if (reflected.near_zero()) return result;
+
+            rays++;
+            STATS_COUNT(shadow_rays);
+
+            // The shadow ray runs from just off the surface (see hit_record::spawn_origin) to the point sampled on the
+            // light, and stops just short of it, as the light would otherwise block it. Aiming it at that point rather
+            // than along the sampled direction matters in single precision, where the offset origin would move the
+            // ray noticeably sideways and so onto a nearer part of the light
+            point3 origin = rec.spawn_origin(sample.direction);
+            point3 target = rec.p + sample.distance * sample.direction;
+            ray shadow(origin, target - origin, current.time());
+            if (world.occluded(shadow, interval(0, 1 - shadow_epsilon))) {
+                STATS_COUNT(shadow_rays_blocked);
+                return result;
+            }
+
+            auto weight = power_heuristic(sample.pdf, rec.mat->pdf(rec, sample.direction));
+            return result + reflected * sample.emission * (weight / sample.pdf);
+        }
+
+        static constexpr double shadow_epsilon = 1e-4;
+
+        static double power_heuristic(double pdf, double other_pdf) {
+            return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+        }
+
+        /*
+            Scatters a path at the hit rec made by its ray current, on the given bounce: updates the throughput, and
+            returns whether the path goes on, along scattered, which was picked with density scatter_pdf (only needed,
+            and only set, when sampling lights). Paths end when they are absorbed, when their throughput becomes
+            negligible, or by Russian roulette.
+        */
+        bool continue_path(const ray& current, const hit_record& rec, int bounce, color& throughput, double& scatter_pdf, ray& scattered) const {
+            color attenuation;
+            if (!rec.mat->scatter(current, rec, attenuation, scattered)) {
+                STATS_COUNT(absorbed);
+                STATS_PATH_LENGTH(bounce + 1);
+                return false;
+            }
+
+            throughput = throughput * attenuation;
+            scatter_pdf = sampling_lights() ? rec.mat->pdf(rec, unit_vector(scattered.direction())) : 0;
+
+            auto max_throughput = std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z()));
+            if (max_throughput < min_throughput) {
+                STATS_PATH_LENGTH(bounce + 1);
+                return false;
+            }
+
+            if (bounce + 1 >= rr_min_depth) {
+                auto survive = std::fmin(max_throughput, 1.0);
+                if (random_double() >= survive) {
+                    STATS_PATH_LENGTH(bounce + 1);
+                    return false;
+                }
+                throughput /= survive;
+            }
+
+            return true;
+        }
 };
 
 #endif
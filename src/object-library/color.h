@@ -10,6 +10,40 @@
 // between color vectors and geometry vectors
 using color = vec3;
 
+/*
+ * Running sum of colours, such as the samples of a pixel. It is double precision whatever real is: with RAYTRACER_FLOAT
+ * a float sum of thousands of samples would round away most of each new sample's low bits.
+ */
+class color_sum {
+    public:
+        color_sum() : e{ 0, 0, 0 } {}
+        color_sum(double r, double g, double b) : e{ r, g, b } {}
+
+        double x() const { return e[0]; }
+        double y() const { return e[1]; }
+        double z() const { return e[2]; }
+
+        color_sum& operator+=(const color& c) {
+            e[0] += c.x();
+            e[1] += c.y();
+            e[2] += c.z();
+            return *this;
+        }
+
+        color_sum& operator+=(const color_sum& s) {
+            e[0] += s.e[0];
+            e[1] += s.e[1];
+            e[2] += s.e[2];
+            return *this;
+        }
+
+        // The sum times scale, e.g. one over the number of samples for their mean
+        color scaled(double scale) const { return color(real(e[0] * scale), real(e[1] * scale), real(e[2] * scale)); }
+
+    private:
+        double e[3];
+};
+
 /*
  * Converts RGB values from the liniear space to the gamma space.
  */
@@ -21,24 +55,25 @@ inline double linear_to_gamma(double linear_component) {
     return 0;
 }
 
+/*
+ * Converts one linear colour component into an 8-bit gamma space value.
+ *
+ * Expects the component to be in the range [0, 1], and clamps it into that range otherwise.
+ */
+inline unsigned char to_byte(double linear_component) {
+	// Translate the [0, 1] value into the appropriate [0, 255] byte range
+	static const interval intensity(0.000, 0.999);
+	return (unsigned char)(256 * intensity.clamp(linear_to_gamma(linear_component)));
+}
+
 // Writes out color data to specified outstream from one vector
 //
 // Expects vector components to be in the range [0, 1]. Converts them
 // to the [0, 255] range, and then outputs them in the ppm format.
 inline void write_color(std::ostream& out, const color& pixel_color) {
-	auto r = pixel_color.x();
-	auto g = pixel_color.y();
-	auto b = pixel_color.z();
-
-	r = linear_to_gamma(r);
-	g = linear_to_gamma(g);
-	b = linear_to_gamma(b);
-
-	// Translate the [0, 1] value into the appropriate [0, 255] byte range
-	static const interval intensity(0.000, 0.999);
-	int rbyte = int(256 * intensity.clamp(r));
-	int gbyte = int(255.999 * intensity.clamp(g));
-	int bbyte = int(255.999 * intensity.clamp(b));
+	int rbyte = to_byte(pixel_color.x());
+	int gbyte = to_byte(pixel_color.y());
+	int bbyte = to_byte(pixel_color.z());
 
 	out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
 }
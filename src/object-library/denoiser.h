@@ -0,0 +1,173 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "image.h"
+#include "thread-pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <utility>
+#include <vector>
+
+/*
+ * Denoising of renders taken with few samples per pixel, guided by auxiliary buffers (AOVs).
+ *
+ * aov_buffers describe what each pixel's camera rays first hit (see camera::render_aovs). Unlike the colour, they
+ * are nearly free of noise after a handful of samples, and their edges are the edges of the objects in the image.
+ *
+ * denoise_image() is the edge-avoiding à-trous wavelet filter (Dammertz, Sewtz, Hanika and Lensch, "Edge-Avoiding
+ * À-Trous Wavelet Transform for fast Global Illumination Filtering", 2010). A 5x5 B-spline blur is applied several
+ * times, with its taps spread twice as far apart on every pass, so that a few passes of 25 taps each blur a wide area.
+ * Every tap is weighted down by how much its pixel differs from the centre in colour, normal, depth and albedo, so
+ * the blur spreads along surfaces but stops at their edges, and fades as the colour differences it meets grow larger
+ * than the noise.
+ *
+ * The colour is divided by the albedo before filtering and multiplied back afterwards. What is blurred is then only
+ * the light falling on the surfaces, and the surfaces' own colours keep their full sharpness.
+ */
+
+struct aov_buffers {
+    image albedo;   // Colour of the surface first hit (see material::albedo), or the background where rays escape
+    image normal;   // Shading normal of the surface first hit, facing the camera, or zero where rays escape
+    image depth;    // Mean distance from the camera to the surfaces hit, in all three channels, or zero where every ray escapes
+};
+
+struct denoise_settings {
+    int iterations = 4;             // Passes of the filter. Pass k spaces its taps 2^k pixels apart
+    double color_sigma = 0.3;       // Colour difference (after tone compression) at which taps lose most of their weight
+    double normal_sigma = 0.02;     // Likewise for 1 - the cosine of the angle between normals
+    double depth_sigma = 0.01;      // Likewise for the relative difference in depth per pixel of distance
+    double albedo_sigma = 0.1;      // Likewise for albedo difference
+};
+
+/*
+ * Filters noisy guided by aovs, which must be of the same size. Each pass is split into rows across pool, if one is
+ * given.
+ */
+inline image denoise_image(const image& noisy, const aov_buffers& aovs, const denoise_settings& settings = {},
+                           thread_pool* pool = nullptr) {
+    const int width = noisy.width, height = noisy.height;
+    const size_t n = noisy.pixels.size();
+
+    // Dark albedos are clamped, so that dividing by them cannot blow the noise up beyond what the filter can handle
+    const real min_albedo = real(0.01);
+    std::vector<color> albedo(n);
+    std::vector<vec3> normal(n);
+    image current(width, height), next(width, height);
+    for (size_t k = 0; k < n; k++) {
+        const color& a = aovs.albedo.pixels[k];
+        albedo[k] = color(std::fmax(a.x(), min_albedo), std::fmax(a.y(), min_albedo), std::fmax(a.z(), min_albedo));
+        const color& c = noisy.pixels[k];
+        current.pixels[k] = color(c.x() / albedo[k].x(), c.y() / albedo[k].y(), c.z() / albedo[k].z());
+
+        const vec3& nk = aovs.normal.pixels[k];
+        real length = nk.length();
+        normal[k] = length > 0 ? nk / length : vec3(0, 0, 0);
+    }
+
+    // Colours are compared after compressing them into [0, 1), so that the filter is as strong in bright areas as
+    // in dark ones, and single very bright samples cannot stop it
+    auto compress = [](const color& c) { return color(c.x() / (1 + c.x()), c.y() / (1 + c.y()), c.z() / (1 + c.z())); };
+
+    /*
+     * Taps are compared with the median of the 3x3 pixels around the centre rather than the centre itself. A single
+     * very bright pixel then looks unlike the median and is blurred away, where compared with itself it would have
+     * kept all its own weight.
+     */
+    std::vector<color> guide(n);
+    auto find_guide = [&](int j, int) {
+        for (int i = 0; i < width; i++) {
+            real channels[3][9];
+            int count = 0;
+            for (int y = std::max(j - 1, 0); y <= std::min(j + 1, height - 1); y++) {
+                for (int x = std::max(i - 1, 0); x <= std::min(i + 1, width - 1); x++) {
+                    color c = compress(current.pixels[(size_t)y * width + x]);
+                    for (int k = 0; k < 3; k++) channels[k][count] = c[k];
+                    count++;
+                }
+            }
+            color median;
+            for (int k = 0; k < 3; k++) {
+                std::nth_element(channels[k], channels[k] + count / 2, channels[k] + count);
+                median[k] = channels[k][count / 2];
+            }
+            guide[(size_t)j * width + i] = median;
+        }
+    };
+
+    auto for_each_row = [&](const std::function<void(int, int)>& row) {
+        if (pool && height > 1) {
+            pool->start(height, row);
+            pool->wait();
+        } else {
+            for (int j = 0; j < height; j++) row(j, 0);
+        }
+    };
+
+    static constexpr double kernel[5] = { 1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16 };
+
+    for (int pass = 0; pass < settings.iterations; pass++) {
+        const int step = 1 << pass;
+
+        // Colour differences are penalised twice as hard on every pass (the colour variance halves, as in Dammertz et
+        // al.). Later passes see an image the earlier ones have already smoothed, where a difference that remains is
+        // more likely an edge than noise
+        const double color_scale = 1 / (settings.color_sigma * settings.color_sigma * std::ldexp(1.0, -pass));
+        const double normal_scale = 1 / settings.normal_sigma;
+        const double depth_scale = 1 / settings.depth_sigma;
+        const double albedo_scale = 1 / (settings.albedo_sigma * settings.albedo_sigma);
+
+        auto filter_row = [&](int j, int) {
+            for (int i = 0; i < width; i++) {
+                size_t p = (size_t)j * width + i;
+                const color& cp = guide[p];
+                const vec3& np = normal[p];
+                double zp = aovs.depth.pixels[p].x();
+                const color& ap = aovs.albedo.pixels[p];
+                bool hit_p = zp > 0;
+
+                color sum(0, 0, 0);
+                double total = 0;
+                for (int dy = -2; dy <= 2; dy++) {
+                    int y = j + dy * step;
+                    if (y < 0 || y >= height) continue;
+                    for (int dx = -2; dx <= 2; dx++) {
+                        int x = i + dx * step;
+                        if (x < 0 || x >= width) continue;
+
+                        size_t q = (size_t)y * width + x;
+                        double zq = aovs.depth.pixels[q].x();
+
+                        // Escaped rays and surfaces never mix
+                        if ((zq > 0) != hit_p) continue;
+
+                        double exponent = (compress(current.pixels[q]) - cp).length_squared() * color_scale;
+                        exponent += (aovs.albedo.pixels[q] - ap).length_squared() * albedo_scale;
+                        if (hit_p && (dx != 0 || dy != 0)) {
+                            exponent += (1 - dot(normal[q], np)) * normal_scale;
+                            double distance = step * std::sqrt(double(dx * dx + dy * dy));
+                            exponent += std::fabs(zq - zp) / (std::fmax(zp, zq) * distance) * depth_scale;
+                        }
+
+                        double weight = kernel[dx + 2] * kernel[dy + 2] * std::exp(-exponent);
+                        sum += weight * current.pixels[q];
+                        total += weight;
+                    }
+                }
+
+                // Keep the pixel as it is in the unlikely case every tap's weight underflowed
+                next.pixels[p] = total > 0 ? sum / total : current.pixels[p];
+            }
+        };
+
+        for_each_row(find_guide);
+        for_each_row(filter_row);
+        std::swap(current, next);
+    }
+
+    for (size_t k = 0; k < n; k++) current.pixels[k] = current.pixels[k] * albedo[k];
+    return current;
+}
+
+#endif
@@ -0,0 +1,485 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "camera.h"
+#include "accumulation.h"
+#include "framebuffer.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+/*
+ * Rendering across several processes: the coordinator's render_distributed() and the workers' render_worker().
+ *
+ * A coordinator starts worker processes, each of which loads the same scene and camera, and talks to every worker
+ * over a local socket on the worker's standard input and output. The coordinator sends tasks, each a tile and a range
+ * of sample indices, and the worker sends back the sum of those samples for every pixel of the tile. Every sample's
+ * random numbers derive from the seed, pixel and sample index (see sampler.h), so a task traces exactly the same
+ * samples whichever process it is given to, and a task a worker never finishes can be handed to another.
+ *
+ * Messages are plain structs, sent in the machine's own byte order:
+ *
+ *  - worker_hello, from the worker once its scene is loaded, so the coordinator can check it renders the same image
+ *  - task_message, from the coordinator. The worker exits when its input is closed
+ *  - result_message from the worker, followed by 3 doubles (the colour sum) per pixel of the task's tile, row by row
+ */
+
+struct worker_hello {
+    char magic[4];
+    uint32_t version;
+    uint32_t width, height;
+    uint64_t seed;
+    uint32_t sampler;
+    uint32_t samples_per_pixel;
+
+    static constexpr char expected_magic[4] = { 'R', 'T', 'W', 'K' };
+    static constexpr uint32_t current_version = 1;
+};
+
+struct task_message {
+    uint32_t id;
+    int32_t x0, y0, x1, y1;
+    int32_t first_sample, last_sample;
+};
+
+struct result_message {
+    uint32_t id;
+    uint32_t pixel_count;
+    int64_t rays;
+};
+
+// Reads exactly size bytes, returning false if the stream ends or fails first
+inline bool read_exact(int fd, void* data, size_t size) {
+    auto p = static_cast<unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+// Writes all size bytes, returning false if the stream fails first
+inline bool write_all(int fd, const void* data, size_t size) {
+    auto p = static_cast<const unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+// Waits until a non-blocking socket is ready for events, returning false once deadline has passed
+inline bool wait_before(int fd, short events, std::chrono::steady_clock::time_point deadline) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0) return false;
+    pollfd fds = { fd, events, 0 };
+    ::poll(&fds, 1, int(std::min<long long>(left.count() + 1, INT32_MAX)));
+    return true;
+}
+
+// Like read_exact, for a non-blocking socket, and also returning false if deadline passes first
+inline bool read_before(int fd, void* data, size_t size, std::chrono::steady_clock::time_point deadline) {
+    auto p = static_cast<unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = ::read(fd, p, size);
+        if (n > 0) {
+            p += n;
+            size -= size_t(n);
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) || !wait_before(fd, POLLIN, deadline)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Like write_all, for a non-blocking socket, and also returning false if deadline passes first
+inline bool send_before(int fd, const void* data, size_t size, std::chrono::steady_clock::time_point deadline) {
+    auto p = static_cast<const unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n > 0) {
+            p += n;
+            size -= size_t(n);
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) || !wait_before(fd, POLLOUT, deadline)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Worker processes started on this machine, each connected to the coordinator by a socket on its standard input and
+ * output.
+ *
+ * A worker which exits, or whose socket fails, is lost: its socket is closed and its process reaped, and it is never
+ * used again. So is one which takes longer than message_timeout to finish sending or accepting a message it has
+ * started on, e.g. because it stopped part way through a result; the coordinator's sockets never block. Destroying the set closes the remaining sockets, which tells the workers to exit, and waits for them.
+ */
+class worker_processes {
+    public:
+        /*
+         * Starts count processes running executable with the given arguments, the first of which is the name the
+         * process is given. Throws std::runtime_error if a socket cannot be made or a process cannot be started.
+         */
+        worker_processes(const std::string& executable, const std::vector<std::string>& arguments, int count,
+                         std::chrono::milliseconds message_timeout = std::chrono::seconds(10))
+            : message_timeout(message_timeout) {
+            std::vector<char*> argv;
+            for (const auto& arg : arguments) argv.push_back(const_cast<char*>(arg.c_str()));
+            argv.push_back(nullptr);
+
+            for (int k = 0; k < count; k++) {
+                int ends[2];
+                if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ends) != 0) {
+                    stop();
+                    throw std::runtime_error("Unable to create a socket for a render worker");
+                }
+                ::fcntl(ends[0], F_SETFL, ::fcntl(ends[0], F_GETFL) | O_NONBLOCK);
+
+                // The worker's end becomes its standard input and output. Every other socket is closed on exec
+                posix_spawn_file_actions_t actions;
+                posix_spawn_file_actions_init(&actions);
+                posix_spawn_file_actions_adddup2(&actions, ends[1], STDIN_FILENO);
+                posix_spawn_file_actions_adddup2(&actions, ends[1], STDOUT_FILENO);
+
+                pid_t pid;
+                int failed = posix_spawn(&pid, executable.c_str(), &actions, nullptr, argv.data(), environ);
+                posix_spawn_file_actions_destroy(&actions);
+                ::close(ends[1]);
+
+                if (failed) {
+                    ::close(ends[0]);
+                    stop();
+                    throw std::runtime_error("Unable to start render worker '" + executable + "'");
+                }
+                workers.push_back({ pid, ends[0] });
+            }
+        }
+
+        ~worker_processes() { stop(); }
+
+        worker_processes(const worker_processes&) = delete;
+        worker_processes& operator=(const worker_processes&) = delete;
+
+        int size() const { return int(workers.size()); }
+
+        bool alive(int worker) const { return workers[worker].socket >= 0; }
+
+        int alive_count() const {
+            int count = 0;
+            for (const auto& w : workers) count += w.socket >= 0;
+            return count;
+        }
+
+        // Sends a message, losing the worker if that fails or takes longer than message_timeout
+        bool send(int worker, const void* data, size_t size) {
+            if (!alive(worker)) return false;
+            auto deadline = std::chrono::steady_clock::now() + message_timeout;
+            if (send_before(workers[worker].socket, data, size, deadline)) return true;
+
+            lose(worker);
+            return false;
+        }
+
+        // Reads exactly size bytes from a worker, losing it if that fails or takes longer than message_timeout
+        bool receive(int worker, void* data, size_t size) {
+            if (!alive(worker)) return false;
+            auto deadline = std::chrono::steady_clock::now() + message_timeout;
+            if (read_before(workers[worker].socket, data, size, deadline)) return true;
+
+            lose(worker);
+            return false;
+        }
+
+        /*
+         * Waits up to timeout for workers to have something to read, returning those which do. A worker which has
+         * exited is returned too, and loses itself on the next receive().
+         */
+        std::vector<int> wait(std::chrono::milliseconds timeout) {
+            std::vector<pollfd> fds;
+            std::vector<int> index;
+            for (int k = 0; k < size(); k++) {
+                if (!alive(k)) continue;
+                fds.push_back({ workers[k].socket, POLLIN, 0 });
+                index.push_back(k);
+            }
+
+            std::vector<int> ready;
+            if (fds.empty()) return ready;
+
+            if (::poll(fds.data(), fds.size(), int(timeout.count())) <= 0) return ready;
+            for (size_t k = 0; k < fds.size(); k++) {
+                if (fds[k].revents) ready.push_back(index[k]);
+            }
+            return ready;
+        }
+
+        // Stops using a worker: its socket is closed, and the process killed in case it has not already exited
+        void lose(int worker) {
+            auto& w = workers[worker];
+            if (w.socket < 0) return;
+
+            ::close(w.socket);
+            w.socket = -1;
+            ::kill(w.pid, SIGKILL);
+            ::waitpid(w.pid, nullptr, 0);
+            w.pid = -1;
+        }
+
+    private:
+        struct process {
+            pid_t pid;
+            int socket;     // The coordinator's end, or -1 once the worker is lost
+        };
+
+        std::vector<process> workers;
+        std::chrono::milliseconds message_timeout;
+
+        // Closes every socket, which tells the workers to exit, and waits until they have
+        void stop() {
+            for (auto& w : workers) {
+                if (w.socket >= 0) ::close(w.socket);
+                w.socket = -1;
+            }
+            for (auto& w : workers) {
+                if (w.pid > 0) ::waitpid(w.pid, nullptr, 0);
+                w.pid = -1;
+            }
+        }
+};
+
+/*
+ * Distributed render with cam. Like camera::render_progressive, but the samples are traced by worker processes
+ * running render_worker with the same scene and camera. The samples each tile is missing are split
+ * into tasks of pass_samples per pixel, which are handed out a pass at a time, two to each worker at once so
+ * that none sits idle waiting for its next one. after_pass (if given) is called whenever every tile has had
+ * another pass added.
+ *
+ * A tile's tasks are added to the buffer in order, so the image is exactly the one render_progressive makes,
+ * however many workers there are and whichever of them traced each task. The unfinished tasks of a worker
+ * which exits or is killed are handed to the others. Throws std::runtime_error if every worker is lost, if a
+ * worker renders a different image (another resolution, seed, sampler or sample count), or if a tile's pixels
+ * in the buffer have different numbers of samples.
+ */
+inline image render_distributed(camera& cam, worker_processes& workers, accumulation_buffer& accumulated,
+                                const std::function<void(const accumulation_buffer&)>& after_pass = {}) {
+    auto start = std::chrono::high_resolution_clock::now();
+    cam.initialize();
+    cam.prepare_accumulation(accumulated);
+
+    std::vector<tile> tiles = cam.make_tiles();
+    int pass_size = std::max(1, cam.pass_samples);
+
+    // Each tile carries on from the samples its pixels already have, which must be the same for all of them
+    std::vector<int> tile_start(tiles.size());
+    long long total = 0;
+    int passes = 0;
+    for (size_t k = 0; k < tiles.size(); k++) {
+        const tile& t = tiles[k];
+        uint32_t count = accumulated.counts[(size_t)t.y0 * cam.image_width + t.x0];
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                if (accumulated.counts[(size_t)j * cam.image_width + i] != count) {
+                    throw std::runtime_error("Accumulation buffer has tiles whose pixels have different sample counts");
+                }
+            }
+        }
+
+        tile_start[k] = int(count);
+        int missing = std::max(0, cam.samples_per_pixel - int(count));
+        total += (long long)missing * t.pixel_count();
+        passes = std::max(passes, (missing + pass_size - 1) / pass_size);
+    }
+
+    // Tasks are numbered pass by pass, so handing them out in order finishes every tile's pass before the next
+    std::vector<task_message> tasks;
+    std::vector<std::vector<uint32_t>> tile_tasks(tiles.size());    // Each tile's tasks, in order
+    std::vector<int> task_tile, task_pass;
+    std::vector<int> pass_tiles(passes, 0);                         // Tiles which have a task in each pass
+    for (int pass = 0; pass < passes; pass++) {
+        for (size_t k = 0; k < tiles.size(); k++) {
+            int first = tile_start[k] + pass * pass_size;
+            if (first >= cam.samples_per_pixel) continue;
+
+            const tile& t = tiles[k];
+            auto id = uint32_t(tasks.size());
+            tasks.push_back({ id, t.x0, t.y0, t.x1, t.y1, first, std::min(cam.samples_per_pixel, first + pass_size) });
+            tile_tasks[k].push_back(id);
+            task_tile.push_back(int(k));
+            task_pass.push_back(pass);
+            pass_tiles[pass]++;
+        }
+    }
+
+    bool report = cam.progress && cam.progress->enabled();
+    if (report) cam.progress->begin(total);
+
+    std::deque<uint32_t> queue;
+    for (uint32_t id = 0; id < tasks.size(); id++) queue.push_back(id);
+
+    std::vector<std::deque<uint32_t>> in_flight(workers.size());    // Tasks sent to each worker, in order
+    std::vector<bool> greeted(workers.size(), false);
+    std::vector<std::vector<color_sum>> held(tasks.size());         // Results waiting for a tile's earlier pass
+    std::vector<size_t> next_task(tiles.size(), 0);                 // Position in tile_tasks of the next to add
+    std::vector<int> pass_added(passes, 0);
+    int passes_done = 0;
+    size_t tasks_added = 0;
+    long long samples = 0, rays = 0;
+    std::vector<double> values;
+
+    while (tasks_added < tasks.size()) {
+        // A lost worker's tasks go back to the front of the queue, in their original order
+        for (int w = 0; w < workers.size(); w++) {
+            if (workers.alive(w)) continue;
+            while (!in_flight[w].empty()) {
+                queue.push_front(in_flight[w].back());
+                in_flight[w].pop_back();
+            }
+        }
+        if (workers.alive_count() == 0) throw std::runtime_error("Every render worker has stopped");
+
+        for (int w = 0; w < workers.size(); w++) {
+            while (workers.alive(w) && in_flight[w].size() < 2 && !queue.empty()) {
+                if (!workers.send(w, &tasks[queue.front()], sizeof(task_message))) break;
+                in_flight[w].push_back(queue.front());
+                queue.pop_front();
+            }
+        }
+
+        for (int w : workers.wait(std::chrono::milliseconds(100))) {
+            if (!greeted[w]) {
+                worker_hello hello;
+                if (!workers.receive(w, &hello, sizeof(hello))) continue;
+                if (std::memcmp(hello.magic, worker_hello::expected_magic, 4) != 0 || hello.version != worker_hello::current_version
+                    || hello.width != uint32_t(cam.image_width) || hello.height != uint32_t(cam.image_height) || hello.seed != cam.seed
+                    || hello.sampler != uint32_t(cam.sampler) || hello.samples_per_pixel != uint32_t(cam.samples_per_pixel)) {
+                    throw std::runtime_error("Render worker " + std::to_string(w) + " renders a different image");
+                }
+                greeted[w] = true;
+                continue;
+            }
+
+            // Workers answer their tasks in the order they were sent. Anything else is treated as a loss
+            result_message result;
+            if (!workers.receive(w, &result, sizeof(result))) continue;
+            if (in_flight[w].empty() || result.id != in_flight[w].front()
+                || result.pixel_count != tiles[task_tile[result.id]].pixel_count()) {
+                workers.lose(w);
+                continue;
+            }
+
+            values.resize(size_t(result.pixel_count) * 3);
+            if (!workers.receive(w, values.data(), values.size() * sizeof(double))) continue;
+            in_flight[w].pop_front();
+            rays += result.rays;
+
+            auto& sums = held[result.id];
+            sums.resize(result.pixel_count);
+            for (size_t k = 0; k < sums.size(); k++) sums[k] = color_sum(values[3 * k], values[3 * k + 1], values[3 * k + 2]);
+
+            // Add the tile's results for as many passes in a row as have arrived
+            int index = task_tile[result.id];
+            const tile& t = tiles[index];
+            while (next_task[index] < tile_tasks[index].size() && !held[tile_tasks[index][next_task[index]]].empty()) {
+                uint32_t id = tile_tasks[index][next_task[index]++];
+                const task_message& task = tasks[id];
+                auto ready = std::move(held[id]);
+
+                size_t k = 0;
+                for (int j = t.y0; j < t.y1; j++) {
+                    for (int i = t.x0; i < t.x1; i++, k++) {
+                        size_t pixel = (size_t)j * cam.image_width + i;
+                        accumulated.sums[pixel] += ready[k];
+                        accumulated.counts[pixel] = uint32_t(task.last_sample);
+                    }
+                }
+
+                samples += (long long)(task.last_sample - task.first_sample) * t.pixel_count();
+                pass_added[task_pass[id]]++;
+                tasks_added++;
+            }
+        }
+
+        while (passes_done < passes && pass_added[passes_done] == pass_tiles[passes_done]) {
+            passes_done++;
+            if (after_pass) after_pass(accumulated);
+        }
+
+        if (report) cam.progress->update(samples, total, cam.elapsed_seconds(start));
+    }
+
+    cam.samples_traced = samples;
+    cam.rays_traced = rays;
+    if (report) cam.progress->finish(total, cam.elapsed_seconds(start));
+    return accumulated.resolve();
+}
+
+/*
+ * Serves as a worker of render_distributed, rendering with cam: reads tasks from input and writes back their results
+ * until input is closed. Returns false if a task is invalid or a message cannot be written.
+ */
+inline bool render_worker(camera& cam, const hittable& world, int input = STDIN_FILENO, int output = STDOUT_FILENO) {
+    cam.initialize();
+
+    worker_hello hello = {};
+    std::memcpy(hello.magic, worker_hello::expected_magic, 4);
+    hello.version = worker_hello::current_version;
+    hello.width = uint32_t(cam.image_width);
+    hello.height = uint32_t(cam.image_height);
+    hello.seed = cam.seed;
+    hello.sampler = uint32_t(cam.sampler);
+    hello.samples_per_pixel = uint32_t(cam.samples_per_pixel);
+    if (!write_all(output, &hello, sizeof(hello))) return false;
+
+    task_message task;
+    std::vector<double> values;
+    while (read_exact(input, &task, sizeof(task))) {
+        tile t = { task.x0, task.y0, task.x1, task.y1 };
+        if (t.x0 < 0 || t.y0 < 0 || t.x1 > cam.image_width || t.y1 > cam.image_height || t.x0 >= t.x1 || t.y0 >= t.y1
+            || task.first_sample < 0 || task.last_sample < task.first_sample) {
+            return false;
+        }
+
+        pixel_sampler samples(cam.sampler, cam.samples_per_pixel, cam.seed);
+        long long rays = 0;
+        values.clear();
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                color_sum sum = cam.sample_sum(world, samples, i, j, task.first_sample, task.last_sample, rays);
+                values.insert(values.end(), { sum.x(), sum.y(), sum.z() });
+            }
+        }
+
+        result_message result = { task.id, uint32_t(t.pixel_count()), rays };
+        if (!write_all(output, &result, sizeof(result))) return false;
+        if (!write_all(output, values.data(), values.size() * sizeof(double))) return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "image.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+/*
+ * Pixel storage for the tiled renderers, laid out tile by tile rather than row by row.
+ *
+ * Neighbouring tiles of an image are rendered by different threads at the same time, and in a row-major buffer the
+ * pixels at either end of a tile's rows share cache lines with the tiles beside them, so threads keep taking those
+ * lines from each other. A framebuffer instead gives every tile one contiguous block of pixels starting on a cache
+ * line of its own, so no two tiles ever share a line. resolve() gathers the blocks into a row-major image once the
+ * render is done.
+ */
+
+// A rectangle of pixels, from (x0, y0) up to but not including (x1, y1)
+struct tile {
+	int x0, y0, x1, y1;
+
+	int width() const { return x1 - x0; }
+	int height() const { return y1 - y0; }
+	size_t pixel_count() const { return (size_t)width() * height(); }
+};
+
+class framebuffer {
+	public:
+		// The tiles must cover the image without overlapping
+		framebuffer(int width, int height, std::vector<tile> tiles) : width(width), height(height), tiles(std::move(tiles)) {
+			// Every block is padded to a whole number of pixels which also fills whole cache lines
+			size_t pixel_step = std::lcm(cache_line, sizeof(color)) / sizeof(color);
+
+			offsets.resize(this->tiles.size());
+			size_t total = 0;
+			for (size_t k = 0; k < this->tiles.size(); k++) {
+				offsets[k] = total;
+				total += (this->tiles[k].pixel_count() + pixel_step - 1) / pixel_step * pixel_step;
+			}
+
+			storage.reset(static_cast<color*>(::operator new[](std::max<size_t>(total, 1) * sizeof(color), std::align_val_t(cache_line))));
+			std::uninitialized_default_construct_n(storage.get(), total);
+		}
+
+		int tile_count() const { return int(tiles.size()); }
+		const tile& tile_at(int index) const { return tiles[index]; }
+
+		// The pixels of a tile, row by row, each row as wide as the tile
+		color* tile_pixels(int index) { return storage.get() + offsets[index]; }
+		const color* tile_pixels(int index) const { return storage.get() + offsets[index]; }
+
+		image resolve() const {
+			image output(width, height);
+			for (size_t k = 0; k < tiles.size(); k++) {
+				const tile& t = tiles[k];
+				const color* src = tile_pixels(int(k));
+				for (int j = t.y0; j < t.y1; j++, src += t.width()) {
+					std::copy(src, src + t.width(), &output.at(t.x0, j));
+				}
+			}
+			return output;
+		}
+
+	private:
+		static constexpr size_t cache_line = 64;
+
+		struct aligned_delete {
+			void operator()(color* pixels) const { ::operator delete[](pixels, std::align_val_t(cache_line)); }
+		};
+
+		int width, height;
+		std::vector<tile> tiles;
+		std::vector<size_t> offsets;	// First pixel of each tile's block
+		std::unique_ptr<color[], aligned_delete> storage;
+};
+
+#endif
@@ -9,6 +9,12 @@
 using std::make_shared;
 using std::shared_ptr;
 
+/*
+	A list of objects, shared so that lists, BVHs and instances can hold the same geometry. It is meant for a few large
+	objects: a scene puts its spheres in a sphere_set and its meshes in an instance_bvh, each of which stores its
+	primitives in contiguous arrays, and keeps its materials in a table of its own. Hits are then only ever reached
+	through plain pointers, and the shared_ptrs here are touched when the scene is built, not while rendering.
+*/
 class hittable_list : public hittable {
 	public:
 		std::vector<shared_ptr<hittable>> objects;
@@ -16,16 +22,29 @@ class hittable_list : public hittable {
 		hittable_list() {};
 		hittable_list(shared_ptr<hittable> object) { add(object); }
 
-		void clear() { objects.clear(); }
+		void clear() {
+			objects.clear();
+			bbox = aabb();
+			start_bbox = aabb();
+			end_bbox = aabb();
+			any_moving = false;
+		}
+
+		void add(shared_ptr<hittable> object) {
+			objects.push_back(object);
+			bbox = aabb(bbox, object->bounding_box());
+			start_bbox = aabb(start_bbox, object->start_bounding_box());
+			end_bbox = aabb(end_bbox, object->end_bounding_box());
+			any_moving |= object->moving();
+		}
 
-		void add(shared_ptr<hittable> object) { objects.push_back(object); }
-		
 
 		// Iterates through objects vec, and returns true if ray intersects with any object 
 		// in objects. Sets hit_record to contain hit values pertaining only to the closest 
 		// object (as this is the only one that is important)
 
 		bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+			STATS_ADD(list_tests, objects.size());
 			hit_record temp_rec;
 			bool hit_anything = false;
 			auto closest_so_far = ray_t.max;
@@ -40,6 +59,24 @@ class hittable_list : public hittable {
 
 			return hit_anything;
 		}
+
+		bool occluded(const ray& r, interval ray_t) const override {
+			for (const auto& object : objects) {
+				STATS_COUNT(list_tests);
+				if (object->occluded(r, ray_t)) return true;
+			}
+			return false;
+		}
+
+		aabb bounding_box() const override { return bbox; }
+		bool moving() const override { return any_moving; }
+		aabb start_bounding_box() const override { return start_bbox; }
+		aabb end_bounding_box() const override { return end_bbox; }
+
+	private:
+		aabb bbox;
+		aabb start_bbox, end_bbox;
+		bool any_moving = false;
 };
 
 #endif
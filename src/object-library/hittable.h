@@ -4,16 +4,25 @@
 #include "interval.h"
 #include "vec3.h"
 #include "ray.h"
+#include "aabb.h"
+#include "stats.h"
 
 class material;
 
+// Plain data, so hit records are cheap to copy around the intersection loops. The material is a non-owning
+// pointer: materials are owned by the scene (see scene.h), never by a hit record
 class hit_record {
 	public:
 		point3 p;
 		vec3 normal;
-		double t;
+		real t;
 		bool front_face;
-		shared_ptr<material> mat;
+		const material* mat;
+
+		// Bound on the rounding error in each coordinate of p, and the true surface normal (normal may be a shading
+		// normal). Together they say how far p has to move to be certainly off the surface, see spawn_origin()
+		real p_error;
+		vec3 geometric_normal;
 
 		void set_face_normal(const ray& r, const vec3& outward_normal) {
 			// Sets the hit record normal vector
@@ -21,6 +30,26 @@ class hit_record {
 
 			front_face = dot(r.direction(), outward_normal) < 0;
 			normal = front_face ? outward_normal : -outward_normal;
+			geometric_normal = outward_normal;
+		}
+
+		/*
+			Origin for a ray leaving the surface in direction dir.
+
+			Starting the ray exactly at p would let it hit the surface it is leaving again, at a tiny distance, since p
+			is only known to within p_error. Rather than ignoring all hits closer than some fixed distance, which is too
+			little for large or distant objects and too much for small ones (and far too little once the geometry is
+			single precision), the origin is moved along the normal to the side dir points to, just far enough that
+			the box of possible true positions of p lies entirely behind it (Pharr, Jakob and Humphreys, "Physically
+			Based Rendering", 4th ed., section 6.8.6). The box is grown by the rounding of the move itself, which pbrt
+			handles by stepping each coordinate to the next float instead; growing it costs no branches.
+		*/
+		point3 spawn_origin(const vec3& dir) const {
+			const vec3& n = geometric_normal;
+			real magnitude = std::fmax(std::fabs(p.x()), std::fmax(std::fabs(p.y()), std::fabs(p.z())));
+			real error = p_error + gamma_bound(2) * magnitude;
+			real distance = error * (std::fabs(n.x()) + std::fabs(n.y()) + std::fabs(n.z()));
+			return p + (dot(dir, n) < 0 ? -distance : distance) * n;
 		}
 };
 
@@ -29,6 +58,31 @@ class hittable {
 		virtual ~hittable() = default;
 
 		virtual bool hit(const ray&r, interval ray_t, hit_record& rec) const = 0;
+
+		/*
+			Whether anything is hit within ray_t, for shadow rays. Unlike hit() this may stop at the first hit found
+			rather than looking for the closest, and fills in no hit record, so objects override it with a cheaper test
+			where they can.
+		*/
+		virtual bool occluded(const ray& r, interval ray_t) const {
+			hit_record rec;
+			return hit(r, ray_t, rec);
+		}
+
+		// Box enclosing the whole object, used to build acceleration structures over it. For a moving object it
+		// encloses the whole of its motion
+		virtual aabb bounding_box() const = 0;
+
+		/*
+			Objects which move over the shutter (see ray::time) give boxes enclosing them at times 0 and 1, such that
+			the box interpolated linearly between the two encloses them at every time in between, as it does for
+			anything moving in straight lines at constant speeds. Acceleration structures interpolate them to the time
+			of each ray, which culls far more than the box around the whole motion would. Still objects need not
+			override these.
+		*/
+		virtual bool moving() const { return false; }
+		virtual aabb start_bounding_box() const { return bounding_box(); }
+		virtual aabb end_bounding_box() const { return bounding_box(); }
 };
 
 #endif
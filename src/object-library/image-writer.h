@@ -0,0 +1,251 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "image.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define IMAGE_WRITER_AVX 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Binary image encoders.
+ *
+ * Each encoder builds the complete file in memory in a single pass over the image, which is then written out with one
+ * call. This is far cheaper than formatting every pixel as text through an ostream, as the plain text P3 format does.
+ *
+ *  - ppm: binary P6, 8 bits per channel, gamma corrected.
+ *  - pfm: 32-bit float per channel in linear space, preserving values above 1 for HDR workflows.
+ *  - png: 8 bits per channel, gamma corrected. Stored uncompressed (deflate "stored" blocks), so no zlib is needed.
+ *
+ * Gamma correction and quantisation are done as the 8-bit formats are written, converting whole rows at a time.
+ */
+
+enum class image_format { ppm, pfm, png };
+
+// Guesses the format from the extension of a file path, defaulting to ppm
+inline image_format format_from_path(const std::string& path) {
+	auto dot = path.find_last_of('.');
+	if (dot == std::string::npos) return image_format::ppm;
+
+	std::string ext = path.substr(dot + 1);
+	for (auto& c : ext) c = char(std::tolower((unsigned char)c));
+
+	if (ext == "pfm") return image_format::pfm;
+	if (ext == "png") return image_format::png;
+	return image_format::ppm;
+}
+
+// Converts count linear components to gamma corrected bytes, exactly as to_byte does one at a time
+inline void components_to_bytes_scalar(const real* src, size_t count, unsigned char* dst) {
+	for (size_t k = 0; k < count; k++) dst[k] = to_byte(src[k]);
+}
+
+#ifdef IMAGE_WRITER_AVX
+// to_byte of 4 components. max and min take the place of its comparisons, and like them turn NaN into 0
+__attribute__((target("avx")))
+inline __m128i components_to_words_avx(const real* src) {
+#ifdef RAYTRACER_FLOAT
+	__m256d x = _mm256_cvtps_pd(_mm_loadu_ps(src));
+#else
+	__m256d x = _mm256_loadu_pd(src);
+#endif
+	__m256d gamma = _mm256_min_pd(_mm256_sqrt_pd(_mm256_max_pd(x, _mm256_setzero_pd())), _mm256_set1_pd(real(0.999)));
+#ifdef RAYTRACER_FLOAT
+	// to_byte clamps with an interval of floats, which rounds the gamma corrected value to float
+	gamma = _mm256_cvtps_pd(_mm256_cvtpd_ps(gamma));
+#endif
+	return _mm256_cvttpd_epi32(_mm256_mul_pd(gamma, _mm256_set1_pd(256)));
+}
+
+// components_to_bytes_scalar 8 components at a time
+__attribute__((target("avx")))
+inline void components_to_bytes_avx(const real* src, size_t count, unsigned char* dst) {
+	size_t k = 0;
+	for (; k + 8 <= count; k += 8) {
+		__m128i words = _mm_packus_epi32(components_to_words_avx(src + k), components_to_words_avx(src + k + 4));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + k), _mm_packus_epi16(words, words));
+	}
+	components_to_bytes_scalar(src + k, count - k, dst + k);
+}
+#endif
+
+inline void components_to_bytes(const real* src, size_t count, unsigned char* dst) {
+#ifdef IMAGE_WRITER_AVX
+	static const bool supported = __builtin_cpu_supports("avx");
+	if (supported) {
+		components_to_bytes_avx(src, count, dst);
+		return;
+	}
+#endif
+	components_to_bytes_scalar(src, count, dst);
+}
+
+// The components of a run of pixels, which are stored one after another
+inline const real* components(const color* pixels) {
+	static_assert(sizeof(color) == 3 * sizeof(real), "colours must be three packed components");
+	return pixels->e;
+}
+
+inline void append_text(std::vector<unsigned char>& out, const std::string& text) {
+	out.insert(out.end(), text.begin(), text.end());
+}
+
+inline std::vector<unsigned char> encode_ppm(const image& img) {
+	std::vector<unsigned char> out;
+	append_text(out, "P6\n" + std::to_string(img.width) + ' ' + std::to_string(img.height) + "\n255\n");
+
+	size_t header = out.size();
+	out.resize(header + img.pixels.size() * 3);
+	components_to_bytes(components(img.pixels.data()), img.pixels.size() * 3, out.data() + header);
+	return out;
+}
+
+inline std::vector<unsigned char> encode_pfm(const image& img) {
+	// A negative scale marks the data as little endian. Rows are stored bottom to top
+	std::vector<unsigned char> out;
+	append_text(out, "PF\n" + std::to_string(img.width) + ' ' + std::to_string(img.height) + "\n-1.0\n");
+
+	size_t header = out.size();
+	std::vector<float> row((size_t)img.width * 3);
+	out.resize(header + img.pixels.size() * 3 * sizeof(float));
+	unsigned char* dst = out.data() + header;
+
+	for (int j = img.height - 1; j >= 0; j--) {
+		for (int i = 0; i < img.width; i++) {
+			const color& pixel = img.at(i, j);
+			row[3 * i + 0] = float(pixel.x());
+			row[3 * i + 1] = float(pixel.y());
+			row[3 * i + 2] = float(pixel.z());
+		}
+
+		// PFM is little endian, as are all the platforms this is built for
+		std::memcpy(dst, row.data(), row.size() * sizeof(float));
+		dst += row.size() * sizeof(float);
+	}
+
+	return out;
+}
+
+inline uint32_t crc32(const unsigned char* data, size_t length, uint32_t crc = 0) {
+	static const auto table = [] {
+		std::vector<uint32_t> t(256);
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			t[n] = c;
+		}
+		return t;
+	}();
+
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+inline std::vector<unsigned char> encode_png(const image& img) {
+	auto put32 = [](std::vector<unsigned char>& out, uint32_t v) {
+		out.push_back((unsigned char)(v >> 24));
+		out.push_back((unsigned char)(v >> 16));
+		out.push_back((unsigned char)(v >> 8));
+		out.push_back((unsigned char)v);
+	};
+
+	auto put_chunk = [&](std::vector<unsigned char>& out, const char* type, const std::vector<unsigned char>& data) {
+		put32(out, uint32_t(data.size()));
+		size_t start = out.size();
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), data.begin(), data.end());
+		put32(out, crc32(out.data() + start, out.size() - start));
+	};
+
+	// Raw scanlines, each prefixed by filter type 0 (none)
+	size_t row_bytes = (size_t)img.width * 3 + 1;
+	std::vector<unsigned char> raw(row_bytes * img.height);
+	for (int j = 0; j < img.height; j++) {
+		unsigned char* dst = raw.data() + j * row_bytes;
+		*dst++ = 0;
+		components_to_bytes(components(&img.at(0, j)), (size_t)img.width * 3, dst);
+	}
+
+	// zlib stream made of uncompressed deflate blocks, which hold at most 65535 bytes each
+	std::vector<unsigned char> zlib = { 0x78, 0x01 };
+	const size_t max_block = 65535;
+	size_t pos = 0;
+	do {
+		size_t length = std::min(max_block, raw.size() - pos);
+		bool final_block = pos + length == raw.size();
+		zlib.push_back(final_block ? 1 : 0);
+		zlib.push_back((unsigned char)(length & 0xFF));
+		zlib.push_back((unsigned char)(length >> 8));
+		zlib.push_back((unsigned char)(~length & 0xFF));
+		zlib.push_back((unsigned char)((~length >> 8) & 0xFF));
+		zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + length);
+		pos += length;
+	} while (pos < raw.size());
+
+	// Adler-32. The sums cannot overflow within 5552 bytes, so they are only reduced once per run of that many
+	uint32_t a = 1, b = 0;
+	for (size_t start = 0; start < raw.size(); start += 5552) {
+		size_t end = std::min(raw.size(), start + 5552);
+		for (size_t k = start; k < end; k++) {
+			a += raw[k];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	put32(zlib, (b << 16) | a);
+
+	std::vector<unsigned char> header;
+	put32(header, uint32_t(img.width));
+	put32(header, uint32_t(img.height));
+	header.insert(header.end(), { 8, 2, 0, 0, 0 });	// 8-bit depth, RGB, default compression/filter, no interlace
+
+	std::vector<unsigned char> out = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	put_chunk(out, "IHDR", header);
+	put_chunk(out, "IDAT", zlib);
+	put_chunk(out, "IEND", {});
+	return out;
+}
+
+inline std::vector<unsigned char> encode_image(const image& img, image_format format) {
+	switch (format) {
+		case image_format::pfm: return encode_pfm(img);
+		case image_format::png: return encode_png(img);
+		default: return encode_ppm(img);
+	}
+}
+
+/*
+ * Writes the image to the given path, or to stdout if the path is empty or "-". Throws std::runtime_error if the file
+ * cannot be written.
+ */
+inline void write_image(const image& img, const std::string& path, image_format format) {
+	auto bytes = encode_image(img, format);
+
+	bool to_stdout = path.empty() || path == "-";
+	std::FILE* file = to_stdout ? stdout : std::fopen(path.c_str(), "wb");
+	if (!file) throw std::runtime_error("Unable to open '" + path + "' for writing");
+
+	size_t written = std::fwrite(bytes.data(), 1, bytes.size(), file);
+	bool failed = written != bytes.size();
+	failed |= to_stdout ? std::fflush(file) != 0 : std::fclose(file) != 0;
+
+	if (failed) throw std::runtime_error("Unable to write image to '" + (to_stdout ? std::string("stdout") : path) + "'");
+}
+
+inline void write_image(const image& img, const std::string& path) {
+	write_image(img, path, format_from_path(path));
+}
+
+#endif
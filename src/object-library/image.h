@@ -0,0 +1,27 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "color.h"
+
+#include <vector>
+
+/*
+ * A rendered image, holding one linear colour per pixel in row-major order from the top left.
+ *
+ * Pixels are stored before gamma correction and quantisation, so the same image can be written out to both low and
+ * high dynamic range formats.
+ */
+class image {
+	public:
+		int width = 0;
+		int height = 0;
+		std::vector<color> pixels;
+
+		image() {}
+		image(int width, int height) : width(width), height(height), pixels((size_t)width * height) {}
+
+		color& at(int i, int j) { return pixels[(size_t)j * width + i]; }
+		const color& at(int i, int j) const { return pixels[(size_t)j * width + i]; }
+};
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "bvh.h"
+#include "transform.h"
+
+#include <unordered_set>
+#include <vector>
+
+/*
+	Instancing: placing the same geometry in a scene many times without copying it.
+
+	An instance is a pointer to shared geometry (a sphere, triangle_mesh, sphere_set, bvh, ...) plus the transform from
+	the geometry's own space into the world. Rays are moved into the geometry's space rather than the geometry into
+	the world, so every instance of a million-triangle mesh shares the one mesh and its BVH.
+
+	instance_bvh is the top level of a two-level BVH: it stores its instances by value in one array and builds a
+	bvh_tree over their world space boxes, while each piece of geometry keeps its own bottom-level tree. Moving
+	instances only means rebuilding the (much smaller) top level, with build(). Instances keep the index add()
+	returned for them, so they can be found again to be moved.
+*/
+
+class instance final : public hittable {
+	public:
+		// The geometry must outlive the instance
+		instance(const hittable* geometry, const transform& object_to_world) : geometry(geometry) {
+			set_transform(object_to_world);
+		}
+
+		const hittable* object() const { return geometry; }
+		const transform& object_to_world() const { return xform; }
+
+		void set_transform(const transform& object_to_world) {
+			xform = object_to_world;
+			bbox = xform.bounds(geometry->bounding_box());
+		}
+
+		// The box of a transformed box is linear in it, so the geometry's motion stays within the interpolated boxes
+		bool moving() const override { return geometry->moving(); }
+		aabb start_bounding_box() const override { return xform.bounds(geometry->start_bounding_box()); }
+		aabb end_bounding_box() const override { return xform.bounds(geometry->end_bounding_box()); }
+
+		bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+			STATS_COUNT(instance_tests);
+
+			// The direction is transformed but not normalised, so distances along the ray are the same in both spaces
+			ray local(xform.inverse_point(r.origin()), xform.inverse_vector(r.direction()), r.time());
+			if (!geometry->hit(local, ray_t, rec)) return false;
+
+			rec.p_error = xform.point_error(rec.p, rec.p_error);
+			rec.p = xform.point(rec.p);
+			rec.normal = unit_vector(xform.normal(rec.normal));
+			rec.geometric_normal = unit_vector(xform.normal(rec.geometric_normal));
+			return true;
+		}
+
+		bool occluded(const ray& r, interval ray_t) const override {
+			STATS_COUNT(instance_tests);
+			ray local(xform.inverse_point(r.origin()), xform.inverse_vector(r.direction()), r.time());
+			return geometry->occluded(local, ray_t);
+		}
+
+		aabb bounding_box() const override { return bbox; }
+
+	private:
+		const hittable* geometry;
+		transform xform;
+		aabb bbox;
+};
+
+class instance_bvh : public hittable {
+	public:
+		// Adds an instance of geometry that must outlive the set, returning the instance's index
+		size_t add(const hittable* geometry, const transform& object_to_world) {
+			instances.emplace_back(geometry, object_to_world);
+			return instances.size() - 1;
+		}
+
+		// Adds an instance of geometry the set keeps alive. Any number of instances may share it
+		size_t add(shared_ptr<hittable> geometry, const transform& object_to_world) {
+			if (owned_index.insert(geometry.get()).second) owned.push_back(geometry);
+			return add(geometry.get(), object_to_world);
+		}
+
+		size_t size() const { return instances.size(); }
+
+		const instance& operator[](size_t index) const { return instances[index]; }
+
+		// Moves an instance. build() must be called again before the set is next rendered
+		void set_transform(size_t index, const transform& object_to_world) {
+			instances[index].set_transform(object_to_world);
+		}
+
+		// Builds the top-level tree over the instances' current boxes. The geometry's own trees are left alone
+		void build() {
+			bool any_moving = false;
+			for (const auto& object : instances) any_moving |= object.moving();
+
+			// Testing an instance means transforming the ray and walking another tree, so it pays to split finely
+			if (any_moving) {
+				std::vector<aabb> start(instances.size()), end(instances.size());
+				for (size_t k = 0; k < instances.size(); k++) {
+					start[k] = instances[k].start_bounding_box();
+					end[k] = instances[k].end_bounding_box();
+				}
+				tree.build(start, end, 2, 4.0);
+			} else {
+				std::vector<aabb> bounds(instances.size());
+				for (size_t k = 0; k < instances.size(); k++) bounds[k] = instances[k].bounding_box();
+				tree.build(bounds, 2, 4.0);
+			}
+		}
+
+		bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+			return tree.traverse(r, ray_t, [&](int first, int count, interval& t) {
+				bool hit_anything = false;
+				for (int k = first; k < first + count; k++) {
+					if (instances[tree.prim_indices[k]].hit(r, t, rec)) {
+						hit_anything = true;
+						t.max = rec.t;
+					}
+				}
+				return hit_anything;
+			});
+		}
+
+		bool occluded(const ray& r, interval ray_t) const override {
+			return tree.traverse_any(r, ray_t, [&](int first, int count, interval& t) {
+				for (int k = first; k < first + count; k++) {
+					if (instances[tree.prim_indices[k]].occluded(r, t)) return true;
+				}
+				return false;
+			});
+		}
+
+		aabb bounding_box() const override { return tree.bounding_box(); }
+		bool moving() const override { return tree.moving(); }
+		aabb start_bounding_box() const override { return tree.start_bounding_box(); }
+		aabb end_bounding_box() const override { return tree.end_bounding_box(); }
+
+	private:
+		std::vector<instance> instances;	// In the order added, so indices stay valid across builds
+		std::vector<shared_ptr<hittable>> owned;
+		std::unordered_set<const hittable*> owned_index;
+		bvh_tree tree;
+};
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef INTERACTIVE_H
+#define INTERACTIVE_H
+
+#include "camera.h"
+#include "image.h"
+#include "accumulation.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+/*
+ * Interactive previews, for moving the camera around a scene and seeing the result straight away.
+ *
+ * An interactive_preview renders on a thread of its own, and starts again whenever it is given a new camera. Each
+ * start first renders a coarse frame, at a fraction of the resolution with 1 sample per pixel, and then refines the
+ * full resolution image progressively, doubling its samples per pixel from one frame to the next until it reaches the
+ * camera's samples_per_pixel. A new camera cancels the render in flight (see camera::cancel), so the first frame of the
+ * new view follows within a tile's worth of work plus the coarse frame.
+ *
+ * Every frame is handed to a callback with the time the camera it shows was set, and how long after that the frame was
+ * ready. The preview's latency runs until the frame is actually shown, so the callback stops the clock once it has
+ * shown the first frame after a change.
+ */
+
+struct preview_frame {
+    image pixels;                   // Always at the camera's full resolution, scaled up from a coarse render
+    int render_width;               // Width of the render it was made from, which is less for the coarse frame
+    int samples_per_pixel;
+    unsigned long long change;      // Which camera it shows: 1 for the first, counting up with every change
+    bool first;                     // Whether it is the first frame since that change
+    double seconds;                 // Time from the change to the frame being ready
+    std::chrono::steady_clock::time_point changed_at;   // When the camera it shows was set
+};
+
+class interactive_preview {
+    public:
+        /*
+         * Starts rendering world as seen by cam. The coarse frame is rendered at 1 / coarse_divisor of the width and
+         * height. on_frame is called on the render thread, which goes on with the next frame when it returns. The
+         * world must outlive the preview.
+         */
+        interactive_preview(const hittable& world, const camera& cam, std::function<void(const preview_frame&)> on_frame,
+                            int coarse_divisor = 4)
+            : world(world), on_frame(std::move(on_frame)), coarse_divisor(std::max(1, coarse_divisor)) {
+            set_camera(cam);
+            render_thread = std::thread(&interactive_preview::run, this);
+        }
+
+        ~interactive_preview() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+                cancel->store(true);
+            }
+            wake.notify_all();
+            render_thread.join();
+        }
+
+        interactive_preview(const interactive_preview&) = delete;
+        interactive_preview& operator=(const interactive_preview&) = delete;
+
+        // Starts again with a new camera, abandoning the frame being rendered. May be called from any thread
+        void set_camera(const camera& cam) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                pending = cam;
+                changes++;
+                changed_at = std::chrono::steady_clock::now();
+                cancel->store(true);
+            }
+            wake.notify_all();
+        }
+
+    private:
+        const hittable& world;
+        std::function<void(const preview_frame&)> on_frame;
+        int coarse_divisor;
+
+        // Kept from one camera to the next, so that no threads are created on a change
+        shared_ptr<thread_pool> pool;
+        shared_ptr<std::atomic<bool>> cancel = make_shared<std::atomic<bool>>(false);
+
+        std::mutex lock;
+        std::condition_variable wake;
+        camera pending;
+        unsigned long long changes = 0;
+        std::chrono::steady_clock::time_point changed_at;
+        bool stopping = false;
+        std::thread render_thread;
+
+        void run() {
+            unsigned long long rendered = 0;
+            for (;;) {
+                camera cam;
+                std::chrono::steady_clock::time_point start;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [&] { return stopping || changes != rendered; });
+                    if (stopping) return;
+
+                    // Cleared while holding the lock, so a change made after the copy is never missed
+                    cam = pending;
+                    rendered = changes;
+                    start = changed_at;
+                    cancel->store(false);
+                }
+                refine(cam, rendered, start);
+            }
+        }
+
+        // Renders the coarse frame and then the refinements for one camera, until done or cancelled
+        void refine(camera cam, unsigned long long change, std::chrono::steady_clock::time_point start) {
+            cam.progress = nullptr;
+            cam.cancel = cancel;
+            if (!cam.pool) cam.pool = pool;
+
+            const int width = cam.image_width, height = cam.output_height();
+            const int full_samples = std::max(1, cam.samples_per_pixel);
+
+            auto deliver = [&](image pixels, int render_width, int samples, bool first) {
+                if (cancel->load()) return false;
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                on_frame({ std::move(pixels), render_width, samples, change, first, seconds, start });
+                return true;
+            };
+
+            camera coarse = cam;
+            coarse.image_width = std::max(1, width / coarse_divisor);
+            coarse.samples_per_pixel = 1;
+            coarse.pass_samples = 1;
+            accumulation_buffer coarse_buffer;
+            image small = coarse.render_progressive(world, coarse_buffer);
+            if (coarse.pool) pool = coarse.pool;
+
+            // Nearest neighbour, so the coarse pixels show as blocks of the final image
+            image scaled(width, height);
+            for (int j = 0; j < height; j++) {
+                int y = std::min(small.height - 1, int((long long)j * small.height / height));
+                for (int i = 0; i < width; i++) {
+                    int x = std::min(small.width - 1, int((long long)i * small.width / width));
+                    scaled.pixels[(size_t)j * width + i] = small.pixels[(size_t)y * small.width + x];
+                }
+            }
+            if (!deliver(std::move(scaled), coarse.image_width, 1, true)) return;
+
+            // Each pass adds as many samples as the image already has, and is a frame. The sampler is set up for the full
+            // count throughout, because stratified and blue noise point sets depend on it (see accumulation.h)
+            accumulation_buffer accumulated;
+            cam.pool = pool;
+            cam.samples_per_pixel = full_samples;
+            cam.pass_samples = 1;
+            cam.render_progressive(world, accumulated, [&](const accumulation_buffer& refined) {
+                int samples = int(refined.min_count());
+                if (deliver(refined.resolve(), width, samples, false)) cam.pass_samples = samples;
+            });
+            if (cam.pool) pool = cam.pool;
+        }
+};
+
+#endif
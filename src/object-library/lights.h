@@ -0,0 +1,118 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "vec3.h"
+#include "color.h"
+#include "util.h"
+
+#include <vector>
+
+/*
+	The lights of a scene which paths sample directly (next-event estimation, see camera::direct_light).
+
+	Finding a small light by chance takes a great many bounces, so at every diffuse bounce a path instead picks a
+	point on one of the lights and checks with a shadow ray whether it can see it. Lights are spheres, each emitting
+	from its outside. Seen from a point outside it, a sphere covers a cone of directions, and sample() picks directions
+	uniformly within that cone, so every direction it returns hits the sphere and none are wasted on its far side.
+
+	A light is chosen uniformly at random, so pdf() is the density of the cone sampling divided by the number of
+	lights.
+*/
+
+struct light_sample {
+	vec3 direction;		// Unit vector from the shaded point towards the light
+	real distance;		// Distance to the light along direction
+	color emission;
+	double pdf;			// Density of direction over solid angle, including the choice of light
+};
+
+class light_list {
+	public:
+		// Adds a sphere emitting light from its outside, returning its index
+		int add_sphere(const point3& center, real radius, const color& emission) {
+			spheres.push_back({ center, radius, emission });
+			return int(spheres.size()) - 1;
+		}
+
+		size_t size() const { return spheres.size(); }
+		bool empty() const { return spheres.empty(); }
+
+		// Picks a direction from p towards a light. Fails if p is inside the chosen light, which it cannot see
+		bool sample(const point3& p, light_sample& s) const {
+			// One value picks both the light and how far from the cone's axis to go, so that a sampler pair keeps its
+			// spread over both directions of the cone
+			double pick = random_light_double() * spheres.size();
+			int index = std::min(int(pick), int(spheres.size()) - 1);
+			const auto& light = spheres[index];
+
+			auto u1 = std::fmin(pick - index, 1.0);
+			auto u2 = random_light_double();
+
+			cone view;
+			if (!cone_from(p, light, view)) return false;
+
+			// cos_theta is picked uniformly between 1 and cos_max, which spreads directions evenly over the cone
+			real one_minus_cos = real(u1) * view.one_minus_cos_max;
+			real cos_theta = 1 - one_minus_cos;
+			real sin_theta = std::sqrt(std::fmax(real(0), one_minus_cos * (2 - one_minus_cos)));
+			real phi = real(2 * pi * u2);
+
+			vec3 axis = view.axis;
+			vec3 helper = std::fabs(axis.x()) > real(0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+			vec3 tangent = unit_vector(cross(axis, helper));
+			vec3 bitangent = cross(axis, tangent);
+			s.direction = sin_theta * std::cos(phi) * tangent + sin_theta * std::sin(phi) * bitangent + cos_theta * axis;
+
+			// Nearer of the two distances at which the direction crosses the sphere. Rounding can leave directions
+			// at the very edge of the cone just missing it, and those graze it at their closest approach
+			real along = view.distance * cos_theta;
+			real squared = light.radius * light.radius - view.distance * view.distance * sin_theta * sin_theta;
+			s.distance = along - std::sqrt(std::fmax(real(0), squared));
+
+			s.emission = light.emission;
+			s.pdf = 1 / (2 * pi * double(view.one_minus_cos_max) * double(spheres.size()));
+			return true;
+		}
+
+		// Density with which sample() picks a direction from p which hits light index
+		double pdf(const point3& p, int index) const {
+			cone view;
+			if (!cone_from(p, spheres[index], view)) return 0;
+			return 1 / (2 * pi * double(view.one_minus_cos_max) * double(spheres.size()));
+		}
+
+	private:
+		struct sphere_light {
+			point3 center;
+			real radius;
+			color emission;
+		};
+
+		std::vector<sphere_light> spheres;
+
+		// The cone of directions from a point to a sphere: its axis, the distance to the center, and 1 - the cosine
+		// of its half angle
+		struct cone {
+			vec3 axis;
+			real distance;
+			real one_minus_cos_max;
+		};
+
+		static bool cone_from(const point3& p, const sphere_light& light, cone& view) {
+			vec3 to_center = light.center - p;
+			real distance_squared = to_center.length_squared();
+			real radius_squared = light.radius * light.radius;
+			if (distance_squared <= radius_squared) return false;
+
+			// 1 - cos_max is computed as sin^2 / (1 + cos), since subtracting loses all precision for small or
+			// distant lights, whose cones are very narrow
+			real sin2_max = radius_squared / distance_squared;
+			real cos_max = std::sqrt(1 - sin2_max);
+			view.distance = std::sqrt(distance_squared);
+			view.axis = to_center / view.distance;
+			view.one_minus_cos_max = sin2_max / (1 + cos_max);
+			return true;
+		}
+};
+
+#endif
@@ -4,20 +4,49 @@
 #include "hittable.h"
 #include "color.h"
 
-class material {
+#include <cstdint>
+#include <variant>
+
+/*
+ * Materials are plain values rather than a class hierarchy: each kind of material is a small class with a non-virtual
+ * scatter(), and a material holds any one of them in a std::variant. Scattering dispatches on the variant's tag with a
+ * switch the compiler can see through, so each kind's scatter() is inlined into it, with no virtual call or pointer
+ * chase per bounce. Scenes keep their materials side by side in one table (see scene.h), which hit records point
+ * into.
+ *
+ * A new kind of material is a new class added to the variant and to material_type, in the same order.
+ *
+ * Besides scatter(), the integrator asks each kind for the light it emits, and for eval() and pdf() to weigh light
+ * sampling against scattering (see camera::direct_light). material_base gives the defaults for kinds which need none
+ * of these: no emission, and scattering into directions light sampling has no chance of picking (mirror reflection
+ * and refraction), which pdf() reports as a density of 0.
+ */
+
+class material_base {
     public:
-        virtual ~material() = default;
+        // Whether scatter() spreads light over a range of directions, so that light sampling can find them too
+        static constexpr bool diffuse = false;
 
-        virtual bool scatter (
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const {
-            return false;
-        }
+        // Light given off at a hit, back along the ray which hit it
+        color emitted(const hit_record&) const { return color(0, 0, 0); }
+
+        // Fraction of the light arriving from a unit direction which is scattered back along the incoming ray,
+        // including the cosine of the angle it arrives at
+        color eval(const hit_record&, const vec3&) const { return color(0, 0, 0); }
+
+        // Density (over solid angle) with which scatter() picks a unit direction
+        double pdf(const hit_record&, const vec3&) const { return 0; }
+
+        // The colour of the surface itself, for the denoiser's albedo buffer (see denoiser.h). White for surfaces
+        // which tint nothing
+        color albedo() const { return color(1, 1, 1); }
 };
 
-class lambertian : public material {
+class lambertian : public material_base {
     public:
-        lambertian(const color& albedo) : albedo(albedo) {};
+        static constexpr bool diffuse = true;
+
+        lambertian(const color& albedo) : reflectance(albedo) {};
 
         /*
 
@@ -26,41 +55,60 @@ class lambertian : public material {
             For the sake of simplicity, the convention that lambertian materials always scatter is used.
 
          */
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
+            STATS_COUNT(scatter_lambertian);
             auto scatter_direction = rec.normal + random_unit_vector();
 
             // Catch potential zero vector bug
             if (scatter_direction.near_zero()) scatter_direction = rec.normal;
 
-            scattered = ray(rec.p, scatter_direction);
-            attenuation = albedo;
+            scattered = ray(rec.spawn_origin(scatter_direction), scatter_direction, r_in.time());
+            attenuation = reflectance;
             return true;
         }
+
+        // The scattered directions are cosine distributed, so attenuation is exactly eval() / pdf()
+        color eval(const hit_record& rec, const vec3& direction) const {
+            auto cosine = dot(rec.normal, direction);
+            return cosine > 0 ? reflectance * (cosine / pi) : color(0, 0, 0);
+        }
+
+        double pdf(const hit_record& rec, const vec3& direction) const {
+            return std::fmax(0.0, dot(rec.normal, direction) / pi);
+        }
+
+        color albedo() const { return reflectance; }
+
     private:
-        color albedo;
+        color reflectance;
 };
 
-class metal : public material {
+class metal : public material_base {
     public:
-        metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+        metal(const color& albedo, double fuzz) : reflectance(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
+            STATS_COUNT(scatter_metal);
             vec3 reflected = reflect(r_in.direction(), rec.normal);
             reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-            scattered = ray(rec.p, reflected);
-            attenuation = albedo;
+            scattered = ray(rec.spawn_origin(reflected), reflected, r_in.time());
+            attenuation = reflectance;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
+
+        color albedo() const { return reflectance; }
+
     private:
-        color albedo;
+        color reflectance;
         double fuzz;
 };
 
-class dielectric : public material {
+class dielectric : public material_base {
     public:
         dielectric(double refraction_index) : refraction_index(refraction_index) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
+            STATS_COUNT(scatter_dielectric);
             attenuation = color(1.0, 1.0, 1.0);
             double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
 
@@ -76,7 +124,7 @@ class dielectric : public material {
             else
                 direction = refract(unit_direction, rec.normal, ri);
 
-            scattered = ray(rec.p, direction);
+            scattered = ray(rec.spawn_origin(direction), direction, r_in.time());
             return true;
         }
 
@@ -90,4 +138,81 @@ class dielectric : public material {
         }
 };
 
+/*
+ * A surface giving off light of the same colour and brightness in every direction, from its front face only. It
+ * absorbs whatever hits it.
+ *
+ * Lights which paths should sample directly are also registered in the scene's light_list (see lights.h), and the
+ * material then holds the index of its entry there, so a path which happens to hit the light can tell how likely
+ * light sampling was to have found the same point. Emitters not in the list are only ever found by chance.
+ */
+class diffuse_light : public material_base {
+    public:
+        diffuse_light(const color& emission, int light = -1) : emission(emission), light(light) {}
+
+        bool scatter(const ray&, const hit_record&, color&, ray&) const {
+            return false;
+        }
+
+        color emitted(const hit_record& rec) const { return rec.front_face ? emission : color(0, 0, 0); }
+
+        int light_index() const { return light; }
+
+    private:
+        color emission;
+        int light;
+};
+
+// The kinds of material, numbered as the alternatives of material's variant. Also the type field of scene files
+enum class material_type : uint32_t { lambertian, metal, dielectric, diffuse_light };
+
+class material {
+    public:
+        using variant = std::variant<lambertian, metal, dielectric, diffuse_light>;
+        static constexpr int type_count = int(std::variant_size_v<variant>);
+
+        // Implicit, so any kind of material can be passed where a material is expected
+        material(const lambertian& m) : value(m) {}
+        material(const metal& m) : value(m) {}
+        material(const dielectric& m) : value(m) {}
+        material(const diffuse_light& m) : value(m) {}
+
+        material_type type() const { return material_type(value.index()); }
+
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
+            return std::visit([&](const auto& m) { return m.scatter(r_in, rec, attenuation, scattered); }, value);
+        }
+
+        bool emits() const { return type() == material_type::diffuse_light; }
+
+        bool diffuse() const {
+            return std::visit([](const auto& m) { return std::decay_t<decltype(m)>::diffuse; }, value);
+        }
+
+        color emitted(const hit_record& rec) const {
+            return std::visit([&](const auto& m) { return m.emitted(rec); }, value);
+        }
+
+        color eval(const hit_record& rec, const vec3& direction) const {
+            return std::visit([&](const auto& m) { return m.eval(rec, direction); }, value);
+        }
+
+        double pdf(const hit_record& rec, const vec3& direction) const {
+            return std::visit([&](const auto& m) { return m.pdf(rec, direction); }, value);
+        }
+
+        color albedo() const {
+            return std::visit([](const auto& m) { return m.albedo(); }, value);
+        }
+
+        // Index of the light in the scene's light_list, or -1 if it is not one
+        int light_index() const {
+            auto light = std::get_if<diffuse_light>(&value);
+            return light ? light->light_index() : -1;
+        }
+
+    private:
+        variant value;
+};
+
 #endif
@@ -0,0 +1,132 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "triangle-mesh.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <istream>
+#include <stdexcept>
+#include <string>
+
+/*
+	Wavefront OBJ reader.
+
+	The file is streamed a line at a time straight into the mesh's vertex and index buffers, so nothing but the mesh
+	itself is held in memory however large the file is. Vertex positions (v), normals (vn) and faces (f) are read.
+	Face corners may be given as v, v/vt, v//vn or v/vt/vn, with negative indices counting back from the latest
+	vertex, and polygons are split into a fan of triangles. Everything else (texture coordinates, groups, material
+	libraries, smoothing groups, ...) is skipped.
+
+	Throws std::runtime_error, naming the offending line, if the file is malformed.
+*/
+
+namespace obj_detail {
+	inline void skip_space(const char*& p) {
+		while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+	}
+
+	inline double read_double(const char*& p, const std::string& where) {
+		char* end;
+		double value = std::strtod(p, &end);
+		if (end == p) throw std::runtime_error(where + ": expected a number");
+		p = end;
+		return value;
+	}
+
+	// Converts a 1-based (or negative, relative) OBJ index into a 0-based one
+	inline uint32_t resolve_index(long index, size_t count, const std::string& where) {
+		long long resolved = index > 0 ? index - 1 : (long long)count + index;
+		if (index == 0 || resolved < 0 || resolved >= (long long)count)
+			throw std::runtime_error(where + ": index " + std::to_string(index) + " is out of range");
+		return uint32_t(resolved);
+	}
+}
+
+inline shared_ptr<triangle_mesh> load_obj(std::istream& in, const material* mat, const std::string& name = "obj") {
+	using namespace obj_detail;
+
+	auto mesh = make_shared<triangle_mesh>(mat);
+	bool any_normals = false;
+
+	std::string line;
+	std::vector<uint32_t> face, face_normals;
+	for (long line_number = 1; std::getline(in, line); line_number++) {
+		const char* p = line.c_str();
+		skip_space(p);
+
+		bool is_vertex = p[0] == 'v' && (p[1] == ' ' || p[1] == '\t');
+		bool is_normal = p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t');
+		bool is_face = p[0] == 'f' && (p[1] == ' ' || p[1] == '\t');
+		if (!is_vertex && !is_normal && !is_face) continue;
+
+		std::string where = name + ":" + std::to_string(line_number);
+		p += is_normal ? 2 : 1;
+
+		if (!is_face) {
+			double x = read_double(p, where);
+			double y = read_double(p, where);
+			double z = read_double(p, where);
+			if (is_vertex) mesh->vertices.push_back(point3(x, y, z));
+			else mesh->normals.push_back(vec3(x, y, z));
+			continue;
+		}
+
+		face.clear();
+		face_normals.clear();
+		bool face_has_normals = true;
+		while (true) {
+			skip_space(p);
+			if (*p == '\0' || *p == '#') break;
+
+			char* end;
+			long vertex = std::strtol(p, &end, 10);
+			if (end == p) throw std::runtime_error(where + ": expected a vertex index");
+			p = end;
+			face.push_back(resolve_index(vertex, mesh->vertices.size(), where));
+
+			long normal = 0;
+			if (*p == '/') {
+				p++;
+				if (*p != '/') {
+					std::strtol(p, &end, 10);	// Texture coordinate, unused
+					p = end;
+				}
+				if (*p == '/') {
+					p++;
+					normal = std::strtol(p, &end, 10);
+					if (end == p) throw std::runtime_error(where + ": expected a normal index");
+					p = end;
+				}
+			}
+
+			if (normal != 0) face_normals.push_back(resolve_index(normal, mesh->normals.size(), where));
+			else face_has_normals = false;
+		}
+
+		if (face.size() < 3) throw std::runtime_error(where + ": a face needs at least three vertices");
+		any_normals |= face_has_normals;
+
+		for (size_t k = 1; k + 1 < face.size(); k++) {
+			mesh->add_triangle(face[0], face[k], face[k + 1]);
+			if (face_has_normals) {
+				mesh->normal_indices.insert(mesh->normal_indices.end(), { face_normals[0], face_normals[k], face_normals[k + 1] });
+			} else {
+				mesh->normal_indices.insert(mesh->normal_indices.end(), 3, triangle_mesh::no_normal);
+			}
+		}
+	}
+
+	if (!any_normals) mesh->normal_indices.clear();
+
+	mesh->build();
+	return mesh;
+}
+
+inline shared_ptr<triangle_mesh> load_obj(const std::string& path, const material* mat) {
+	std::ifstream in(path);
+	if (!in) throw std::runtime_error("Unable to open mesh '" + path + "'");
+	return load_obj(in, mat, path);
+}
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Per-thread progress counters.
+ *
+ * Each worker owns one counter on its own cache line, and is the only thread which ever writes to it. Updates are
+ * therefore a plain relaxed load and store rather than an atomic read-modify-write, and never bounce a cache line
+ * between threads. The reporting thread sums the counters lazily, whenever it wants to draw an update.
+ */
+class progress_counters {
+    public:
+        explicit progress_counters(int workers = 1) : slots(workers > 0 ? workers : 1) {}
+
+        // Must only be called by the thread which owns the given worker slot
+        void add(int worker, long long amount) {
+            auto& value = slots[worker].value;
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+        long long total() const {
+            long long sum = 0;
+            for (const auto& slot : slots) sum += slot.value.load(std::memory_order_relaxed);
+            return sum;
+        }
+
+    private:
+        struct alignas(64) slot {
+            std::atomic<long long> value = 0;
+        };
+
+        std::vector<slot> slots;
+};
+
+/*
+ * Interface for reporting the progress of a render. The camera calls begin(total) once, update(done, total, elapsed)
+ * periodically while the render runs, and finish(total, elapsed) once the image is complete. Times are in seconds
+ * since the render started.
+ *
+ * Reporters which return false from enabled() are never polled, and the camera skips counting progress altogether.
+ */
+class progress_reporter {
+    public:
+        virtual ~progress_reporter() = default;
+
+        virtual bool enabled() const { return true; }
+
+        virtual void begin(long long) {}
+        virtual void update(long long, long long, double) {}
+        virtual void finish(long long, double) {}
+};
+
+// Reports nothing, for headless batch jobs
+class silent_progress_reporter : public progress_reporter {
+    public:
+        bool enabled() const override { return false; }
+};
+
+/*
+ * Draws a loading bar on a terminal. The line is only redrawn when the percentage or elapsed seconds shown would
+ * change, and is written out with a single call.
+ */
+class tty_progress_reporter : public progress_reporter {
+    public:
+        tty_progress_reporter(std::ostream& out = std::clog) : out(out) {}
+
+        void begin(long long) override {
+            last_percent = -1;
+            last_seconds = -1;
+        }
+
+        void update(long long done, long long total, double elapsed) override {
+            int percent_complete = total > 0 ? int(100.0 * done / total) : 100;
+            long long seconds = (long long)elapsed;
+            if (percent_complete == last_percent && seconds == last_seconds) return;
+            last_percent = percent_complete;
+            last_seconds = seconds;
+
+            std::string line = "[";
+            for (int i = 0; i < 100; i++) {
+                if (i < percent_complete) line += '=';
+                else if (i == percent_complete) line += '>';
+                else line += ' ';
+            }
+            line += "] " + std::to_string(percent_complete) + "%, Elapsed Time: " + format_time(seconds) + " \r";
+
+            out << line << std::flush;
+        }
+
+        void finish(long long, double elapsed) override {
+            std::string line = "\rTotal time taken: " + format_time((long long)elapsed);
+            line.resize(130, ' ');
+            out << line << '\n';
+        }
+
+    private:
+        std::ostream& out;
+        int last_percent = -1;
+        long long last_seconds = -1;
+
+        static std::string format_time(long long seconds) {
+            return std::to_string(seconds / 60) + "m " + std::to_string(seconds % 60) + "s";
+        }
+};
+
+/*
+ * Emits one JSON object per line, for consumption by job schedulers and other tools rather than people. A progress
+ * line is written whenever the completed percentage changes.
+ */
+class json_progress_reporter : public progress_reporter {
+    public:
+        json_progress_reporter(std::ostream& out = std::clog) : out(out) {}
+
+        void begin(long long total) override {
+            last_percent = -1;
+            out << "{\"event\":\"begin\",\"total\":" << total << "}\n" << std::flush;
+        }
+
+        void update(long long done, long long total, double elapsed) override {
+            int percent_complete = total > 0 ? int(100.0 * done / total) : 100;
+            if (percent_complete == last_percent) return;
+            last_percent = percent_complete;
+
+            char line[160];
+            std::snprintf(line, sizeof(line), "{\"event\":\"progress\",\"done\":%lld,\"total\":%lld,\"percent\":%d,\"elapsed\":%.3f}\n",
+                done, total, percent_complete, elapsed);
+            out << line << std::flush;
+        }
+
+        void finish(long long total, double elapsed) override {
+            char line[120];
+            std::snprintf(line, sizeof(line), "{\"event\":\"finish\",\"total\":%lld,\"elapsed\":%.3f}\n", total, elapsed);
+            out << line << std::flush;
+        }
+
+    private:
+        std::ostream& out;
+        int last_percent = -1;
+};
+
+// Returns the reporter with the given name ("tty", "json" or "none"), or nullptr if the name is not recognised
+inline std::shared_ptr<progress_reporter> make_progress_reporter(const std::string& name) {
+    if (name == "tty") return std::make_shared<tty_progress_reporter>();
+    if (name == "json") return std::make_shared<json_progress_reporter>();
+    if (name == "none" || name == "silent") return std::make_shared<silent_progress_reporter>();
+    return nullptr;
+}
+
+#endif
@@ -7,18 +7,23 @@ class ray {
 	private:
 		point3 orig;
 		vec3 dir;
+		real tm = 0;
 
 	public:
 		ray() = default;
 		
-		ray(const point3& origin, const vec3& direction) : 
-			orig(origin), dir(direction) {}
+		ray(const point3& origin, const vec3& direction, real time = 0) :
+			orig(origin), dir(direction), tm(time) {}
 	
 
 		const point3& origin() const { return orig; }
 		const vec3& direction() const { return dir; }
 
-		point3 at(double t) const { return orig + (t*dir); }
+		// The moment the ray is cast, within the camera's shutter (see camera::shutter_open). Moving objects are where
+		// they are at this time, from time 0 at the start of their motion to 1 at its end
+		real time() const { return tm; }
+
+		point3 at(real t) const { return orig + (t*dir); }
 };
 
 #endif
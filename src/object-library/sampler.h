@@ -0,0 +1,218 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "util.h"
+
+#include <cmath>
+#include <cstdint>
+
+/*
+ * Sample generation for the camera.
+ *
+ * Every sample of every pixel is given its own deterministic random sequence, keyed by the render seed, the pixel and
+ * the sample index. Renders are therefore reproducible no matter how tiles are scheduled across threads.
+ *
+ * The first dimensions of each sample can additionally be drawn from better distributed sets than independent random
+ * numbers, which lowers the noise reached for a given samples_per_pixel. Dimensions are generated in pairs: the
+ * position within the pixel, the position on the lens, and then the first few values the path itself asks
+ * random_double() for (e.g. the first bounce direction), which are queued in the thread's sample_stream. With motion
+ * blur, the time of the sample comes from one more pair, and the first two light samples of the path from the two
+ * after that.
+ *
+ *  - independent: plain random numbers from the PCG32 generator.
+ *  - stratified:  the unit square is split into a sqrt(spp) x sqrt(spp) grid and one sample is jittered in each cell.
+ *  - sobol:       the (0,2)-sequence formed by the first two Sobol dimensions, Owen scrambled per pixel.
+ *  - blue_noise:  an R2 low-discrepancy sequence per pixel, rotated by an interleaved gradient noise value of the
+ *                 pixel. Neighbouring pixels get very different rotations, pushing their error to high frequencies.
+ *
+ * Each pair visits its points in a different, hashed order, so that the pairs are not correlated with each other.
+ * Dimensions beyond those come straight from the thread's PCG32 generator, which start_sample() reseeds.
+ */
+
+enum class sampler_type { independent, stratified, sobol, blue_noise };
+
+struct sample_2d {
+    double u, v;
+};
+
+class pixel_sampler {
+    public:
+        pixel_sampler(sampler_type type, int samples_per_pixel, uint64_t seed) :
+            type(type), samples_per_pixel(samples_per_pixel), seed(seed)
+        {
+            strata = int(std::sqrt(double(samples_per_pixel)));
+            if (strata < 1) strata = 1;
+        }
+
+        // Prepares to generate the given sample of pixel (i, j), and reseeds the calling thread's random generator
+        void start_sample(int i, int j, int sample_index) {
+            pixel_i = i;
+            pixel_j = j;
+            index = sample_index;
+            pixel_key = mix_bits(seed ^ mix_bits((uint64_t(uint32_t(j)) << 32) | uint32_t(i)));
+            random_generator().seed(pixel_key, uint64_t(sample_index));
+
+            auto& stream = thread_sample_stream();
+            stream.next = 0;
+            stream.count = 0;
+            stream.light_next = 0;
+            stream.light_count = 0;
+            if (type == sampler_type::independent) return;
+
+            for (int pair = 0; pair < sample_stream::capacity / 2; pair++) {
+                sample_2d s = next_2d(2 + pair);
+                stream.values[2 * pair] = s.u;
+                stream.values[2 * pair + 1] = s.v;
+            }
+            stream.count = sample_stream::capacity;
+
+            for (int pair = 0; pair < sample_stream::light_capacity / 2; pair++) {
+                sample_2d s = next_2d(first_light_dimension + pair);
+                stream.light_values[2 * pair] = s.u;
+                stream.light_values[2 * pair + 1] = s.v;
+            }
+            stream.light_count = sample_stream::light_capacity;
+        }
+
+        // Position of the sample within the pixel, in [0, 1)^2
+        sample_2d pixel_2d() { return next_2d(0); }
+
+        // Position of the sample on the lens, in [0, 1)^2
+        sample_2d lens_2d() { return next_2d(1); }
+
+        // Moment of the sample within the camera's shutter, in [0, 1). Drawn after the pixel and lens positions, from
+        // a pair of its own past the ones queued for the path
+        double time_1d() { return next_2d(2 + sample_stream::capacity / 2).u; }
+
+    private:
+        static constexpr int first_light_dimension = 3 + sample_stream::capacity / 2;
+
+        sampler_type type;
+        int samples_per_pixel;
+        uint64_t seed;
+        int strata;
+
+        int pixel_i = 0, pixel_j = 0, index = 0;
+        uint64_t pixel_key = 0;
+
+        // The index of this sample within the given dimension pair's own ordering of the first length points.
+        // Samples past those (which adaptive sampling can take) keep their own index
+        uint32_t shuffled_index(int dimension, uint32_t length) const {
+            if (uint32_t(index) >= length) return uint32_t(index);
+            return permute(uint32_t(index), length, uint32_t(mix_bits(pixel_key + dimension)));
+        }
+
+        sample_2d next_2d(int dimension) {
+            switch (type) {
+                case sampler_type::stratified: return stratified_2d(dimension);
+                case sampler_type::sobol: return sobol_2d(dimension);
+                case sampler_type::blue_noise: return blue_noise_2d(dimension);
+                default: {
+                    auto u = random_generator().next_double();
+                    auto v = random_generator().next_double();
+                    return { u, v };
+                }
+            }
+        }
+
+        sample_2d stratified_2d(int dimension) {
+            int cells = strata * strata;
+            auto jitter_u = random_generator().next_double();
+            auto jitter_v = random_generator().next_double();
+            if (index >= cells) return { jitter_u, jitter_v };
+
+            int cell = int(shuffled_index(dimension, uint32_t(cells)));
+            return { (cell % strata + jitter_u) / strata, (cell / strata + jitter_v) / strata };
+        }
+
+        sample_2d sobol_2d(int dimension) {
+            /*
+                Both the sample index and the resulting point are Owen scrambled (Burley, "Practical Hash-based Owen
+                Scrambling", 2020). Scrambling the index shuffles the order of the points differently for every pair
+                of dimensions, while keeping every power of two prefix of the sequence well stratified. That matters
+                for adaptive sampling, which may stop a pixel after any number of samples.
+            */
+            uint64_t key = mix_bits(pixel_key + 0x632be59bd9b4e019ULL * (dimension + 1));
+            uint32_t i = nested_uniform_scramble(uint32_t(index), uint32_t(key));
+
+            uint32_t u = nested_uniform_scramble(reverse_bits(i), uint32_t(key >> 32));
+            uint32_t v = nested_uniform_scramble(sobol_dimension2(i), uint32_t(key >> 32) ^ 0x5bd1e995u);
+            return { u * 0x1p-32, v * 0x1p-32 };
+        }
+
+        sample_2d blue_noise_2d(int dimension) {
+            // R2 sequence: successive multiples of the reciprocal plastic number and its square, modulo 1
+            const double a1 = 0.7548776662466927;
+            const double a2 = 0.5698402909980532;
+
+            double shift = 17.0 * dimension;
+            double rotate_u = interleaved_gradient_noise(pixel_i + shift, pixel_j);
+            double rotate_v = interleaved_gradient_noise(pixel_i + 5.588238, pixel_j + 5.588238 + shift);
+
+            uint32_t i = dimension == 0 ? uint32_t(index) : shuffled_index(dimension, uint32_t(samples_per_pixel));
+            double u = 0.5 + a1 * i + rotate_u;
+            double v = 0.5 + a2 * i + rotate_v;
+            return { u - std::floor(u), v - std::floor(v) };
+        }
+
+        static double interleaved_gradient_noise(double x, double y) {
+            double f = 0.06711056 * x + 0.00583715 * y;
+            f = 52.9829189 * (f - std::floor(f));
+            return f - std::floor(f);
+        }
+
+        static uint32_t reverse_bits(uint32_t v) {
+            v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+            v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+            v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+            v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+            return (v >> 16) | (v << 16);
+        }
+
+        // Hash-based Owen scrambling: randomly flips each bit depending only on the bits above it
+        static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+            x = reverse_bits(x);
+            x += seed;
+            x ^= x * 0x6c50b47cu;
+            x ^= x * 0xb82f1e52u;
+            x ^= x * 0xc7afe638u;
+            x ^= x * 0x8d22f6e6u;
+            return reverse_bits(x);
+        }
+
+        // Second dimension of the Sobol sequence, whose generator matrix is the Pascal triangle mod 2
+        static uint32_t sobol_dimension2(uint32_t i) {
+            uint32_t result = 0;
+            for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+                if (i & 1) result ^= v;
+            }
+            return result;
+        }
+
+        // Kensler's hashed permutation: maps i to a unique value in [0, length), differently for each p
+        static uint32_t permute(uint32_t i, uint32_t length, uint32_t p) {
+            uint32_t w = length - 1;
+            w |= w >> 1;
+            w |= w >> 2;
+            w |= w >> 4;
+            w |= w >> 8;
+            w |= w >> 16;
+            do {
+                i ^= p;             i *= 0xe170893d;
+                i ^= p >> 16;
+                i ^= (i & w) >> 4;
+                i ^= p >> 8;        i *= 0x0929eb3f;
+                i ^= p >> 23;
+                i ^= (i & w) >> 1;  i *= 1 | p >> 27;
+                                    i *= 0x6935fa69;
+                i ^= (i & w) >> 11; i *= 0x74dcb303;
+                i ^= (i & w) >> 2;  i *= 0x9e501cc3;
+                i ^= (i & w) >> 2;  i *= 0xc860a3df;
+                i &= w;
+                i ^= i >> 5;
+            } while (i >= length);
+            return (i + p) % length;
+        }
+};
+
+#endif
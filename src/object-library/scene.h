@@ -0,0 +1,703 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "camera.h"
+#include "material.h"
+#include "sphere-set.h"
+#include "hittable-list.h"
+#include "triangle-mesh.h"
+#include "obj-loader.h"
+#include "instance.h"
+#include "transform.h"
+#include "lights.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SCENE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Scene files, so that scenes and camera settings can be changed without rebuilding.
+ *
+ * Text scenes hold one statement per line, with '#' starting a comment:
+ *
+ *     camera <field> <value...>                    any public camera field, e.g. "camera lookfrom 13 2 3"
+ *     material <name> lambertian <r> <g> <b>
+ *     material <name> metal <r> <g> <b> <fuzz>
+ *     material <name> dielectric <refraction index>
+ *     material <name> diffuse_light <r> <g> <b>         emitted colour, which may be brighter than 1
+ *     sphere <x> <y> <z> <radius> <material name> [to <x> <y> <z>]
+ *     mesh <OBJ file> <material name> [transform...]
+ *
+ * A sphere with a "to" center moves there in a straight line, from its first center at time 0 to the second at time 1,
+ * and is blurred over the camera's shutter_open to shutter_close (see ray::time).
+ *
+ * A mesh's optional transform is a sequence of "translate <x> <y> <z>", "rotate <axis x> <y> <z> <degrees>" and
+ * "scale <x> <y> <z>", applied in the order written. Every mesh line naming the same file and material is an instance
+ * of a single copy of the mesh.
+ *
+ * Still spheres made of a diffuse_light are added to the scene's light_list, so that paths sample them directly.
+ * Emissive meshes and moving spheres give off light too, but are only found by paths which happen to hit them.
+ *
+ * Binary scenes hold the same content as fixed size records, laid out exactly as the structs below (little endian):
+ *
+ *     "RTSC", u32 version, u32 material count, u32 sphere count, u32 mesh count, u32 reserved,
+ *     scene_camera_record, material_record[material count], sphere_record[sphere count],
+ *     then per mesh: u32 material, u32 path length, f64 transform[3][4] (row-major object to world),
+ *                    path (padded with zeros to a multiple of 8 bytes)
+ *
+ * Binary files are memory mapped and the records read in place: the materials are made in one table and the spheres
+ * copied straight into the sphere_set's arrays, so loading does no per-object allocation or parsing. Meshes stay in
+ * their OBJ files, with relative paths taken from the directory of the scene file.
+ */
+
+struct material_record {
+    uint32_t type;
+    uint32_t reserved;
+    double albedo[3];
+    double parameter;   // Fuzz for metal, refraction index for dielectric
+                        // (albedo is the emitted colour of a diffuse_light)
+};
+
+struct sphere_record {
+    double center[3];
+    double radius;
+    uint32_t material;  // Index into the scene's material records
+    uint32_t reserved;
+    double motion[3];   // From the center at time 0 to the center at time 1, zero for a still sphere
+};
+
+struct scene_camera_record {
+    double aspect_ratio, sample_radius, diffusion_colour_amount, min_throughput;
+    double vfov, lookfrom[3], lookat[3], vup[3];
+    double defocus_angle, focus_dist, adaptive_threshold;
+    uint64_t seed;
+    int32_t image_width, samples_per_pixel, max_recurse_depth, rr_min_depth;
+    int32_t sampler, multithread_mode, thread_count, tile_size;
+    int32_t adaptive_sampling, adaptive_min_samples, adaptive_max_samples, pass_samples;
+    double background_color[3];
+    int32_t sky, light_sampling;
+    double shutter_open, shutter_close;
+};
+
+static_assert(sizeof(material_record) == 40 && sizeof(sphere_record) == 64 && sizeof(scene_camera_record) == 240,
+              "Scene records are written to disk as they are laid out in memory");
+
+/*
+ * The contents of a scene as plain records: what text files are parsed into and binary files are written from.
+ * Scenes built in code can be described the same way, and then saved.
+ */
+struct scene_description {
+    camera cam;
+    std::vector<material_record> materials;
+    std::vector<sphere_record> spheres;
+
+    struct mesh_entry {
+        std::string path;
+        uint32_t material;
+        transform object_to_world;
+    };
+    std::vector<mesh_entry> meshes;
+
+    uint32_t add_lambertian(const color& albedo) { return add_material(material_type::lambertian, albedo, 0); }
+    uint32_t add_metal(const color& albedo, double fuzz) { return add_material(material_type::metal, albedo, fuzz); }
+    uint32_t add_dielectric(double refraction_index) {
+        return add_material(material_type::dielectric, color(1, 1, 1), refraction_index);
+    }
+    uint32_t add_diffuse_light(const color& emission) { return add_material(material_type::diffuse_light, emission, 0); }
+
+    uint32_t add_material(material_type type, const color& albedo, double parameter) {
+        materials.push_back({ uint32_t(type), 0, { albedo.x(), albedo.y(), albedo.z() }, parameter });
+        return uint32_t(materials.size() - 1);
+    }
+
+    void add_sphere(const point3& center, double radius, uint32_t material) {
+        add_sphere(center, center, radius, material);
+    }
+
+    // A sphere moving from center1 at time 0 to center2 at time 1
+    void add_sphere(const point3& center1, const point3& center2, double radius, uint32_t material) {
+        vec3 motion = center2 - center1;
+        spheres.push_back({ { center1.x(), center1.y(), center1.z() }, radius, material, 0, { motion.x(), motion.y(), motion.z() } });
+    }
+
+    void add_mesh(const std::string& path, uint32_t material, const transform& object_to_world = transform()) {
+        meshes.push_back({ path, material, object_to_world });
+    }
+};
+
+inline const char* sampler_type_name(sampler_type type) {
+    switch (type) {
+        case sampler_type::stratified: return "stratified";
+        case sampler_type::sobol: return "sobol";
+        case sampler_type::blue_noise: return "blue_noise";
+        default: return "independent";
+    }
+}
+
+inline bool sampler_type_from_name(const std::string& name, sampler_type& type) {
+    for (auto candidate : { sampler_type::independent, sampler_type::stratified, sampler_type::sobol, sampler_type::blue_noise }) {
+        if (name == sampler_type_name(candidate)) {
+            type = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline scene_camera_record make_camera_record(const camera& cam) {
+    scene_camera_record rec{};
+    rec.aspect_ratio = cam.aspect_ratio;
+    rec.sample_radius = cam.sample_radius;
+    rec.diffusion_colour_amount = cam.diffusion_colour_amount;
+    rec.min_throughput = cam.min_throughput;
+    rec.vfov = cam.vfov;
+    for (int a = 0; a < 3; a++) {
+        rec.lookfrom[a] = cam.lookfrom[a];
+        rec.lookat[a] = cam.lookat[a];
+        rec.vup[a] = cam.vup[a];
+    }
+    rec.defocus_angle = cam.defocus_angle;
+    rec.focus_dist = cam.focus_dist;
+    rec.adaptive_threshold = cam.adaptive_threshold;
+    rec.seed = cam.seed;
+    rec.image_width = cam.image_width;
+    rec.samples_per_pixel = cam.samples_per_pixel;
+    rec.max_recurse_depth = cam.max_recurse_depth;
+    rec.rr_min_depth = cam.rr_min_depth;
+    rec.sampler = int32_t(cam.sampler);
+    rec.multithread_mode = cam.multithread_mode;
+    rec.thread_count = cam.thread_count;
+    rec.tile_size = cam.tile_size;
+    rec.adaptive_sampling = cam.adaptive_sampling;
+    rec.adaptive_min_samples = cam.adaptive_min_samples;
+    rec.adaptive_max_samples = cam.adaptive_max_samples;
+    rec.pass_samples = cam.pass_samples;
+    for (int a = 0; a < 3; a++) rec.background_color[a] = cam.background_color[a];
+    rec.sky = cam.sky;
+    rec.light_sampling = cam.light_sampling;
+    rec.shutter_open = cam.shutter_open;
+    rec.shutter_close = cam.shutter_close;
+    return rec;
+}
+
+inline void apply_camera_record(const scene_camera_record& rec, camera& cam) {
+    cam.aspect_ratio = rec.aspect_ratio;
+    cam.sample_radius = rec.sample_radius;
+    cam.diffusion_colour_amount = rec.diffusion_colour_amount;
+    cam.min_throughput = rec.min_throughput;
+    cam.vfov = rec.vfov;
+    cam.lookfrom = point3(rec.lookfrom[0], rec.lookfrom[1], rec.lookfrom[2]);
+    cam.lookat = point3(rec.lookat[0], rec.lookat[1], rec.lookat[2]);
+    cam.vup = vec3(rec.vup[0], rec.vup[1], rec.vup[2]);
+    cam.defocus_angle = rec.defocus_angle;
+    cam.focus_dist = rec.focus_dist;
+    cam.adaptive_threshold = rec.adaptive_threshold;
+    cam.seed = rec.seed;
+    cam.image_width = rec.image_width;
+    cam.samples_per_pixel = rec.samples_per_pixel;
+    cam.max_recurse_depth = rec.max_recurse_depth;
+    cam.rr_min_depth = rec.rr_min_depth;
+    cam.sampler = sampler_type(rec.sampler);
+    cam.multithread_mode = rec.multithread_mode != 0;
+    cam.thread_count = rec.thread_count;
+    cam.tile_size = rec.tile_size;
+    cam.adaptive_sampling = rec.adaptive_sampling != 0;
+    cam.adaptive_min_samples = rec.adaptive_min_samples;
+    cam.adaptive_max_samples = rec.adaptive_max_samples;
+    cam.pass_samples = rec.pass_samples;
+    cam.background_color = color(rec.background_color[0], rec.background_color[1], rec.background_color[2]);
+    cam.sky = rec.sky != 0;
+    cam.light_sampling = rec.light_sampling != 0;
+    cam.shutter_open = rec.shutter_open;
+    cam.shutter_close = rec.shutter_close;
+}
+
+namespace scene_detail {
+    constexpr char magic[4] = { 'R', 'T', 'S', 'C' };
+    constexpr uint32_t version = 5;
+
+    struct header {
+        char magic[4];
+        uint32_t version;
+        uint32_t material_count;
+        uint32_t sphere_count;
+        uint32_t mesh_count;
+        uint32_t reserved;
+    };
+
+    struct mesh_record {
+        uint32_t material;
+        uint32_t path_length;
+        double object_to_world[3][4];
+    };
+
+    // Makes paths in a scene file relative to the file's own directory
+    inline std::string resolve_path(const std::string& scene_path, const std::string& path) {
+        std::filesystem::path p(path);
+        if (p.is_absolute()) return path;
+        // absolute() of the empty parent of a bare file name fails, so resolve the scene path itself first
+        return (std::filesystem::absolute(scene_path).parent_path() / p).lexically_normal().string();
+    }
+
+    // Read-only view of a whole file, memory mapped where the platform allows it
+    class mapped_file {
+        public:
+            explicit mapped_file(const std::string& path) {
+#ifdef SCENE_MMAP
+                int fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0) throw std::runtime_error("Unable to open scene '" + path + "'");
+                struct stat info;
+                if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+                    size = size_t(info.st_size);
+                    void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (mapping != MAP_FAILED) mapped = static_cast<const unsigned char*>(mapping);
+                }
+                ::close(fd);
+                if (mapped) return;
+                size = 0;
+#endif
+                std::ifstream in(path, std::ios::binary);
+                if (!in) throw std::runtime_error("Unable to open scene '" + path + "'");
+                copy.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+                size = copy.size();
+            }
+
+            ~mapped_file() {
+#ifdef SCENE_MMAP
+                if (mapped) ::munmap(const_cast<unsigned char*>(mapped), size);
+#endif
+            }
+
+            mapped_file(const mapped_file&) = delete;
+            mapped_file& operator=(const mapped_file&) = delete;
+
+            const unsigned char* data() const { return mapped ? mapped : copy.data(); }
+            size_t length() const { return size; }
+
+        private:
+            const unsigned char* mapped = nullptr;
+            std::vector<unsigned char> copy;
+            size_t size = 0;
+    };
+
+    inline bool is_binary(const mapped_file& file) {
+        return file.length() >= sizeof(magic) && std::memcmp(file.data(), magic, sizeof(magic)) == 0;
+    }
+
+    // The records of a binary scene, pointing into the file
+    struct binary_scene {
+        header head;
+        const scene_camera_record* cam;
+        const material_record* materials;
+        const sphere_record* spheres;
+        std::vector<scene_description::mesh_entry> meshes;
+    };
+
+    // Checks the binary layout and finds the records within the file
+    inline binary_scene read_binary(const mapped_file& file, const std::string& path) {
+        binary_scene result;
+        header& head = result.head;
+        auto truncated = [&]() { return std::runtime_error("Scene '" + path + "' is truncated"); };
+
+        if (file.length() < sizeof(head) + sizeof(scene_camera_record)) throw truncated();
+        std::memcpy(&head, file.data(), sizeof(head));
+        if (head.version != version)
+            throw std::runtime_error("Scene '" + path + "' has unsupported version " + std::to_string(head.version));
+
+        size_t materials_offset = sizeof(head) + sizeof(scene_camera_record);
+        size_t spheres_offset = materials_offset + size_t(head.material_count) * sizeof(material_record);
+        size_t meshes_offset = spheres_offset + size_t(head.sphere_count) * sizeof(sphere_record);
+        if (file.length() < meshes_offset) throw truncated();
+
+        // Every record is a multiple of 8 bytes, so they are suitably aligned within a mapping
+        result.cam = reinterpret_cast<const scene_camera_record*>(file.data() + sizeof(head));
+        result.materials = reinterpret_cast<const material_record*>(file.data() + materials_offset);
+        result.spheres = reinterpret_cast<const sphere_record*>(file.data() + spheres_offset);
+
+        // The camera's sizes and counts go on to size buffers and divide by, and its sampler to pick from an enum
+        const scene_camera_record& cam = *result.cam;
+        if (cam.image_width <= 0 || cam.samples_per_pixel <= 0 || cam.max_recurse_depth <= 0
+            || !(cam.aspect_ratio > 0) || !std::isfinite(cam.aspect_ratio)) {
+            throw std::runtime_error("Scene '" + path + "' has an invalid camera resolution, sample count or depth");
+        }
+        if (cam.sampler < 0 || cam.sampler > int32_t(sampler_type::blue_noise)) {
+            throw std::runtime_error("Scene '" + path + "' has an unknown sampler");
+        }
+
+        size_t offset = meshes_offset;
+        for (uint32_t k = 0; k < head.mesh_count; k++) {
+            mesh_record rec;
+            if (file.length() < offset + sizeof(rec)) throw truncated();
+            std::memcpy(&rec, file.data() + offset, sizeof(rec));
+            offset += sizeof(rec);
+
+            if (file.length() < offset + rec.path_length) throw truncated();
+            std::string mesh_path(reinterpret_cast<const char*>(file.data() + offset), rec.path_length);
+            transform object_to_world;
+            if (!transform::try_make(rec.object_to_world, object_to_world)) {
+                throw std::runtime_error("Scene '" + path + "': mesh " + std::to_string(k) + " has a singular or non-finite transform");
+            }
+            result.meshes.push_back({ resolve_path(path, mesh_path), rec.material, object_to_world });
+            offset += (rec.path_length + 7) & ~size_t(7);
+        }
+        return result;
+    }
+
+    inline void read_values(std::istringstream& in, double* values, int count, const std::string& where) {
+        for (int k = 0; k < count; k++) {
+            if (!(in >> values[k])) throw std::runtime_error(where + ": expected " + std::to_string(count) + " numbers");
+        }
+    }
+
+    inline void set_camera_field(camera& cam, const std::string& field, std::istringstream& in, const std::string& where) {
+        double v[3];
+        auto number = [&]() { read_values(in, v, 1, where); return v[0]; };
+        auto vector = [&]() { read_values(in, v, 3, where); return vec3(v[0], v[1], v[2]); };
+        auto flag = [&]() {
+            std::string word;
+            in >> word;
+            if (word == "true" || word == "1") return true;
+            if (word == "false" || word == "0") return false;
+            throw std::runtime_error(where + ": expected true or false");
+        };
+
+        if (field == "aspect_ratio") cam.aspect_ratio = number();
+        else if (field == "image_width") cam.image_width = int(number());
+        else if (field == "samples_per_pixel") cam.samples_per_pixel = int(number());
+        else if (field == "sample_radius") cam.sample_radius = number();
+        else if (field == "diffusion_colour_amount") cam.diffusion_colour_amount = number();
+        else if (field == "max_recurse_depth") cam.max_recurse_depth = int(number());
+        else if (field == "rr_min_depth") cam.rr_min_depth = int(number());
+        else if (field == "min_throughput") cam.min_throughput = number();
+        else if (field == "vfov") cam.vfov = number();
+        else if (field == "lookfrom") cam.lookfrom = vector();
+        else if (field == "lookat") cam.lookat = vector();
+        else if (field == "vup") cam.vup = vector();
+        else if (field == "defocus_angle") cam.defocus_angle = number();
+        else if (field == "focus_dist") cam.focus_dist = number();
+        else if (field == "seed") {
+            if (!(in >> cam.seed)) throw std::runtime_error(where + ": expected a seed");
+        }
+        else if (field == "sampler") {
+            std::string name;
+            in >> name;
+            if (!sampler_type_from_name(name, cam.sampler))
+                throw std::runtime_error(where + ": unknown sampler '" + name + "'");
+        }
+        else if (field == "multithread_mode") cam.multithread_mode = flag();
+        else if (field == "thread_count") cam.thread_count = int(number());
+        else if (field == "tile_size") cam.tile_size = int(number());
+        else if (field == "adaptive_sampling") cam.adaptive_sampling = flag();
+        else if (field == "adaptive_threshold") cam.adaptive_threshold = number();
+        else if (field == "adaptive_min_samples") cam.adaptive_min_samples = int(number());
+        else if (field == "adaptive_max_samples") cam.adaptive_max_samples = int(number());
+        else if (field == "pass_samples") cam.pass_samples = int(number());
+        else if (field == "sky") cam.sky = flag();
+        else if (field == "background_color") cam.background_color = vector();
+        else if (field == "light_sampling") cam.light_sampling = flag();
+        else if (field == "shutter_open") cam.shutter_open = number();
+        else if (field == "shutter_close") cam.shutter_close = number();
+        else throw std::runtime_error(where + ": unknown camera field '" + field + "'");
+    }
+
+    inline scene_description parse_text(const char* text, size_t length, const std::string& path) {
+        scene_description desc;
+        std::unordered_map<std::string, uint32_t> material_names;
+
+        std::istringstream file(std::string(text, length));
+        std::string line;
+        for (int line_number = 1; std::getline(file, line); line_number++) {
+            auto comment = line.find('#');
+            if (comment != std::string::npos) line.erase(comment);
+
+            std::istringstream in(line);
+            std::string keyword;
+            if (!(in >> keyword)) continue;
+            std::string where = path + ":" + std::to_string(line_number);
+
+            if (keyword == "camera") {
+                std::string field;
+                in >> field;
+                set_camera_field(desc.cam, field, in, where);
+            } else if (keyword == "material") {
+                std::string name, type;
+                in >> name >> type;
+                double v[4];
+                uint32_t index;
+                if (type == "lambertian") {
+                    read_values(in, v, 3, where);
+                    index = desc.add_lambertian(color(v[0], v[1], v[2]));
+                } else if (type == "metal") {
+                    read_values(in, v, 4, where);
+                    index = desc.add_metal(color(v[0], v[1], v[2]), v[3]);
+                } else if (type == "dielectric") {
+                    read_values(in, v, 1, where);
+                    index = desc.add_dielectric(v[0]);
+                } else if (type == "diffuse_light") {
+                    read_values(in, v, 3, where);
+                    index = desc.add_diffuse_light(color(v[0], v[1], v[2]));
+                } else {
+                    throw std::runtime_error(where + ": unknown material type '" + type + "'");
+                }
+                material_names[name] = index;
+            } else if (keyword == "sphere") {
+                double v[4];
+                read_values(in, v, 4, where);
+                std::string name;
+                in >> name;
+                auto found = material_names.find(name);
+                if (found == material_names.end()) throw std::runtime_error(where + ": unknown material '" + name + "'");
+
+                point3 center(v[0], v[1], v[2]);
+                point3 center2 = center;
+                std::string to;
+                if (in >> to) {
+                    if (to != "to") throw std::runtime_error(where + ": expected 'to' after the sphere's material");
+                    double w[3];
+                    read_values(in, w, 3, where);
+                    center2 = point3(w[0], w[1], w[2]);
+                }
+                desc.add_sphere(center, center2, v[3], found->second);
+            } else if (keyword == "mesh") {
+                std::string mesh_path, name;
+                in >> mesh_path >> name;
+                auto found = material_names.find(name);
+                if (found == material_names.end()) throw std::runtime_error(where + ": unknown material '" + name + "'");
+
+                transform object_to_world;
+                std::string op;
+                while (in >> op) {
+                    double v[4];
+                    try {
+                        if (op == "translate") {
+                            read_values(in, v, 3, where);
+                            object_to_world = transform::translate(vec3(v[0], v[1], v[2])) * object_to_world;
+                        } else if (op == "rotate") {
+                            read_values(in, v, 4, where);
+                            object_to_world = transform::rotate(vec3(v[0], v[1], v[2]), v[3]) * object_to_world;
+                        } else if (op == "scale") {
+                            read_values(in, v, 3, where);
+                            object_to_world = transform::scale(vec3(v[0], v[1], v[2])) * object_to_world;
+                        } else {
+                            throw std::runtime_error(where + ": unknown transform '" + op + "'");
+                        }
+                    } catch (const std::invalid_argument&) {
+                        throw std::runtime_error(where + ": " + op + " makes the mesh transform singular or not finite");
+                    }
+                }
+                desc.add_mesh(resolve_path(path, mesh_path), found->second, object_to_world);
+            } else {
+                throw std::runtime_error(where + ": unknown statement '" + keyword + "'");
+            }
+        }
+        return desc;
+    }
+}
+
+/*
+ * Writes a scene as a binary scene file, which loads much faster than text. Throws std::runtime_error on failure.
+ */
+inline void write_scene_binary(const scene_description& desc, const std::string& path) {
+    scene_detail::header head;
+    std::memcpy(head.magic, scene_detail::magic, sizeof(head.magic));
+    head.version = scene_detail::version;
+    head.material_count = uint32_t(desc.materials.size());
+    head.sphere_count = uint32_t(desc.spheres.size());
+    head.mesh_count = uint32_t(desc.meshes.size());
+    head.reserved = 0;
+    scene_camera_record cam = make_camera_record(desc.cam);
+
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) throw std::runtime_error("Unable to open '" + path + "' for writing");
+
+    bool failed = std::fwrite(&head, sizeof(head), 1, file) != 1;
+    failed |= std::fwrite(&cam, sizeof(cam), 1, file) != 1;
+    failed |= std::fwrite(desc.materials.data(), sizeof(material_record), desc.materials.size(), file) != desc.materials.size();
+    failed |= std::fwrite(desc.spheres.data(), sizeof(sphere_record), desc.spheres.size(), file) != desc.spheres.size();
+    for (const auto& mesh : desc.meshes) {
+        scene_detail::mesh_record rec{ mesh.material, uint32_t(mesh.path.size()), {} };
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 4; c++) rec.object_to_world[r][c] = mesh.object_to_world.element(r, c);
+        }
+        const char padding[8] = {};
+        failed |= std::fwrite(&rec, sizeof(rec), 1, file) != 1;
+        failed |= std::fwrite(mesh.path.data(), 1, mesh.path.size(), file) != mesh.path.size();
+        failed |= std::fwrite(padding, 1, (8 - mesh.path.size() % 8) % 8, file) != (8 - mesh.path.size() % 8) % 8;
+    }
+    failed |= std::fclose(file) != 0;
+    if (failed) throw std::runtime_error("Unable to write scene '" + path + "'");
+}
+
+// Reads a text or binary scene file into records. Throws std::runtime_error if it is missing or malformed
+inline scene_description read_scene_description(const std::string& path) {
+    scene_detail::mapped_file file(path);
+    if (!scene_detail::is_binary(file)) {
+        return scene_detail::parse_text(reinterpret_cast<const char*>(file.data()), file.length(), path);
+    }
+
+    auto binary = scene_detail::read_binary(file, path);
+
+    scene_description desc;
+    apply_camera_record(*binary.cam, desc.cam);
+    desc.materials.assign(binary.materials, binary.materials + binary.head.material_count);
+    desc.spheres.assign(binary.spheres, binary.spheres + binary.head.sphere_count);
+    desc.meshes = std::move(binary.meshes);
+    return desc;
+}
+
+/*
+ * Applies camera statements, as in a text scene file but with nothing else, to cam. Fields they do not mention keep
+ * their values. name is used in error messages. Throws std::runtime_error if they are malformed, in which case cam may
+ * have been partly changed.
+ */
+inline void apply_camera_settings(std::istream& text, const std::string& name, camera& cam) {
+    std::string line;
+    for (int line_number = 1; std::getline(text, line); line_number++) {
+        auto comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+
+        std::istringstream in(line);
+        std::string keyword, field;
+        if (!(in >> keyword)) continue;
+        std::string where = name + ":" + std::to_string(line_number);
+        if (keyword != "camera") throw std::runtime_error(where + ": expected only camera statements");
+        if (!(in >> field)) throw std::runtime_error(where + ": expected a camera field");
+        scene_detail::set_camera_field(cam, field, in, where);
+    }
+}
+
+// Applies a file of camera statements to cam, as apply_camera_settings. Throws std::runtime_error if it is missing
+inline void read_camera_settings(const std::string& path, camera& cam) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("Unable to open camera settings '" + path + "'");
+    apply_camera_settings(file, path, cam);
+}
+
+/*
+ * A loaded scene, ready to render: the camera settings and the world, with its acceleration structures built. The
+ * spheres form a single sphere_set, and the meshes are instances in an instance_bvh, with each distinct mesh loaded
+ * once. The scene owns the materials, so must outlive any render of its world.
+ */
+class scene {
+    public:
+        camera cam;
+        hittable_list world;
+
+        scene() {}
+
+        // Loads a text or binary scene file (told apart by the binary magic). Throws std::runtime_error on failure
+        explicit scene(const std::string& path) {
+            scene_detail::mapped_file file(path);
+            if (!scene_detail::is_binary(file)) {
+                build(scene_detail::parse_text(reinterpret_cast<const char*>(file.data()), file.length(), path));
+                return;
+            }
+
+            auto binary = scene_detail::read_binary(file, path);
+            build(*binary.cam, binary.materials, binary.head.material_count, binary.spheres, binary.head.sphere_count,
+                  binary.meshes, path);
+        }
+
+        explicit scene(const scene_description& desc) { build(desc); }
+
+        // The world's objects point into the material table and light list, so a copy would point into this scene's
+        scene(const scene&) = delete;
+        scene& operator=(const scene&) = delete;
+
+    private:
+        std::vector<material> material_table;   // Never grown once built, as hit records point into it
+        shared_ptr<light_list> lights = make_shared<light_list>();
+
+        void build(const scene_description& desc) {
+            build(make_camera_record(desc.cam), desc.materials.data(), desc.materials.size(),
+                  desc.spheres.data(), desc.spheres.size(), desc.meshes, "scene");
+        }
+
+        void build(const scene_camera_record& camera_record, const material_record* materials, size_t material_count,
+                   const sphere_record* spheres, size_t sphere_count,
+                   const std::vector<scene_description::mesh_entry>& meshes, const std::string& path) {
+            apply_camera_record(camera_record, cam);
+
+            auto sphere_world = make_shared<sphere_set>();
+            sphere_world->reserve(sphere_count, material_count);
+
+            // Every sphere light gets a copy of its material of its own, holding the light's index
+            size_t sphere_lights = 0;
+            for (size_t k = 0; k < sphere_count; k++) {
+                if (spheres[k].material < material_count
+                    && material_type(materials[spheres[k].material].type) == material_type::diffuse_light) sphere_lights++;
+            }
+
+            material_table.reserve(material_count + sphere_lights);
+            for (size_t k = 0; k < material_count; k++) {
+                const auto& m = materials[k];
+                color albedo(m.albedo[0], m.albedo[1], m.albedo[2]);
+                switch (material_type(m.type)) {
+                    case material_type::lambertian: material_table.push_back(lambertian(albedo)); break;
+                    case material_type::metal: material_table.push_back(metal(albedo, m.parameter)); break;
+                    case material_type::dielectric: material_table.push_back(dielectric(m.parameter)); break;
+                    case material_type::diffuse_light: material_table.push_back(diffuse_light(albedo)); break;
+                    default: throw std::runtime_error("Scene '" + path + "' has a material of unknown type " + std::to_string(m.type));
+                }
+                sphere_world->add_material(&material_table[k]);
+            }
+
+            for (size_t k = 0; k < sphere_count; k++) {
+                const auto& s = spheres[k];
+                if (s.material >= material_count)
+                    throw std::runtime_error("Scene '" + path + "' has a sphere with an invalid material");
+                point3 center(s.center[0], s.center[1], s.center[2]);
+                vec3 motion(s.motion[0], s.motion[1], s.motion[2]);
+                int mat = int(s.material);
+
+                // The light list has no notion of time, so only still lights can be sampled
+                const auto& m = materials[s.material];
+                if (material_type(m.type) == material_type::diffuse_light && motion.length_squared() == 0) {
+                    color emission(m.albedo[0], m.albedo[1], m.albedo[2]);
+                    material_table.push_back(diffuse_light(emission, lights->add_sphere(center, s.radius, emission)));
+                    mat = sphere_world->add_material(&material_table.back());
+                }
+                sphere_world->add(center, center + motion, s.radius, mat);
+            }
+            cam.lights = lights;
+
+            if (sphere_world->size() > 0) {
+                sphere_world->build();
+                world.add(sphere_world);
+            }
+
+            if (meshes.empty()) return;
+
+            auto instances = make_shared<instance_bvh>();
+            std::map<std::pair<std::string, uint32_t>, shared_ptr<triangle_mesh>> loaded_meshes;
+            for (const auto& mesh : meshes) {
+                if (mesh.material >= material_count)
+                    throw std::runtime_error("Scene '" + path + "' has a mesh with an invalid material");
+
+                auto& geometry = loaded_meshes[{ mesh.path, mesh.material }];
+                if (!geometry) geometry = load_obj(mesh.path, &material_table[mesh.material]);
+                instances->add(geometry, mesh.object_to_world);
+            }
+            instances->build();
+            world.add(instances);
+        }
+};
+
+#endif
@@ -0,0 +1,435 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "hittable.h"
+#include "sphere.h"
+#include "bvh.h"
+
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SPHERE_SET_AVX2 1
+#include <immintrin.h>
+#endif
+
+/*
+	A large collection of spheres stored as a single hittable.
+
+	Rather than one heap allocated sphere object per sphere, reached through a virtual call each, the centers, radii and
+	material indices are kept in flat structure-of-arrays storage. A bvh_tree is built over the spheres, and the arrays
+	are sorted into leaf order, so every leaf is a contiguous run of spheres which can be tested several at a time:
+	4 per instruction with AVX2 where the CPU supports it (checked at runtime), or one by one otherwise. In the single
+	precision build (see real in util.h), AVX2 tests 8 at a time.
+
+	Spheres may move in straight lines (see ray::time). Once any does, the set keeps every sphere's motion in three more
+	arrays, the kernels move each center to the ray's time before testing it, and the tree interpolates its boxes to
+	that time too. Sets of still spheres never touch any of it.
+
+	Spheres are added with add(), after which build() must be called before the set is rendered.
+*/
+
+// Spheres [first, first + count) of the arrays passed, with the moving kernels moving each center by time times
+// (mx, my, mz). Returns the index of the closest one hit in (t_min, t_max) and shrinks t_max to its distance, or
+// returns -1 if none are hit
+using sphere_leaf_kernel = int (*)(
+	const real* cx, const real* cy, const real* cz, const real* radius, const real* mx, const real* my, const real* mz,
+	int first, int count, const real origin[3], const real dir[3], real time, real a, real t_min, real& t_max
+);
+
+template <bool moving>
+inline int sphere_leaf_scalar(
+	const real* cx, const real* cy, const real* cz, const real* radius, const real* mx, const real* my, const real* mz,
+	int first, int count, const real origin[3], const real dir[3], real time, real a, real t_min, real& t_max
+) {
+	const real inv_a = 1 / a;
+
+	int closest = -1;
+	for (int i = first; i < first + count; i++) {
+		real x = cx[i], y = cy[i], z = cz[i];
+		if constexpr (moving) {
+			x += time * mx[i];
+			y += time * my[i];
+			z += time * mz[i];
+		}
+
+		real ocx = x - origin[0];
+		real ocy = y - origin[1];
+		real ocz = z - origin[2];
+
+		real h = dir[0] * ocx + dir[1] * ocy + dir[2] * ocz;
+		real c = ocx * ocx + ocy * ocy + ocz * ocz - radius[i] * radius[i];
+		real discriminant = h * h - a * c;
+		if (discriminant < 0) continue;
+
+		real sqrtd = std::sqrt(discriminant);
+		real root = (h - sqrtd) * inv_a;
+		if (!(t_min < root && root < t_max)) {
+			root = (h + sqrtd) * inv_a;
+			if (!(t_min < root && root < t_max)) continue;
+		}
+
+		t_max = root;
+		closest = i;
+	}
+	return closest;
+}
+
+#if defined(SPHERE_SET_AVX2) && !defined(RAYTRACER_FLOAT)
+template <bool moving>
+__attribute__((target("avx2,fma")))
+inline int sphere_leaf_avx2(
+	const double* cx, const double* cy, const double* cz, const double* radius, const double* mx, const double* my, const double* mz,
+	int first, int count, const double origin[3], const double dir[3], double time, double a, double t_min, double& t_max
+) {
+	const __m256d ox = _mm256_set1_pd(origin[0]);
+	const __m256d oy = _mm256_set1_pd(origin[1]);
+	const __m256d oz = _mm256_set1_pd(origin[2]);
+	const __m256d dx = _mm256_set1_pd(dir[0]);
+	const __m256d dy = _mm256_set1_pd(dir[1]);
+	const __m256d dz = _mm256_set1_pd(dir[2]);
+	const __m256d va = _mm256_set1_pd(a);
+	const __m256d vinv_a = _mm256_set1_pd(1 / a);
+	const __m256d vt_min = _mm256_set1_pd(t_min);
+	const __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+	const __m256d zero = _mm256_setzero_pd();
+
+	int closest = -1;
+	for (int k = first; k < first + count; k += 4) {
+		__m256d x = _mm256_loadu_pd(cx + k);
+		__m256d y = _mm256_loadu_pd(cy + k);
+		__m256d z = _mm256_loadu_pd(cz + k);
+		if constexpr (moving) {
+			x = _mm256_fmadd_pd(_mm256_set1_pd(time), _mm256_loadu_pd(mx + k), x);
+			y = _mm256_fmadd_pd(_mm256_set1_pd(time), _mm256_loadu_pd(my + k), y);
+			z = _mm256_fmadd_pd(_mm256_set1_pd(time), _mm256_loadu_pd(mz + k), z);
+		}
+
+		__m256d ocx = _mm256_sub_pd(x, ox);
+		__m256d ocy = _mm256_sub_pd(y, oy);
+		__m256d ocz = _mm256_sub_pd(z, oz);
+		__m256d r = _mm256_loadu_pd(radius + k);
+
+		__m256d h = _mm256_fmadd_pd(dz, ocz, _mm256_fmadd_pd(dy, ocy, _mm256_mul_pd(dx, ocx)));
+		__m256d c = _mm256_fmadd_pd(ocz, ocz, _mm256_fmadd_pd(ocy, ocy, _mm256_mul_pd(ocx, ocx)));
+		c = _mm256_fnmadd_pd(r, r, c);
+		__m256d discriminant = _mm256_fnmadd_pd(va, c, _mm256_mul_pd(h, h));
+
+		// Lanes past the end of the leaf hold other spheres (or padding), so are masked out
+		__m256d valid = _mm256_cmp_pd(lane, _mm256_set1_pd(double(first + count - k)), _CMP_LT_OQ);
+		valid = _mm256_and_pd(valid, _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ));
+		if (_mm256_movemask_pd(valid) == 0) continue;
+
+		__m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+		__m256d vt_max = _mm256_set1_pd(t_max);
+		__m256d near_root = _mm256_mul_pd(_mm256_sub_pd(h, sqrtd), vinv_a);
+		__m256d far_root = _mm256_mul_pd(_mm256_add_pd(h, sqrtd), vinv_a);
+
+		__m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(vt_min, near_root, _CMP_LT_OQ), _mm256_cmp_pd(near_root, vt_max, _CMP_LT_OQ));
+		__m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(vt_min, far_root, _CMP_LT_OQ), _mm256_cmp_pd(far_root, vt_max, _CMP_LT_OQ));
+
+		__m256d root = _mm256_blendv_pd(far_root, near_root, near_ok);
+		__m256d hit = _mm256_and_pd(valid, _mm256_or_pd(near_ok, far_ok));
+
+		int mask = _mm256_movemask_pd(hit);
+		if (mask == 0) continue;
+
+		alignas(32) double roots[4];
+		_mm256_store_pd(roots, root);
+		for (int l = 0; l < 4; l++) {
+			if ((mask >> l) & 1 && roots[l] < t_max) {
+				t_max = roots[l];
+				closest = k + l;
+			}
+		}
+	}
+	return closest;
+}
+#elif defined(SPHERE_SET_AVX2)
+// The same as above, on 8 single precision lanes
+template <bool moving>
+__attribute__((target("avx2,fma")))
+inline int sphere_leaf_avx2(
+	const float* cx, const float* cy, const float* cz, const float* radius, const float* mx, const float* my, const float* mz,
+	int first, int count, const float origin[3], const float dir[3], float time, float a, float t_min, float& t_max
+) {
+	const __m256 ox = _mm256_set1_ps(origin[0]);
+	const __m256 oy = _mm256_set1_ps(origin[1]);
+	const __m256 oz = _mm256_set1_ps(origin[2]);
+	const __m256 dx = _mm256_set1_ps(dir[0]);
+	const __m256 dy = _mm256_set1_ps(dir[1]);
+	const __m256 dz = _mm256_set1_ps(dir[2]);
+	const __m256 va = _mm256_set1_ps(a);
+	const __m256 vinv_a = _mm256_set1_ps(1 / a);
+	const __m256 vt_min = _mm256_set1_ps(t_min);
+	const __m256 lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256 zero = _mm256_setzero_ps();
+
+	int closest = -1;
+	for (int k = first; k < first + count; k += 8) {
+		__m256 x = _mm256_loadu_ps(cx + k);
+		__m256 y = _mm256_loadu_ps(cy + k);
+		__m256 z = _mm256_loadu_ps(cz + k);
+		if constexpr (moving) {
+			x = _mm256_fmadd_ps(_mm256_set1_ps(time), _mm256_loadu_ps(mx + k), x);
+			y = _mm256_fmadd_ps(_mm256_set1_ps(time), _mm256_loadu_ps(my + k), y);
+			z = _mm256_fmadd_ps(_mm256_set1_ps(time), _mm256_loadu_ps(mz + k), z);
+		}
+
+		__m256 ocx = _mm256_sub_ps(x, ox);
+		__m256 ocy = _mm256_sub_ps(y, oy);
+		__m256 ocz = _mm256_sub_ps(z, oz);
+		__m256 r = _mm256_loadu_ps(radius + k);
+
+		__m256 h = _mm256_fmadd_ps(dz, ocz, _mm256_fmadd_ps(dy, ocy, _mm256_mul_ps(dx, ocx)));
+		__m256 c = _mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx)));
+		c = _mm256_fnmadd_ps(r, r, c);
+		__m256 discriminant = _mm256_fnmadd_ps(va, c, _mm256_mul_ps(h, h));
+
+		__m256 valid = _mm256_cmp_ps(lane, _mm256_set1_ps(float(first + count - k)), _CMP_LT_OQ);
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ));
+		if (_mm256_movemask_ps(valid) == 0) continue;
+
+		__m256 sqrtd = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+		__m256 vt_max = _mm256_set1_ps(t_max);
+		__m256 near_root = _mm256_mul_ps(_mm256_sub_ps(h, sqrtd), vinv_a);
+		__m256 far_root = _mm256_mul_ps(_mm256_add_ps(h, sqrtd), vinv_a);
+
+		__m256 near_ok = _mm256_and_ps(_mm256_cmp_ps(vt_min, near_root, _CMP_LT_OQ), _mm256_cmp_ps(near_root, vt_max, _CMP_LT_OQ));
+		__m256 far_ok = _mm256_and_ps(_mm256_cmp_ps(vt_min, far_root, _CMP_LT_OQ), _mm256_cmp_ps(far_root, vt_max, _CMP_LT_OQ));
+
+		__m256 root = _mm256_blendv_ps(far_root, near_root, near_ok);
+		__m256 hit = _mm256_and_ps(valid, _mm256_or_ps(near_ok, far_ok));
+
+		int mask = _mm256_movemask_ps(hit);
+		if (mask == 0) continue;
+
+		alignas(32) float roots[8];
+		_mm256_store_ps(roots, root);
+		for (int l = 0; l < 8; l++) {
+			if ((mask >> l) & 1 && roots[l] < t_max) {
+				t_max = roots[l];
+				closest = k + l;
+			}
+		}
+	}
+	return closest;
+}
+#endif
+
+class sphere_set : public hittable {
+	public:
+		// Lanes processed per SIMD step. The arrays are padded by this much so that the last leaf can always be loaded
+		static constexpr int simd_width = 32 / sizeof(real);
+
+		// Whether to use the AVX2 kernel. Defaults to whether the CPU running the program supports it
+		bool use_simd = simd_supported();
+
+		static bool simd_supported() {
+#ifdef SPHERE_SET_AVX2
+			static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+			return supported;
+#else
+			return false;
+#endif
+		}
+
+		void add(const point3& center, real radius, shared_ptr<material> mat) {
+			add(center, center, radius, mat);
+		}
+
+		// A sphere moving in a straight line at constant speed, from center1 at time 0 to center2 at time 1
+		void add(const point3& center1, const point3& center2, real radius, shared_ptr<material> mat) {
+			if (material_index.find(mat.get()) == material_index.end()) owned_materials.push_back(mat);
+			add(center1, center2, radius, mat.get());
+		}
+
+		// The material must outlive the set, e.g. by being in a scene's material table
+		void add(const point3& center, real radius, const material* mat) {
+			add(center, center, radius, mat);
+		}
+
+		void add(const point3& center1, const point3& center2, real radius, const material* mat) {
+			auto found = material_index.find(mat);
+			int index;
+			if (found == material_index.end()) {
+				index = add_material(mat);
+				material_index.emplace(mat, index);
+			} else {
+				index = found->second;
+			}
+
+			add(center1, center2, radius, index);
+		}
+
+		// Appends a material to the set's table without checking for duplicates, returning its index for add()
+		int add_material(const material* mat) {
+			materials.push_back(mat);
+			return int(materials.size()) - 1;
+		}
+
+		// Adds a sphere using a material index returned by add_material()
+		void add(const point3& center, real radius, int material) {
+			add(center, center, radius, material);
+		}
+
+		void add(const point3& center1, const point3& center2, real radius, int material) {
+			// A build pads the arrays for the SIMD kernels, which must not be left between the spheres
+			for (auto* array : { &cx, &cy, &cz, &radii, &mx, &my, &mz }) {
+				if (array->size() > size()) array->resize(size());
+			}
+
+			vec3 motion = center2 - center1;
+			if (motion.length_squared() > 0 && !moving()) {
+				// The first moving sphere: every sphere before it stays still
+				for (auto* array : { &mx, &my, &mz }) {
+					array->reserve(cx.capacity());
+					array->assign(size(), 0);
+				}
+			}
+			if (moving()) {
+				mx.push_back(motion.x());
+				my.push_back(motion.y());
+				mz.push_back(motion.z());
+			}
+
+			cx.push_back(center1.x());
+			cy.push_back(center1.y());
+			cz.push_back(center1.z());
+			radii.push_back(std::fmax(real(0), radius));
+			mat_indices.push_back(material);
+		}
+
+		// Preallocates room for the given number of spheres and materials, so that adding them does not reallocate
+		void reserve(size_t spheres, size_t material_count) {
+			for (auto* array : { &cx, &cy, &cz, &radii }) array->reserve(spheres + simd_width);
+			mat_indices.reserve(spheres);
+			materials.reserve(material_count);
+		}
+
+		size_t size() const { return mat_indices.size(); }
+
+		// Whether any sphere added so far moves
+		bool moving() const override { return !mx.empty(); }
+
+		// Builds the BVH over all spheres added so far, and reorders the sphere arrays to match its leaves
+		void build() {
+			size_t n = size();
+			std::vector<aabb> bounds(n);
+			for (size_t i = 0; i < n; i++) {
+				auto rvec = vec3(radii[i], radii[i], radii[i]);
+				point3 center(cx[i], cy[i], cz[i]);
+				bounds[i] = aabb(center - rvec, center + rvec);
+			}
+
+			// A leaf of spheres is cheap to test compared to a virtual call per object, so leaves can be larger
+			if (moving()) {
+				std::vector<aabb> end_bounds(n);
+				for (size_t i = 0; i < n; i++) {
+					auto rvec = vec3(radii[i], radii[i], radii[i]);
+					point3 center(cx[i] + mx[i], cy[i] + my[i], cz[i] + mz[i]);
+					end_bounds[i] = aabb(center - rvec, center + rvec);
+				}
+				tree.build(bounds, end_bounds, 2 * simd_width, 0.15);
+			} else {
+				tree.build(bounds, 2 * simd_width, 0.15);
+			}
+
+			reorder(cx, tree.prim_indices);
+			reorder(cy, tree.prim_indices);
+			reorder(cz, tree.prim_indices);
+			reorder(radii, tree.prim_indices);
+			reorder(mat_indices, tree.prim_indices);
+
+			for (auto* array : { &cx, &cy, &cz, &radii }) {
+				array->resize(n + simd_width, 0);
+			}
+
+			if (moving()) {
+				for (auto* array : { &mx, &my, &mz }) {
+					reorder(*array, tree.prim_indices);
+					array->resize(n + simd_width, 0);
+				}
+			}
+		}
+
+		bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+			const vec3& d = r.direction();
+			const point3& o = r.origin();
+			const real origin[3] = { o.x(), o.y(), o.z() };
+			const real dir[3] = { d.x(), d.y(), d.z() };
+			const real a = d.length_squared();
+			sphere_leaf_kernel kernel = leaf_kernel();
+
+			int closest = -1;
+			real closest_t = ray_t.max;
+			tree.traverse(r, ray_t, [&](int first, int count, interval& t) {
+				STATS_ADD(sphere_set_tests, count);
+				int i = kernel(cx.data(), cy.data(), cz.data(), radii.data(), mx.data(), my.data(), mz.data(),
+					first, count, origin, dir, r.time(), a, t.min, t.max);
+				if (i < 0) return false;
+				closest = i;
+				closest_t = t.max;
+				return true;
+			});
+
+			if (closest < 0) return false;
+
+			// Only the closest sphere needs a full hit record
+			point3 center(cx[closest], cy[closest], cz[closest]);
+			if (moving()) center += r.time() * vec3(mx[closest], my[closest], mz[closest]);
+
+			rec.t = closest_t;
+			vec3 outward_normal = unit_vector(r.at(rec.t) - center);
+			rec.p = center + radii[closest] * outward_normal;
+			rec.p_error = sphere::reprojection_error(center, radii[closest]);
+			rec.mat = materials[mat_indices[closest]];
+			rec.set_face_normal(r, outward_normal);
+
+			return true;
+		}
+
+		bool occluded(const ray& r, interval ray_t) const override {
+			const vec3& d = r.direction();
+			const point3& o = r.origin();
+			const real origin[3] = { o.x(), o.y(), o.z() };
+			const real dir[3] = { d.x(), d.y(), d.z() };
+			const real a = d.length_squared();
+			sphere_leaf_kernel kernel = leaf_kernel();
+
+			return tree.traverse_any(r, ray_t, [&](int first, int count, interval& t) {
+				STATS_ADD(sphere_set_tests, count);
+				return kernel(cx.data(), cy.data(), cz.data(), radii.data(), mx.data(), my.data(), mz.data(),
+					first, count, origin, dir, r.time(), a, t.min, t.max) >= 0;
+			});
+		}
+
+		aabb bounding_box() const override { return tree.bounding_box(); }
+		aabb start_bounding_box() const override { return tree.start_bounding_box(); }
+		aabb end_bounding_box() const override { return tree.end_bounding_box(); }
+
+	private:
+		std::vector<real> cx, cy, cz, radii;
+		std::vector<real> mx, my, mz;	// Motion of each sphere from time 0 to 1, if any sphere moves. Otherwise empty
+		std::vector<int> mat_indices;
+		std::vector<const material*> materials;
+		std::vector<shared_ptr<material>> owned_materials;
+		std::unordered_map<const material*, int> material_index;
+		bvh_tree tree;
+
+		sphere_leaf_kernel leaf_kernel() const {
+#ifdef SPHERE_SET_AVX2
+			if (use_simd) return moving() ? sphere_leaf_avx2<true> : sphere_leaf_avx2<false>;
+#endif
+			return moving() ? sphere_leaf_scalar<true> : sphere_leaf_scalar<false>;
+		}
+
+		template <typename T>
+		static void reorder(std::vector<T>& values, const std::vector<int>& order) {
+			std::vector<T> sorted(order.size());
+			for (size_t i = 0; i < order.size(); i++) sorted[i] = values[order[i]];
+			values = std::move(sorted);
+		}
+};
+
+#endif
@@ -6,11 +6,89 @@
 
 class sphere : public hittable {
 	public:
-		sphere(const point3& center, double radius, shared_ptr<material> mat) :
-			center(center), radius(std::fmax(0,radius)), mat(mat) {}
+		// Keeps mat alive for as long as the sphere, for scenes built by hand. Hits still only use the plain pointer
+		sphere(const point3& center, real radius, shared_ptr<material> mat) :
+			sphere(center, radius, mat.get())
+		{
+			mat_owner = mat;
+		}
+
+		// The material must outlive the sphere, e.g. by being in a scene's material table
+		sphere(const point3& center, real radius, const material* mat) :
+			sphere(center, center, radius, mat) {}
+
+		// A sphere moving in a straight line at constant speed, from center1 at time 0 to center2 at time 1
+		sphere(const point3& center1, const point3& center2, real radius, shared_ptr<material> mat) :
+			sphere(center1, center2, radius, mat.get())
+		{
+			mat_owner = mat;
+		}
+
+		sphere(const point3& center1, const point3& center2, real radius, const material* mat) :
+			center(center1), motion(center2 - center1), radius(std::fmax(real(0), radius)), mat(mat)
+		{
+			auto rvec = vec3(radius, radius, radius);
+			start_bbox = aabb(center1 - rvec, center1 + rvec);
+			end_bbox = aabb(center2 - rvec, center2 + rvec);
+			bbox = aabb(start_bbox, end_bbox);
+
+			// The error bound grows with the coordinates, so the larger of the two ends bounds it along the way
+			p_error = std::fmax(reprojection_error(center1, radius), reprojection_error(center2, radius));
+		}
+
+		/*
+			Bound on the error of a hit point of a sphere, after moving it onto the surface.
+
+			The point found from the ray's distance can be a long way off the surface when the quadratic loses
+			precision, e.g. for rays grazing the sphere. Moving it along the normal onto the surface, center +
+			radius * normal, leaves an error of a few roundings of the center and radius instead.
+		*/
+		static real reprojection_error(const point3& center, real radius) {
+			real extent = std::fmax(std::fabs(center.x()), std::fmax(std::fabs(center.y()), std::fabs(center.z())));
+			return gamma_bound(6) * (extent + radius);
+		}
 
 		bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-			vec3 oc = center - r.origin();
+			real root;
+			if (!nearest_root(r, ray_t, root)) return false;
+
+			rec.t = root;
+			point3 current = center_at(r.time());
+			vec3 outward_normal = unit_vector(r.at(rec.t) - current);
+			rec.p = current + radius * outward_normal;
+			rec.p_error = p_error;
+			rec.mat = mat;
+			rec.set_face_normal(r, outward_normal);
+
+			return true;
+		}
+
+		bool occluded(const ray& r, interval ray_t) const override {
+			real root;
+			return nearest_root(r, ray_t, root);
+		}
+
+		aabb bounding_box() const override { return bbox; }
+		bool moving() const override { return motion.length_squared() > 0; }
+		aabb start_bounding_box() const override { return start_bbox; }
+		aabb end_bounding_box() const override { return end_bbox; }
+
+	private:
+		point3 center;		// At time 0
+		vec3 motion;		// From the center at time 0 to the center at time 1
+		real radius;
+		real p_error;
+		const material* mat;
+		shared_ptr<material> mat_owner;
+		aabb bbox, start_bbox, end_bbox;
+
+		// Still spheres have no motion, so are always exactly at center
+		point3 center_at(real time) const { return center + time * motion; }
+
+		// Finds the nearest distance within ray_t at which the ray crosses the surface, if any
+		bool nearest_root(const ray& r, interval ray_t, real& root) const {
+			STATS_COUNT(sphere_tests);
+			vec3 oc = center_at(r.time()) - r.origin();
 			auto a = r.direction().length_squared();
 			auto h = dot(r.direction(), oc);
 			auto c = oc.length_squared() - radius*radius;
@@ -24,28 +102,15 @@ class sphere : public hittable {
 
 			// Finding nearest root that lies in the acc range
 
-			auto root = (h - sqrtd) / a;
+			root = (h - sqrtd) / a;
 			if (!ray_t.surrounds(root)) {
 				root = (h + sqrtd)/ a;
 				if (!ray_t.surrounds(root)) {
 					return false;
 				}
 			}
-
-			rec.t = root;
-			rec.p = r.at(rec.t);
-			rec.normal = (rec.p - center) / radius;
-			vec3 outward_normal = (rec.p - center) / radius;
-			rec.mat = mat;
-			rec.set_face_normal(r, outward_normal);
-
 			return true;
 		}
-
-	private:
-		point3 center;
-		double radius;
-		shared_ptr<material> mat;
 };
 
 #endif
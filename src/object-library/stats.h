@@ -0,0 +1,195 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ * Render statistics, compiled in only when RAYTRACER_STATS is defined (the RAYTRACER_STATS CMake option).
+ *
+ * The hot paths count events with the STATS_* macros below. Without RAYTRACER_STATS the macros expand to nothing, so
+ * normal builds carry no trace of them. With it, every thread counts into its own block of counters, reached through
+ * a thread_local pointer and never shared, so counting is a plain increment. The blocks are only summed when a report
+ * is asked for, after the render.
+ *
+ * Counted are camera rays, secondary (bounce) rays and shadow rays, hits and misses, intersection tests by kind of object, scatter
+ * events by material, the distribution of path lengths, and the time spent on every tile. render_stats_report()
+ * prints a summary and render_stats_heatmap() draws the tile times as an image.
+ */
+
+#ifdef RAYTRACER_STATS
+
+#include "image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+enum class stat_counter : int {
+    primary_rays, secondary_rays, shadow_rays, shadow_rays_blocked, hits, misses,
+    bvh_nodes, list_tests, sphere_tests, sphere_set_tests, triangle_tests, instance_tests,
+    scatter_lambertian, scatter_metal, scatter_dielectric, absorbed,
+    count
+};
+
+inline const char* stat_name(stat_counter s) {
+    static const char* names[] = {
+        "camera rays", "secondary rays", "shadow rays", "shadow rays blocked", "hits", "misses",
+        "bvh nodes visited", "hittable_list objects tested", "sphere tests", "sphere_set sphere tests",
+        "triangle tests", "instance tests",
+        "lambertian scatters", "metal scatters", "dielectric scatters", "absorbed",
+    };
+    return names[int(s)];
+}
+
+// One thread's counters
+struct stats_block {
+    static constexpr int path_length_buckets = 64;  // The last bucket also counts all longer paths
+
+    uint64_t values[int(stat_counter::count)] = {};
+    uint64_t path_lengths[path_length_buckets] = {};
+    std::map<std::tuple<int, int, int, int>, double> tile_seconds;  // Keyed by tile x0, y0, x1, y1
+
+    void reset() {
+        std::fill(std::begin(values), std::end(values), 0);
+        std::fill(std::begin(path_lengths), std::end(path_lengths), 0);
+        tile_seconds.clear();
+    }
+};
+
+// Owns every thread's block, so blocks outlive the threads which filled them
+class stats_registry {
+    public:
+        static stats_registry& instance() {
+            static stats_registry registry;
+            return registry;
+        }
+
+        stats_block* add_thread() {
+            std::lock_guard<std::mutex> lock(mutex);
+            blocks.push_back(std::make_unique<stats_block>());
+            return blocks.back().get();
+        }
+
+        // Sums all threads' blocks. Only meaningful while no render is running
+        stats_block merged() {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats_block total;
+            for (const auto& block : blocks) {
+                for (int k = 0; k < int(stat_counter::count); k++) total.values[k] += block->values[k];
+                for (int k = 0; k < stats_block::path_length_buckets; k++) total.path_lengths[k] += block->path_lengths[k];
+                for (const auto& [tile, seconds] : block->tile_seconds) total.tile_seconds[tile] += seconds;
+            }
+            return total;
+        }
+
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& block : blocks) block->reset();
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<std::unique_ptr<stats_block>> blocks;
+};
+
+inline stats_block& stats_thread_block() {
+    thread_local stats_block* block = stats_registry::instance().add_thread();
+    return *block;
+}
+
+// Adds the time until it goes out of scope to the tile's total
+class stats_tile_timer {
+    public:
+        stats_tile_timer(int x0, int y0, int x1, int y1) : tile(x0, y0, x1, y1), start(std::chrono::steady_clock::now()) {}
+
+        ~stats_tile_timer() {
+            auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            stats_thread_block().tile_seconds[tile] += elapsed;
+        }
+
+    private:
+        std::tuple<int, int, int, int> tile;
+        std::chrono::steady_clock::time_point start;
+};
+
+#define STATS_ADD(name, n) (stats_thread_block().values[int(stat_counter::name)] += uint64_t(n))
+#define STATS_COUNT(name) STATS_ADD(name, 1)
+#define STATS_PATH_LENGTH(n) (stats_thread_block().path_lengths[std::min(int(n), stats_block::path_length_buckets - 1)]++)
+#define STATS_TILE_TIMER(x0, y0, x1, y1) stats_tile_timer stats_tile_timer_scope(x0, y0, x1, y1)
+
+// Prints a summary of everything counted since the last reset
+inline void render_stats_report(std::FILE* out) {
+    stats_block s = stats_registry::instance().merged();
+    auto value = [&](stat_counter k) { return s.values[int(k)]; };
+
+    uint64_t rays = value(stat_counter::primary_rays) + value(stat_counter::secondary_rays);
+    std::fprintf(out, "Render statistics\n");
+    for (int k = 0; k < int(stat_counter::count); k++) {
+        double per_ray = rays ? double(s.values[k]) / rays : 0;
+        std::fprintf(out, "  %-30s %16llu  %10.3f per ray\n", stat_name(stat_counter(k)), (unsigned long long)s.values[k], per_ray);
+    }
+
+    uint64_t paths = 0, bounces = 0;
+    for (int k = 0; k < stats_block::path_length_buckets; k++) {
+        paths += s.path_lengths[k];
+        bounces += s.path_lengths[k] * k;
+    }
+    std::fprintf(out, "Path lengths (rays per path), mean %.2f\n", paths ? double(bounces) / paths : 0);
+    for (int k = 0; k < stats_block::path_length_buckets; k++) {
+        if (s.path_lengths[k] == 0) continue;
+        double share = double(s.path_lengths[k]) / paths;
+        std::fprintf(out, "  %3d%s %14llu  %6.2f%%  %.*s\n", k, k == stats_block::path_length_buckets - 1 ? "+" : " ",
+            (unsigned long long)s.path_lengths[k], 100 * share, int(share * 50 + 0.5), "##################################################");
+    }
+
+    if (!s.tile_seconds.empty()) {
+        double total = 0, slowest = 0, fastest = 1e300;
+        for (const auto& [tile, seconds] : s.tile_seconds) {
+            total += seconds;
+            slowest = std::max(slowest, seconds);
+            fastest = std::min(fastest, seconds);
+        }
+        std::fprintf(out, "Tiles: %zu, thread time %.3f s, per tile min %.2f ms, mean %.2f ms, max %.2f ms\n",
+            s.tile_seconds.size(), total, 1000 * fastest, 1000 * total / s.tile_seconds.size(), 1000 * slowest);
+    }
+}
+
+// Draws each tile in a colour for the time spent on it, from black (fastest) through red and yellow to white (slowest)
+inline image render_stats_heatmap(int width, int height) {
+    stats_block s = stats_registry::instance().merged();
+    image heatmap(width, height);
+
+    double fastest = 1e300, slowest = 0;
+    for (const auto& [tile, seconds] : s.tile_seconds) {
+        fastest = std::min(fastest, seconds);
+        slowest = std::max(slowest, seconds);
+    }
+    double range = slowest > fastest ? slowest - fastest : 1;
+
+    for (const auto& [tile, seconds] : s.tile_seconds) {
+        auto [x0, y0, x1, y1] = tile;
+        double t = (seconds - fastest) / range;
+        color c(std::clamp(3 * t, 0.0, 1.0), std::clamp(3 * t - 1, 0.0, 1.0), std::clamp(3 * t - 2, 0.0, 1.0));
+        for (int j = std::max(0, y0); j < std::min(y1, height); j++) {
+            for (int i = std::max(0, x0); i < std::min(x1, width); i++) heatmap.at(i, j) = c;
+        }
+    }
+    return heatmap;
+}
+
+inline void render_stats_reset() { stats_registry::instance().reset(); }
+
+#else
+
+#define STATS_ADD(name, n) ((void)0)
+#define STATS_COUNT(name) ((void)0)
+#define STATS_PATH_LENGTH(n) ((void)0)
+#define STATS_TILE_TIMER(x0, y0, x1, y1) ((void)0)
+
+#endif
+
+#endif
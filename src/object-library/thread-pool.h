@@ -0,0 +1,156 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Persistent pool of worker threads with work-stealing task queues.
+ *
+ * A job is a number of independent tasks, identified by index. The indices are dealt out to the workers in
+ * contiguous blocks (so neighbouring tiles of an image tend to stay on the same thread), and each worker pops tasks
+ * from the front of its own queue. A worker whose queue runs dry steals from the back of another worker's queue, so
+ * threads that drew cheap tasks pick up the slack of those which drew expensive ones instead of sitting idle.
+ *
+ * Threads are created once and sleep between jobs, so the same pool can be reused across many renders.
+ */
+class thread_pool {
+    public:
+        // A thread_count of 0 uses every hardware thread on the machine
+        explicit thread_pool(int thread_count = 0) {
+            if (thread_count <= 0) thread_count = int(std::thread::hardware_concurrency());
+            if (thread_count <= 0) {
+                std::clog << "Unable to determine thread count, defaulting to 2\n";
+                thread_count = 2;
+            }
+
+            queues = std::vector<worker_queue>(thread_count);
+            for (int i = 0; i < thread_count; i++) {
+                workers.emplace_back(&thread_pool::worker_loop, this, i);
+            }
+        }
+
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& t : workers) t.join();
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        int size() const { return int(workers.size()); }
+
+        /*
+         * Starts running task(index, worker) for every index in [0, task_count), and returns immediately. worker is
+         * the index of the thread running the task, in [0, size()), which callers can use to address per-thread
+         * storage without locking. Only one job runs at a time, so this first waits for any previous job to finish.
+         */
+        void start(int task_count, std::function<void(int, int)> task) {
+            wait();
+
+            int n = size();
+            for (int w = 0; w < n; w++) {
+                std::lock_guard<std::mutex> guard(queues[w].lock);
+                queues[w].tasks.clear();
+                for (int i = int((long long)task_count * w / n); i < int((long long)task_count * (w + 1) / n); i++) {
+                    queues[w].tasks.push_back(i);
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                job = std::move(task);
+                busy_workers = n;
+                generation++;
+            }
+            wake.notify_all();
+        }
+
+        // Blocks until the current job has finished
+        void wait() {
+            std::unique_lock<std::mutex> guard(lock);
+            done.wait(guard, [this] { return busy_workers == 0; });
+        }
+
+        // Blocks until the current job has finished or the timeout expires. Returns true if the job has finished
+        template <typename Rep, typename Period>
+        bool wait_for(const std::chrono::duration<Rep, Period>& timeout) {
+            std::unique_lock<std::mutex> guard(lock);
+            return done.wait_for(guard, timeout, [this] { return busy_workers == 0; });
+        }
+
+    private:
+        // Each queue sits on its own cache line, so workers popping their own queues don't contend with each other
+        struct alignas(64) worker_queue {
+            std::mutex lock;
+            std::deque<int> tasks;
+        };
+
+        std::vector<worker_queue> queues;
+        std::vector<std::thread> workers;
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        std::function<void(int, int)> job;
+        unsigned long long generation = 0;
+        int busy_workers = 0;
+        bool stopping = false;
+
+        bool pop_own(int worker, int& task) {
+            std::lock_guard<std::mutex> guard(queues[worker].lock);
+            if (queues[worker].tasks.empty()) return false;
+            task = queues[worker].tasks.front();
+            queues[worker].tasks.pop_front();
+            return true;
+        }
+
+        bool steal(int thief, int& task) {
+            int n = size();
+            for (int offset = 1; offset < n; offset++) {
+                auto& victim = queues[(thief + offset) % n];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (victim.tasks.empty()) continue;
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+            return false;
+        }
+
+        void worker_loop(int worker) {
+            unsigned long long seen_generation = 0;
+
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [&] { return stopping || generation != seen_generation; });
+                    if (stopping) return;
+                    seen_generation = generation;
+                }
+
+                // Tasks are never added to a running job, so once every queue is empty this worker is done
+                int task;
+                while (pop_own(worker, task) || steal(worker, task)) {
+                    job(task, worker);
+                }
+
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (--busy_workers == 0) done.notify_all();
+                }
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "util.h"
+#include "vec3.h"
+#include "aabb.h"
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+/*
+	Affine transform, stored as the top three rows of a 4x4 matrix together with its inverse, so that both directions
+	are a handful of multiply-adds.
+
+	Transforms compose like matrices: (a * b) applies b first, then a. The named constructors build the usual
+	primitives, e.g.
+
+		auto t = transform::translate(vec3(0, 1, 0)) * transform::rotate(vec3(0, 1, 0), 45) * transform::scale(2);
+*/
+
+class transform {
+	public:
+		transform() : m{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } }, inv{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } {}
+
+		// Row-major 3x4 matrix. Throws std::invalid_argument if it has no inverse or is not finite
+		explicit transform(const double (&matrix)[3][4]) {
+			if (!try_make(matrix, *this)) throw std::invalid_argument("Transform matrix is singular or not finite");
+		}
+
+		// Sets result to the transform of a row-major 3x4 matrix, or returns false if it has no inverse or is not finite
+		static bool try_make(const double (&matrix)[3][4], transform& result) {
+			double forward[3][4], inverse[3][4];
+			for (int r = 0; r < 3; r++) {
+				for (int c = 0; c < 4; c++) {
+					if (!std::isfinite(matrix[r][c])) return false;
+					forward[r][c] = matrix[r][c];
+				}
+			}
+			if (!invert(forward, inverse)) return false;
+
+			std::memcpy(result.m, forward, sizeof(forward));
+			std::memcpy(result.inv, inverse, sizeof(inverse));
+			return true;
+		}
+
+		static transform translate(const vec3& offset) {
+			double matrix[3][4] = { { 1, 0, 0, offset.x() }, { 0, 1, 0, offset.y() }, { 0, 0, 1, offset.z() } };
+			return transform(matrix);
+		}
+
+		static transform scale(double s) { return scale(vec3(s, s, s)); }
+
+		static transform scale(const vec3& s) {
+			double matrix[3][4] = { { s.x(), 0, 0, 0 }, { 0, s.y(), 0, 0 }, { 0, 0, s.z(), 0 } };
+			return transform(matrix);
+		}
+
+		// Rotation counter-clockwise about the given axis (looking down it towards the origin)
+		static transform rotate(const vec3& axis, double degrees) {
+			vec3 a = unit_vector(axis);
+			double s = std::sin(degrees_to_radians(degrees));
+			double c = std::cos(degrees_to_radians(degrees));
+			double k = 1 - c;
+			double matrix[3][4] = {
+				{ a.x() * a.x() * k + c,         a.x() * a.y() * k - a.z() * s, a.x() * a.z() * k + a.y() * s, 0 },
+				{ a.y() * a.x() * k + a.z() * s, a.y() * a.y() * k + c,         a.y() * a.z() * k - a.x() * s, 0 },
+				{ a.z() * a.x() * k - a.y() * s, a.z() * a.y() * k + a.x() * s, a.z() * a.z() * k + c,         0 }
+			};
+			return transform(matrix);
+		}
+
+		friend transform operator*(const transform& a, const transform& b) {
+			transform result;
+			multiply(a.m, b.m, result.m);
+			multiply(b.inv, a.inv, result.inv);
+			return result;
+		}
+
+		double element(int row, int col) const { return m[row][col]; }
+
+		point3 point(const point3& p) const { return apply(m, p, 1); }
+		vec3 vector(const vec3& v) const { return apply(m, v, 0); }
+
+		// Bound on the error in each coordinate of point(p), given a bound p_error on the error in each coordinate of p
+		real point_error(const point3& p, real p_error) const {
+			real result = 0;
+			for (int r = 0; r < 3; r++) {
+				double scale = std::fabs(m[r][0]) + std::fabs(m[r][1]) + std::fabs(m[r][2]);
+				double magnitude = std::fabs(m[r][0] * p.x()) + std::fabs(m[r][1] * p.y()) + std::fabs(m[r][2] * p.z()) + std::fabs(m[r][3]);
+				result = std::fmax(result, real(scale * p_error + gamma_bound(4) * magnitude));
+			}
+			return result;
+		}
+
+		point3 inverse_point(const point3& p) const { return apply(inv, p, 1); }
+		vec3 inverse_vector(const vec3& v) const { return apply(inv, v, 0); }
+
+		// Normals transform by the inverse transpose, to stay perpendicular to the transformed surface. Not normalised
+		vec3 normal(const vec3& n) const {
+			return vec3(
+				inv[0][0] * n.x() + inv[1][0] * n.y() + inv[2][0] * n.z(),
+				inv[0][1] * n.x() + inv[1][1] * n.y() + inv[2][1] * n.z(),
+				inv[0][2] * n.x() + inv[1][2] * n.y() + inv[2][2] * n.z()
+			);
+		}
+
+		// Box enclosing the transformed box
+		aabb bounds(const aabb& box) const {
+			if (box.is_empty()) return box;
+
+			// Each output axis is the sum of the matrix columns' contributions, taking the min and max of each term
+			interval axes[3];
+			for (int r = 0; r < 3; r++) {
+				double lo = m[r][3], hi = m[r][3];
+				for (int c = 0; c < 3; c++) {
+					double a = m[r][c] * box.axis_interval(c).min;
+					double b = m[r][c] * box.axis_interval(c).max;
+					lo += std::fmin(a, b);
+					hi += std::fmax(a, b);
+				}
+				axes[r] = interval(lo, hi);
+			}
+			return aabb(axes[0], axes[1], axes[2]);
+		}
+
+	private:
+		double m[3][4];
+		double inv[3][4];
+
+		static vec3 apply(const double (&t)[3][4], const vec3& v, double w) {
+			return vec3(
+				t[0][0] * v.x() + t[0][1] * v.y() + t[0][2] * v.z() + t[0][3] * w,
+				t[1][0] * v.x() + t[1][1] * v.y() + t[1][2] * v.z() + t[1][3] * w,
+				t[2][0] * v.x() + t[2][1] * v.y() + t[2][2] * v.z() + t[2][3] * w
+			);
+		}
+
+		static void multiply(const double (&a)[3][4], const double (&b)[3][4], double (&out)[3][4]) {
+			for (int r = 0; r < 3; r++) {
+				for (int c = 0; c < 4; c++) {
+					out[r][c] = a[r][0] * b[0][c] + a[r][1] * b[1][c] + a[r][2] * b[2][c] + (c == 3 ? a[r][3] : 0);
+				}
+			}
+		}
+
+		static bool invert(const double (&t)[3][4], double (&out)[3][4]) {
+			double det = t[0][0] * (t[1][1] * t[2][2] - t[1][2] * t[2][1])
+			           - t[0][1] * (t[1][0] * t[2][2] - t[1][2] * t[2][0])
+			           + t[0][2] * (t[1][0] * t[2][1] - t[1][1] * t[2][0]);
+			if (det == 0 || !std::isfinite(det)) return false;
+			double d = 1 / det;
+
+			out[0][0] =  (t[1][1] * t[2][2] - t[1][2] * t[2][1]) * d;
+			out[0][1] = -(t[0][1] * t[2][2] - t[0][2] * t[2][1]) * d;
+			out[0][2] =  (t[0][1] * t[1][2] - t[0][2] * t[1][1]) * d;
+			out[1][0] = -(t[1][0] * t[2][2] - t[1][2] * t[2][0]) * d;
+			out[1][1] =  (t[0][0] * t[2][2] - t[0][2] * t[2][0]) * d;
+			out[1][2] = -(t[0][0] * t[1][2] - t[0][2] * t[1][0]) * d;
+			out[2][0] =  (t[1][0] * t[2][1] - t[1][1] * t[2][0]) * d;
+			out[2][1] = -(t[0][0] * t[2][1] - t[0][1] * t[2][0]) * d;
+			out[2][2] =  (t[0][0] * t[1][1] - t[0][1] * t[1][0]) * d;
+
+			// The inverse translation undoes the translation after the inverse linear part
+			for (int r = 0; r < 3; r++) {
+				out[r][3] = -(out[r][0] * t[0][3] + out[r][1] * t[1][3] + out[r][2] * t[2][3]);
+			}
+			return true;
+		}
+};
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "hittable.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+	A triangle mesh stored as a single hittable.
+
+	Triangles are not objects of their own: the mesh holds one shared vertex buffer and an index buffer with three
+	vertex indices per triangle, and builds its own bvh_tree over the triangles. build() reorders the index buffer
+	into leaf order, so a leaf is a contiguous run of triangles and the mesh needs no per-triangle storage beyond its
+	indices.
+
+	Rays are intersected with the watertight algorithm of Woop, Benthin and Wald ("Watertight Ray/Triangle
+	Intersection", 2013). The triangle is transformed into a space where the ray runs along +z from the origin, and
+	the edge functions are evaluated there, which means a ray passing exactly through a shared edge or vertex always
+	hits at least one of the triangles around it: there are no cracks for rays to slip through between neighbouring
+	triangles.
+
+	Triangles face the side their vertices are counter-clockwise from, as in OBJ files. Per-vertex normals, if given,
+	are interpolated for shading.
+*/
+
+class triangle_mesh : public hittable {
+	public:
+		std::vector<point3> vertices;
+		std::vector<vec3> normals;
+		std::vector<uint32_t> indices;			// Three entries into vertices per triangle
+		std::vector<uint32_t> normal_indices;	// Empty, or three entries into normals per triangle (no_normal if none)
+
+		static constexpr uint32_t no_normal = UINT32_MAX;
+
+		triangle_mesh(shared_ptr<material> mat) : triangle_mesh(mat.get()) {
+			mat_owner = mat;
+		}
+
+		// The material must outlive the mesh, e.g. by being in a scene's material table
+		triangle_mesh(const material* mat) : mat(mat) {}
+
+		size_t triangle_count() const { return indices.size() / 3; }
+
+		void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+			indices.insert(indices.end(), { a, b, c });
+		}
+
+		// Builds the BVH over the triangles, and reorders the index buffers to match its leaves
+		void build() {
+			size_t n = triangle_count();
+			std::vector<aabb> bounds(n);
+			for (size_t k = 0; k < n; k++) {
+				const point3& a = vertices[indices[3 * k]];
+				const point3& b = vertices[indices[3 * k + 1]];
+				const point3& c = vertices[indices[3 * k + 2]];
+				bounds[k] = aabb(
+					interval(std::fmin(a.x(), std::fmin(b.x(), c.x())), std::fmax(a.x(), std::fmax(b.x(), c.x()))),
+					interval(std::fmin(a.y(), std::fmin(b.y(), c.y())), std::fmax(a.y(), std::fmax(b.y(), c.y()))),
+					interval(std::fmin(a.z(), std::fmin(b.z(), c.z())), std::fmax(a.z(), std::fmax(b.z(), c.z())))
+				);
+			}
+
+			tree.build(bounds);
+
+			reorder_triangles(indices, tree.prim_indices);
+			if (!normal_indices.empty()) reorder_triangles(normal_indices, tree.prim_indices);
+		}
+
+		bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+			triangle_hit closest;
+			if (!intersect<false>(r, ray_t, closest)) return false;
+
+			// Only the closest triangle needs a full hit record
+			const point3& p0 = vertices[indices[3 * closest.index]];
+			const point3& p1 = vertices[indices[3 * closest.index + 1]];
+			const point3& p2 = vertices[indices[3 * closest.index + 2]];
+
+			rec.t = closest.t;
+			rec.p = closest.u * p0 + closest.v * p1 + closest.w * p2;
+			rec.mat = mat;
+
+			// The barycentric interpolation is a handful of roundings of terms no larger than the vertices' own
+			rec.p_error = 0;
+			for (int axis = 0; axis < 3; axis++) {
+				real magnitude = std::fabs(closest.u * p0[axis]) + std::fabs(closest.v * p1[axis]) + std::fabs(closest.w * p2[axis]);
+				rec.p_error = std::fmax(rec.p_error, gamma_bound(7) * magnitude);
+			}
+
+			vec3 geometric_normal = unit_vector(cross(p1 - p0, p2 - p0));
+			rec.set_face_normal(r, geometric_normal);
+
+			// Interpolated normals only change the shading, turned to whichever side of the surface the ray hit
+			if (!normal_indices.empty() && normal_indices[3 * closest.index] != no_normal) {
+				vec3 shading_normal = unit_vector(
+					closest.u * normals[normal_indices[3 * closest.index]] +
+					closest.v * normals[normal_indices[3 * closest.index + 1]] +
+					closest.w * normals[normal_indices[3 * closest.index + 2]]
+				);
+				rec.normal = dot(shading_normal, geometric_normal) < 0 ? -shading_normal : shading_normal;
+				if (!rec.front_face) rec.normal = -rec.normal;
+			}
+
+			return true;
+		}
+
+		bool occluded(const ray& r, interval ray_t) const override {
+			triangle_hit found;
+			return intersect<true>(r, ray_t, found);
+		}
+
+		aabb bounding_box() const override { return tree.bounding_box(); }
+
+	private:
+		const material* mat;
+		shared_ptr<material> mat_owner;
+		bvh_tree tree;
+
+		// The triangle a ray hits, with its distance and barycentric coordinates
+		struct triangle_hit {
+			int index;
+			real t, u, v, w;
+		};
+
+		/*
+			Finds the closest triangle hit within ray_t, or with any_hit, whichever hit is found first. Only the
+			triangle and its barycentric coordinates are found: hit() builds a full record for the closest alone.
+		*/
+		template <bool any_hit>
+		bool intersect(const ray& r, interval ray_t, triangle_hit& found) const {
+			const point3& origin = r.origin();
+			const vec3& dir = r.direction();
+
+			// Permute the axes so the ray's largest direction component becomes z, keeping the winding the same
+			int kz = 0;
+			if (std::fabs(dir[1]) > std::fabs(dir[kz])) kz = 1;
+			if (std::fabs(dir[2]) > std::fabs(dir[kz])) kz = 2;
+			int kx = kz == 2 ? 0 : kz + 1;
+			int ky = kx == 2 ? 0 : kx + 1;
+			if (dir[kz] < 0) std::swap(kx, ky);
+
+			// Shear which maps the ray direction onto +z
+			const real sx = dir[kx] / dir[kz];
+			const real sy = dir[ky] / dir[kz];
+			const real sz = 1 / dir[kz];
+
+			auto intersect_leaf = [&](int first, int count, interval& t_range) {
+				STATS_ADD(triangle_tests, count);
+				bool hit_anything = false;
+
+				for (int k = first; k < first + count; k++) {
+					vec3 a = vertices[indices[3 * k]] - origin;
+					vec3 b = vertices[indices[3 * k + 1]] - origin;
+					vec3 c = vertices[indices[3 * k + 2]] - origin;
+
+					real ax = a[kx] - sx * a[kz], ay = a[ky] - sy * a[kz];
+					real bx = b[kx] - sx * b[kz], by = b[ky] - sy * b[kz];
+					real cx = c[kx] - sx * c[kz], cy = c[ky] - sy * c[kz];
+
+					// Scaled barycentric coordinates. The ray hits if they all have the same sign
+					real u = cx * by - cy * bx;
+					real v = ax * cy - ay * cx;
+					real w = bx * ay - by * ax;
+
+					// In single precision an edge function can round to exactly zero for a ray passing just beside the
+					// edge, so those are recomputed in double precision, as the paper does
+					if constexpr (sizeof(real) < sizeof(double)) {
+						if (u == 0 || v == 0 || w == 0) {
+							u = real(double(cx) * double(by) - double(cy) * double(bx));
+							v = real(double(ax) * double(cy) - double(ay) * double(cx));
+							w = real(double(bx) * double(ay) - double(by) * double(ax));
+						}
+					}
+
+					if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) continue;
+
+					real det = u + v + w;
+					if (det == 0) continue;
+
+					real t = (u * sz * a[kz] + v * sz * b[kz] + w * sz * c[kz]) / det;
+					if (!t_range.surrounds(t)) continue;
+
+					t_range.max = t;
+					found = { k, t, u / det, v / det, w / det };
+					hit_anything = true;
+					if constexpr (any_hit) break;
+				}
+
+				return hit_anything;
+			};
+
+			if constexpr (any_hit) return tree.traverse_any(r, ray_t, intersect_leaf);
+			else return tree.traverse(r, ray_t, intersect_leaf);
+		}
+
+		static void reorder_triangles(std::vector<uint32_t>& values, const std::vector<int>& order) {
+			std::vector<uint32_t> sorted(values.size());
+			for (size_t k = 0; k < order.size(); k++) {
+				for (int corner = 0; corner < 3; corner++) sorted[3 * k + corner] = values[3 * size_t(order[k]) + corner];
+			}
+			values = std::move(sorted);
+		}
+};
+
+#endif
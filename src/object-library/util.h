@@ -2,24 +2,132 @@
 #define UTIL_H
 
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
-#include <random>
 
 using std::make_shared;
 using std::shared_ptr;
 
+/*
+ * Scalar type of the geometry: vectors, rays, intervals, bounding boxes and the intersection tests.
+ *
+ * double by default. Building with RAYTRACER_FLOAT (the RAYTRACER_FLOAT CMake option) makes it float, which halves the
+ * size of scene data and doubles the lanes per SIMD instruction, at the cost of precision. Camera and material
+ * settings stay double either way, and so do the sums of many samples, which are kept as color_sum (see color.h).
+ */
+#ifdef RAYTRACER_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 
+/*
+ * Bound on the relative rounding error of n successive floating point operations on reals: the result of n
+ * operations lies within a factor (1 +- gamma_bound(n)) of the exact one (Higham, "Accuracy and Stability of
+ * Numerical Algorithms", 2002). Used to make geometric tests conservative.
+ */
+constexpr real gamma_bound(int n) {
+    constexpr real unit_roundoff = std::numeric_limits<real>::epsilon() / 2;
+    return (n * unit_roundoff) / (1 - n * unit_roundoff);
+}
+
 inline double degrees_to_radians(double degrees) {
 	return degrees * pi/180.0;
 }
 
+/*
+ * PCG32 random number generator (see pcg-random.org).
+ *
+ * Much cheaper than std::mt19937 through std::uniform_real_distribution: a single 64-bit multiply-add per output,
+ * with 16 bytes of state. Each (seed, stream) pair gives an independent sequence, which is what allows every pixel
+ * sample to get its own deterministic sequence regardless of which thread renders it.
+ */
+class pcg32 {
+    public:
+        pcg32(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL) {
+            this->seed(seed, stream);
+        }
+
+        void seed(uint64_t seed, uint64_t stream = 1) {
+            state = 0;
+            inc = (stream << 1) | 1;
+            next_uint();
+            state += seed;
+            next_uint();
+        }
+
+        uint32_t next_uint() {
+            uint64_t old = state;
+            state = old * 6364136223846793005ULL + inc;
+            uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+            uint32_t rot = uint32_t(old >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+        }
+
+        // Uniform double in [0, 1)
+        double next_double() {
+            return next_uint() * 0x1p-32;
+        }
+
+        uint64_t state;
+        uint64_t inc;
+};
+
+// Scrambles a 64-bit value (the splitmix64 finaliser). Used to derive well-mixed seeds from small integers
+inline uint64_t mix_bits(uint64_t v) {
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= v >> 33;
+    return v;
+}
+
+// The calling thread's random generator. Every thread starts from the same fixed seed, so results are reproducible
+inline pcg32& random_generator() {
+    thread_local static pcg32 generator;
+    return generator;
+}
+
+/*
+ * Values queued up for the next calls to random_double() on this thread, before it falls back to the generator.
+ *
+ * The camera's sampler fills this with well distributed values for the first few dimensions of each path (such as the
+ * first bounce direction), so materials benefit from stratification without needing to know about samplers.
+ *
+ * Light sampling draws from light_values instead, through random_light_double(). Lights are sampled at some vertices
+ * and not others, so taking from the shared queue would shift the values meant for a bounce direction onto the light.
+ */
+struct sample_stream {
+    static constexpr int capacity = 8;
+    static constexpr int light_capacity = 4;
+    double values[capacity];
+    double light_values[light_capacity];
+    int next = 0;
+    int count = 0;
+    int light_next = 0;
+    int light_count = 0;
+};
+
+inline sample_stream& thread_sample_stream() {
+    thread_local static sample_stream stream;
+    return stream;
+}
+
 inline double random_double() {
-    thread_local static std::mt19937 generator(std::random_device{}());
-    thread_local static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    return distribution(generator);
+    auto& stream = thread_sample_stream();
+    if (stream.next < stream.count) return stream.values[stream.next++];
+    return random_generator().next_double();
+}
+
+inline double random_light_double() {
+    auto& stream = thread_sample_stream();
+    if (stream.light_next < stream.light_count) return stream.light_values[stream.light_next++];
+    return random_generator().next_double();
 }
 
 inline double random_double(double min, double max) {
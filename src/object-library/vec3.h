@@ -18,17 +18,17 @@
 
 class vec3 {
 	public:
-		double e[3];
+		real e[3];
 		vec3() : e{0, 0, 0} {}
-		vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+		vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-		double x() const { return e[0]; }
-		double y() const { return e[1]; }
-		double z() const { return e[2]; }
+		real x() const { return e[0]; }
+		real y() const { return e[1]; }
+		real z() const { return e[2]; }
 
 		vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-		double operator[](int i) const { return e[i]; }
-		double& operator[](int i) { return e[i]; }
+		real operator[](int i) const { return e[i]; }
+		real& operator[](int i) { return e[i]; }
 
 		vec3& operator+=(const vec3& v) {
 			e[0] += v.e[0];
@@ -38,27 +38,27 @@ class vec3 {
 			return *this;
 		}
 
-		vec3& operator*=(double t) {
+		vec3& operator*=(real t) {
 			e[0] *= t;
 			e[1] *= t;
 			e[2] *= t;
 			return *this;
 		}
 
-		vec3& operator/=(double t) {
+		vec3& operator/=(real t) {
 			return *this *= 1/t;
 		}
 
-		double length() const {
+		real length() const {
 			return std::sqrt(length_squared());
 		}
 
-		double length_squared() const {
+		real length_squared() const {
 			return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
 		}
 
 		bool near_zero() const {
-		    auto s = 1e-8;
+		    real s = 1e-8;
 			return (std::fabs(e[0]) < s && std::fabs(e[1]) < s && std::fabs(e[2]) < s);
 		}
 
@@ -99,20 +99,20 @@ inline vec3 operator*(const vec3& u, const vec3& v) {
 	return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+inline vec3 operator*(const vec3& v, real t) {
 	return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v) {
+inline vec3 operator*(real t, const vec3& v) {
 	return v * t;
 }
 
-inline vec3 operator/(const vec3& v, double t) {
+inline vec3 operator/(const vec3& v, real t) {
 	return (1/t) * v;
 }
 
 
-inline double dot(const vec3& u, const vec3& v) {
+inline real dot(const vec3& u, const vec3& v) {
 	return u.e[0] * v.e[0]
 		+ u.e[1] * v.e[1]
 		+ u.e[2] * v.e[2];
@@ -131,27 +131,24 @@ inline vec3 unit_vector(const vec3& u) {
 }
 
 /*
-	Generates a unit random unit vector using the rejection algorithm as follows:
-
-	Generate a random vector within the unit square. If this vector falls within the unit circle enscribed in this unit
-	square, normalise it and return it, otherwise reject and generate a new one. This solution is easier to implement than other
-	analytical based solutions for the purposes of generating diffuse materials.
-
-	While not strictly necessary to reject all vectors outside of the unit circle, it ensures that the distribution
-	of random vectors is uniformly distributed. Using some basic math, it is found that each attempt has roughly 52% chance of
-	success, which is adequate for this purpose, and often faster than the analytical methods due to the simple mathematics required
+	Maps a point (u1, u2) of the unit square onto the unit sphere, preserving area: uniformly distributed inputs give
+	uniformly distributed directions.
 
+	z is picked uniformly in [-1, 1] (by Archimedes' hat-box theorem, equal slices of z cut equal areas of sphere), and
+	the angle around the z axis uniformly in [0, 2pi). Unlike rejection sampling this always takes exactly two random
+	numbers, so it works with stratified and low-discrepancy samples as well as with plain random ones.
 */
-inline vec3 random_unit_vector() {
-	while (true) {
-		auto p = vec3::random(-1, 1);
-		auto lensq = p.length_squared();
+inline vec3 sample_unit_vector(double u1, double u2) {
+	auto z = 1 - 2 * u1;
+	auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+	auto phi = 2 * pi * u2;
+	return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
 
-		// Reject values that are too small to avoid floating point issues
-		if (1e-160 < lensq && lensq <= 1) {
-			return p / sqrt(lensq);
-		}
-	}
+inline vec3 random_unit_vector() {
+	auto u1 = random_double();
+	auto u2 = random_double();
+	return sample_unit_vector(u1, u2);
 }
 
 /*
@@ -174,18 +171,38 @@ inline vec3 reflect(const vec3& v, const vec3& n) {
    return v - 2*dot(v, n)*n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-    auto cos_theta = std::fmin(dot(-uv, n), 1.0);
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
+    auto cos_theta = std::fmin(dot(-uv, n), real(1));
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta*n);
-    vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+    vec3 r_out_parallel = -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
+/*
+	Maps a point (u1, u2) of the unit square onto the unit disk (in the xy plane) with Shirley and Chiu's concentric
+	mapping. It preserves area, and keeps neighbouring points of the square close on the disk, so stratification of
+	the input survives the mapping.
+*/
+inline vec3 sample_unit_disk(double u1, double u2) {
+	auto a = 2 * u1 - 1;
+	auto b = 2 * u2 - 1;
+	if (a == 0 && b == 0) return vec3(0, 0, 0);
+
+	double r, theta;
+	if (std::fabs(a) > std::fabs(b)) {
+		r = a;
+		theta = (pi / 4) * (b / a);
+	} else {
+		r = b;
+		theta = (pi / 2) - (pi / 4) * (a / b);
+	}
+	return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
 inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1) return p;
-    }
+	auto u1 = random_double();
+	auto u2 = random_double();
+	return sample_unit_disk(u1, u2);
 }
 
 #endif
@@ -0,0 +1,155 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "hittable.h"
+#include "util.h"
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Storage for the camera's wavefront integrator (see camera::wavefront_render).
+ *
+ * A path_batch holds the state of every live path of a batch, and a hit_batch what each path's ray hit, as
+ * structure-of-arrays: each field of every path is stored contiguously, so that a stage touching only a few fields
+ * (such as building rays for the intersection stage) streams through just those, and loops over them can be
+ * vectorised.
+ *
+ * Paths are followed out of order, so each has its own random number state (the thread's generator and sample stream,
+ * see util.h), which is swapped in while the path is being shaded. Every path therefore draws exactly the numbers it
+ * would have drawn had it been traced on its own, depth first. The states are kept apart from the batch, one per
+ * sample, so that compacting the batch never moves them.
+ */
+
+struct path_random {
+    pcg32 generator;
+    sample_stream stream;
+
+    // Makes this the calling thread's random state. A stream's values never change once its sample has started, so
+    // only the ones still to be used are copied
+    void resume() const {
+        random_generator() = generator;
+        auto& current = thread_sample_stream();
+        current.next = stream.next;
+        current.count = stream.count;
+        for (int k = stream.next; k < stream.count; k++) current.values[k] = stream.values[k];
+        current.light_next = stream.light_next;
+        current.light_count = stream.light_count;
+        for (int k = stream.light_next; k < stream.light_count; k++) current.light_values[k] = stream.light_values[k];
+    }
+
+    // Takes the calling thread's random state back after resume()
+    void suspend() {
+        generator = random_generator();
+        stream.next = thread_sample_stream().next;
+        stream.light_next = thread_sample_stream().light_next;
+    }
+};
+
+class path_batch {
+    public:
+        std::vector<real> origin_x, origin_y, origin_z;
+        std::vector<real> dir_x, dir_y, dir_z;
+        std::vector<real> time;
+        std::vector<real> throughput_r, throughput_g, throughput_b;
+        std::vector<double> scatter_pdf;   // Density with which the path's last bounce was picked, see camera::direct_light
+        std::vector<uint32_t> slot;         // Index of the sample the path belongs to, where its result and random state are
+
+        size_t size() const { return slot.size(); }
+
+        void resize(size_t n) {
+            for (auto* field : { &origin_x, &origin_y, &origin_z, &dir_x, &dir_y, &dir_z, &time, &throughput_r, &throughput_g, &throughput_b }) {
+                field->resize(n);
+            }
+            scatter_pdf.resize(n);
+            slot.resize(n);
+        }
+
+        ray get_ray(size_t k) const {
+            return ray(point3(origin_x[k], origin_y[k], origin_z[k]), vec3(dir_x[k], dir_y[k], dir_z[k]), time[k]);
+        }
+
+        void set_ray(size_t k, const ray& r) {
+            origin_x[k] = r.origin().x();
+            origin_y[k] = r.origin().y();
+            origin_z[k] = r.origin().z();
+            dir_x[k] = r.direction().x();
+            dir_y[k] = r.direction().y();
+            dir_z[k] = r.direction().z();
+            time[k] = r.time();
+        }
+
+        color throughput(size_t k) const { return color(throughput_r[k], throughput_g[k], throughput_b[k]); }
+
+        void set_throughput(size_t k, const color& c) {
+            throughput_r[k] = c.x();
+            throughput_g[k] = c.y();
+            throughput_b[k] = c.z();
+        }
+
+        // Copies path from of this batch into path to of dst
+        void copy_path(path_batch& dst, size_t to, size_t from) const {
+            dst.origin_x[to] = origin_x[from];
+            dst.origin_y[to] = origin_y[from];
+            dst.origin_z[to] = origin_z[from];
+            dst.dir_x[to] = dir_x[from];
+            dst.dir_y[to] = dir_y[from];
+            dst.dir_z[to] = dir_z[from];
+            dst.time[to] = time[from];
+            dst.throughput_r[to] = throughput_r[from];
+            dst.throughput_g[to] = throughput_g[from];
+            dst.throughput_b[to] = throughput_b[from];
+            dst.scatter_pdf[to] = scatter_pdf[from];
+            dst.slot[to] = slot[from];
+        }
+};
+
+// The hit records of a batch's paths, for the fields shading needs
+class hit_batch {
+    public:
+        std::vector<real> t;
+        std::vector<real> p_x, p_y, p_z;
+        std::vector<real> normal_x, normal_y, normal_z;
+        std::vector<real> geometric_x, geometric_y, geometric_z;
+        std::vector<real> p_error;
+        std::vector<uint8_t> front_face;
+        std::vector<const material*> mat;
+
+        void resize(size_t n) {
+            for (auto* field : { &t, &p_x, &p_y, &p_z, &normal_x, &normal_y, &normal_z, &geometric_x, &geometric_y, &geometric_z, &p_error }) {
+                field->resize(n);
+            }
+            front_face.resize(n);
+            mat.resize(n);
+        }
+
+        void set(size_t k, const hit_record& rec) {
+            t[k] = rec.t;
+            p_x[k] = rec.p.x();
+            p_y[k] = rec.p.y();
+            p_z[k] = rec.p.z();
+            normal_x[k] = rec.normal.x();
+            normal_y[k] = rec.normal.y();
+            normal_z[k] = rec.normal.z();
+            geometric_x[k] = rec.geometric_normal.x();
+            geometric_y[k] = rec.geometric_normal.y();
+            geometric_z[k] = rec.geometric_normal.z();
+            p_error[k] = rec.p_error;
+            front_face[k] = rec.front_face;
+            mat[k] = rec.mat;
+        }
+
+        hit_record get(size_t k) const {
+            hit_record rec;
+            rec.t = t[k];
+            rec.p = point3(p_x[k], p_y[k], p_z[k]);
+            rec.normal = vec3(normal_x[k], normal_y[k], normal_z[k]);
+            rec.geometric_normal = vec3(geometric_x[k], geometric_y[k], geometric_z[k]);
+            rec.p_error = p_error[k];
+            rec.front_face = front_face[k] != 0;
+            rec.mat = mat[k];
+            return rec;
+        }
+};
+
+#endif